@@ -86,6 +86,8 @@ int main(int argc, char *argv[])
         MyHttpServer server(
                 bind_host, bind_port, 30, handlers, &theApp::instance(),
                 error_content_type, error_body);
+        setup_http_server(server, theApp::instance().cfg());
+        setup_http_client(theApp::instance().cfg());
         server.serve();
     }
     catch (const std::exception &ex) {
@@ -91,6 +91,13 @@ int main(int argc, char *argv[])
         MyHttpServer server(
                 bind_host, bind_port, 30, handlers, &theApp::instance(),
                 error_content_type, error_body);
+        setup_http_server(server, theApp::instance().cfg());
+        setup_http_client(theApp::instance().cfg());
+        setup_upstreams(theApp::instance().cfg());
+        // the KeyKeeper reads may be hedged, see Upstream/key_keeper2
+        IConfig &cfg = theApp::instance().cfg();
+        setup_upstream_target(cfg, "key_keeper2",
+                              cfg.get_value("KeyKeeper2/URL"));
         server.serve();
     }
     catch (const std::exception &ex) {
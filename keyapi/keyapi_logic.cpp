@@ -366,10 +366,10 @@ void KeyAPI::rehash_token(TokenizerConfig &tcfg, Domain::DataToken &data_token,
                           Domain::DataKey &data_key, int target_hmac_version)
 {
     auto master_key = tcfg.get_master_key(data_key.kek_version);
-    AESCrypter c1(master_key);
-    auto dek = c1.decrypt(decode_base64(data_key.dek_crypted));
-    AESCrypter c2(dek);
-    auto data = c2.decrypt(decode_base64(data_token.data_crypted));
+    auto dek = AESCrypter::for_key(master_key)->decrypt(
+            decode_base64(data_key.dek_crypted));
+    AESCrypter data_crypter(dek);
+    auto data = data_crypter.decrypt(decode_base64(data_token.data_crypted));
     auto new_hmac_key = tcfg.get_hmac_key(target_hmac_version);
     data_token.hmac_digest = Tokenizer::count_hmac(data, new_hmac_key);
     data_token.hmac_version = target_hmac_version;
@@ -419,10 +419,10 @@ void KeyAPI::reencrypt_dek(TokenizerConfig &tcfg, Domain::DataKey &data_key,
 {
     auto old_master_key = tcfg.get_master_key(data_key.kek_version);
     auto new_master_key = tcfg.get_master_key(target_kek_version);
-    AESCrypter c1(old_master_key);
-    auto dek = c1.decrypt(decode_base64(data_key.dek_crypted));
-    AESCrypter c2(new_master_key);
-    data_key.dek_crypted = encode_base64(c2.encrypt(dek));
+    auto dek = AESCrypter::for_key(old_master_key)->decrypt(
+            decode_base64(data_key.dek_crypted));
+    data_key.dek_crypted = encode_base64(
+            AESCrypter::for_key(new_master_key)->encrypt(dek));
     data_key.kek_version = target_kek_version;
 }
 
@@ -7,9 +7,6 @@
 #include <util/util_config.h>
 #if defined(YBUTIL_WINDOWS)
 #include <rpc.h>
-#else
-#include <unistd.h>
-#include <fcntl.h>
 #endif
 
 static const boost::regex id_fmt("\\w{1,40}");
@@ -27,14 +24,7 @@ Yb::LongInt _get_random()
     Yb::LongInt buf2 = (new_uuid.Data2 << 16) | new_uuid.Data3;
     buf += buf2;
 #else
-    int fd = open("/dev/urandom", O_RDONLY);
-    if (fd == -1)
-        throw ::RunTimeError("can't open /dev/urandom");
-    if (read(fd, &buf, sizeof(buf)) != sizeof(buf)) {
-        close(fd);
-        throw ::RunTimeError("can't read from /dev/urandom");
-    }
-    close(fd);
+    generate_random_bytes(&buf, sizeof(buf));
 #endif
     return buf;
 }
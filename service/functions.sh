@@ -255,6 +255,12 @@ servant_start () {
         chown "$CP_USER:$CP_USER" "$LOG_FILE"
     fi
 
+    # for HttpListener/UnixSocket: /var/run is emptied on reboot,
+    # so the directory is made on each start
+    mkdir -p "/var/run/$SERVANT"
+    chown "$CP_USER:$CP_USER" "/var/run/$SERVANT"
+    chmod 0755 "/var/run/$SERVANT"
+
     RESTARTER="/usr/bin/${SERVANT}-restarter"
     PINGER="/usr/bin/${SERVANT}-ping"
     SERVANT_BIN="/usr/bin/${SERVANT}"
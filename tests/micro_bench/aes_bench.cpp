@@ -0,0 +1,123 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+// Compares AESCrypter with the per-block AES_encrypt loop it replaced,
+// on the key and the vectors of the AES cases in core_tests.cpp:
+//
+//   card_proxy_aes_bench --iterations=1000000
+//
+// Each line is the way the tokenizer uses the crypter: once with a new
+// crypter per call, as for a DEK, once with the cached one from
+// AESCrypter::for_key, as for a KEK.
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <openssl/aes.h>
+#include "aes_crypter.h"
+#include "bench_utils.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// the implementation before EVP: both key schedules were expanded in
+// the constructor, then AES_encrypt was called per 16-byte block
+static const std::string legacy_encrypt(const std::string &key,
+                                        const std::string &input, int mode)
+{
+    AES_KEY encrypt_key, decrypt_key;
+    AES_set_encrypt_key((const unsigned char *)key.data(),
+                        AES_CRYPTER_KEY_SIZE, &encrypt_key);
+    AES_set_decrypt_key((const unsigned char *)key.data(),
+                        AES_CRYPTER_KEY_SIZE, &decrypt_key);
+    std::string result(input.size(), 0);
+    unsigned char iv[AES_CRYPTER_BLOCK_SIZE_BYTES];
+    memset(iv, 0, sizeof(iv));
+    for (size_t offs = 0; offs < input.size();
+            offs += AES_CRYPTER_BLOCK_SIZE_BYTES)
+    {
+        if (mode == AES_CRYPTER_CBC)
+            memxor(iv, input.data() + offs, AES_CRYPTER_BLOCK_SIZE_BYTES);
+        else
+            memcpy(iv, input.data() + offs, AES_CRYPTER_BLOCK_SIZE_BYTES);
+        AES_encrypt(iv, (unsigned char *)&result[offs], &encrypt_key);
+        if (mode == AES_CRYPTER_CBC)
+            memcpy(iv, &result[offs], AES_CRYPTER_BLOCK_SIZE_BYTES);
+    }
+    return result;
+}
+
+static const std::string fresh_encrypt(const std::string &key,
+                                       const std::string &input, int mode)
+{
+    AESCrypter crypter(key, mode);
+    return crypter.encrypt(input);
+}
+
+static const std::string cached_encrypt(const std::string &key,
+                                        const std::string &input, int mode)
+{
+    return AESCrypter::for_key(key, mode)->encrypt(input);
+}
+
+typedef const std::string (*EncryptFunc)(const std::string &key,
+                                         const std::string &input, int mode);
+
+static void run(const std::string &name, EncryptFunc func,
+                const std::string &key, const std::string &input, int mode,
+                int iterations, const std::string &expected)
+{
+    if (func(key, input, mode) != expected)
+        throw std::runtime_error(name + ": wrong cipher text");
+    size_t sink = 0;
+    Clock::time_point started = Clock::now();
+    for (int i = 0; i < iterations; ++i)
+        sink += func(key, input, mode)[0];
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - started).count() / (double)iterations;
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(8) << input.size() << std::setw(12)
+              << std::fixed << std::setprecision(1) << ns
+              << std::setw(12) << std::setprecision(1)
+              << input.size() * 1000.0 / ns << (sink? "": " ") << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions defaults;
+    defaults["iterations"] = "200000";
+    defaults["sizes"] = "16,32,4096";
+    try {
+        BenchOptions options = parse_bench_options(argc, argv, defaults);
+        int iterations = option_as_int(options, "iterations");
+        const std::string key = "12345678901234567890123456789012";
+        const char *modes[] = {"ecb", "cbc"};
+        std::vector<std::string> sizes = split_list(options["sizes"]);
+
+        std::cout << std::left << std::setw(24) << "case" << std::right
+                  << std::setw(8) << "bytes" << std::setw(12) << "ns/call"
+                  << std::setw(12) << "MB/s" << "\n";
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            int size = std::atoi(sizes[i].c_str());
+            std::string input;
+            while ((int)input.size() < size)
+                input += "ABCDEFGHIJKLMNOP";
+            input.resize(size / AES_CRYPTER_BLOCK_SIZE_BYTES
+                         * AES_CRYPTER_BLOCK_SIZE_BYTES);
+            for (int mode = AES_CRYPTER_ECB; mode <= AES_CRYPTER_CBC; ++mode) {
+                std::string expected = legacy_encrypt(key, input, mode);
+                std::string suffix = std::string(" ") + modes[mode];
+                run("legacy" + suffix, legacy_encrypt, key, input, mode,
+                    iterations, expected);
+                run("evp per call" + suffix, fresh_encrypt, key, input, mode,
+                    iterations, expected);
+                run("evp cached" + suffix, cached_encrypt, key, input, mode,
+                    iterations, expected);
+            }
+        }
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "exception: " << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,86 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "bench_utils.h"
+#include <cmath>
+#include <cstdlib>
+
+const BenchOptions parse_bench_options(int argc, char *argv[],
+                                       const BenchOptions &defaults)
+{
+    BenchOptions options = defaults;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") || eq == std::string::npos)
+            throw std::runtime_error("expected --name=value: " + arg);
+        std::string name = arg.substr(2, eq - 2);
+        if (!options.count(name))
+            throw std::runtime_error("unknown option: " + name);
+        options[name] = arg.substr(eq + 1);
+    }
+    return options;
+}
+
+int option_as_int(const BenchOptions &options, const std::string &name)
+{
+    const std::string &value = options.find(name)->second;
+    char *end = NULL;
+    long result = std::strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end)
+        throw std::runtime_error("not a number: --" + name + "=" + value);
+    return (int)result;
+}
+
+const std::vector<std::string> split_list(const std::string &s,
+                                          const char *separators)
+{
+    std::vector<std::string> result;
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t next = s.find_first_of(separators, pos);
+        if (next == std::string::npos)
+            next = s.size();
+        if (next > pos)
+            result.push_back(s.substr(pos, next - pos));
+        pos = next + 1;
+    }
+    return result;
+}
+
+BenchDistribution::BenchDistribution(const std::string &spec)
+    : kind_(FIXED), a_(0), b_(0)
+{
+    std::vector<std::string> parts = split_list(spec, ":");
+    std::vector<double> args;
+    for (size_t i = 1; i < parts.size(); ++i)
+        args.push_back(std::atof(parts[i].c_str()));
+    if (parts.size() == 1) {
+        a_ = std::atof(parts[0].c_str());
+        return;
+    }
+    if (parts[0] == "uniform" && args.size() == 2)
+        kind_ = UNIFORM;
+    else if (parts[0] == "exp" && args.size() == 1)
+        kind_ = EXP;
+    else if (parts[0] == "lognormal" && args.size() == 2)
+        kind_ = LOGNORMAL;
+    else
+        throw std::runtime_error("bad distribution: " + spec);
+    a_ = args[0];
+    b_ = args.size() > 1? args[1]: 0;
+}
+
+double BenchDistribution::next(std::mt19937 &rng)
+{
+    switch (kind_) {
+    case UNIFORM:
+        return std::uniform_real_distribution<double>(a_, b_)(rng);
+    case EXP:
+        return a_ > 0? std::exponential_distribution<double>(1 / a_)(rng): 0;
+    case LOGNORMAL:
+        return a_ > 0? std::lognormal_distribution<double>(
+                std::log(a_), b_)(rng): 0;
+    }
+    return a_;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,40 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__BENCH_UTILS_H
+#define CARD_PROXY__BENCH_UTILS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <stdexcept>
+
+// --name=value options, anything else is an error
+typedef std::map<std::string, std::string> BenchOptions;
+
+const BenchOptions parse_bench_options(int argc, char *argv[],
+                                       const BenchOptions &defaults);
+
+int option_as_int(const BenchOptions &options, const std::string &name);
+
+const std::vector<std::string> split_list(const std::string &s,
+                                          const char *separators = ",");
+
+// A random value drawn from one of:
+//   N              always N
+//   uniform:A:B    evenly between A and B
+//   exp:MEAN       exponential, a few values far above the mean
+//   lognormal:MEDIAN:SIGMA   heavy tail, as the real latencies have
+class BenchDistribution
+{
+public:
+    explicit BenchDistribution(const std::string &spec);
+    double next(std::mt19937 &rng);
+
+private:
+    enum { FIXED, UNIFORM, EXP, LOGNORMAL };
+    int kind_;
+    double a_, b_;
+};
+
+#endif // CARD_PROXY__BENCH_UTILS_H
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,223 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+// Runs the bind_card, start_payment and authorize flows against a running
+// tokenizer, keeping --concurrency requests in flight for --duration
+// seconds, and reports the throughput and the latency percentiles:
+//
+//   card_proxy_load_driver --url=http://127.0.0.1:17117 --concurrency=64
+//
+// The cards are the test ones, which a non-prod tokenizer doesn't store,
+// so with the stub gateway behind it's the proxy layer that is measured.
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include "http_client.h"
+#include "bench_utils.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct FlowStats
+{
+    std::string name;
+    HttpClientRequest request;
+    std::vector<int> latencies;     // usec
+    int errors;
+};
+
+class LoadDriver
+{
+public:
+    LoadDriver(HttpClientEngine &engine, std::vector<FlowStats> &flows,
+               Clock::time_point measure_from, Clock::time_point stop_at)
+        : engine_(engine), flows_(flows)
+        , measure_from_(measure_from), stop_at_(stop_at)
+        , next_flow_(0), in_flight_(0)
+    {}
+
+    void start(int concurrency)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mux_);
+            in_flight_ += concurrency;
+        }
+        for (int i = 0; i < concurrency; ++i)
+            send();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mux_);
+        while (in_flight_ > 0)
+            done_.wait(lock);
+    }
+
+private:
+    HttpClientEngine &engine_;
+    std::vector<FlowStats> &flows_;
+    Clock::time_point measure_from_, stop_at_;
+    size_t next_flow_;
+    int in_flight_;                 // the request chains still running
+    std::mutex mux_;
+    std::condition_variable done_;
+
+    void send()
+    {
+        size_t idx;
+        {
+            std::lock_guard<std::mutex> lock(mux_);
+            idx = next_flow_++ % flows_.size();
+        }
+        Clock::time_point started = Clock::now();
+        try {
+            submit(idx, started);
+        }
+        catch (const std::exception &ex) {
+            std::cerr << "exception: " << ex.what() << "\n";
+            std::lock_guard<std::mutex> lock(mux_);
+            if (!--in_flight_)
+                done_.notify_all();
+        }
+    }
+
+    void submit(size_t idx, Clock::time_point started)
+    {
+        // called on an engine thread, the next request is only posted
+        engine_.submit(flows_[idx].request,
+                [this, idx, started](HttpResponse &response,
+                                     const std::string &error) {
+            Clock::time_point now = Clock::now();
+            bool more = now < stop_at_;
+            {
+                std::lock_guard<std::mutex> lock(mux_);
+                if (started >= measure_from_ && now < stop_at_) {
+                    FlowStats &flow = flows_[idx];
+                    if (!error.empty() || response.resp_code() != 200)
+                        ++flow.errors;
+                    else
+                        flow.latencies.push_back((int)std::chrono::
+                                duration_cast<std::chrono::microseconds>(
+                                    now - started).count());
+                }
+                if (!more && !--in_flight_)
+                    done_.notify_all();
+            }
+            if (more)
+                send();
+        });
+    }
+};
+
+static const HttpClientRequest make_flow_request(const std::string &url,
+                                                 const std::string &flow)
+{
+    const std::string card =
+        "\"card_number\": \"4111111111111111\", \"cvn\": \"123\", "
+        "\"expiration_year\": \"2030\", \"expiration_month\": \"12\", "
+        "\"cardholder\": \"CARD HOLDER\"";
+    const std::string card_form =
+        "card_number=4111111111111111&cvn=123&expiration_year=2030"
+        "&expiration_month=12&cardholder=CARD+HOLDER";
+    HttpClientRequest request;
+    request.method = "POST";
+    request.timeout = 30;
+    if (flow == "bind_card") {
+        request.uri = url + "/incoming/bind_card";
+        request.headers["Content-Type"] = "application/json";
+        request.body = "{\"method\": \"bind_card\", \"params\": {" +
+            card + "}}";
+    }
+    else if (flow == "start_payment") {
+        request.uri = url + "/incoming/start_payment";
+        request.headers["Content-Type"] = "application/x-www-form-urlencoded";
+        request.body = card_form + "&amount=100&currency=RUB";
+    }
+    else if (flow == "authorize") {
+        request.uri = url + "/outgoing/authorize";
+        request.headers["Content-Type"] = "application/x-www-form-urlencoded";
+        request.body = "amount=100&currency=RUB&order_id=1";
+    }
+    else
+        throw std::runtime_error("unknown flow: " + flow);
+    return request;
+}
+
+static int percentile(const std::vector<int> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
+
+static const std::string fmt_msec(int usec)
+{
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2) << usec / 1000.0;
+    return out.str();
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions defaults;
+    defaults["url"] = "http://127.0.0.1:17117";
+    defaults["flows"] = "bind_card,start_payment,authorize";
+    defaults["concurrency"] = "32";
+    defaults["duration"] = "10";
+    defaults["warmup"] = "2";
+    defaults["threads"] = "2";
+    try {
+        BenchOptions options = parse_bench_options(argc, argv, defaults);
+        int concurrency = option_as_int(options, "concurrency");
+        int duration = option_as_int(options, "duration");
+        int warmup = option_as_int(options, "warmup");
+        std::vector<std::string> names = split_list(options["flows"]);
+        std::vector<FlowStats> flows(names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            flows[i].name = names[i];
+            flows[i].request = make_flow_request(options["url"], names[i]);
+            flows[i].errors = 0;
+        }
+        if (flows.empty())
+            throw std::runtime_error("no flows to run");
+
+        HttpClientEngine engine(option_as_int(options, "threads"),
+                                concurrency);
+        Clock::time_point measure_from = Clock::now() +
+            std::chrono::seconds(warmup);
+        Clock::time_point stop_at = measure_from +
+            std::chrono::seconds(duration);
+        LoadDriver driver(engine, flows, measure_from, stop_at);
+        driver.start(concurrency);
+        sleep(warmup + duration);
+        driver.wait();
+
+        std::cout << std::left << std::setw(16) << "flow"
+                  << std::right << std::setw(10) << "req/s"
+                  << std::setw(10) << "errors"
+                  << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+                  << std::setw(10) << "p999 ms" << "\n";
+        for (size_t i = 0; i < flows.size(); ++i) {
+            std::vector<int> &lat = flows[i].latencies;
+            std::sort(lat.begin(), lat.end());
+            std::cout << std::left << std::setw(16) << flows[i].name
+                      << std::right << std::setw(10)
+                      << (int)(lat.size() / (double)duration)
+                      << std::setw(10) << flows[i].errors
+                      << std::setw(10) << fmt_msec(percentile(lat, 50))
+                      << std::setw(10) << fmt_msec(percentile(lat, 99))
+                      << std::setw(10) << fmt_msec(percentile(lat, 99.9))
+                      << "\n";
+        }
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "exception: " << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
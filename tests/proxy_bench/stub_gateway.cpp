@@ -0,0 +1,78 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+// Stands for the processing gateway and the application server when the
+// tokenizer's proxy layer is benchmarked on a single box:
+//
+//   card_proxy_stub_gateway --port=18080 --latency=lognormal:5:0.5
+//
+// and point ProxyUrl/*_url of the tokenizer at http://127.0.0.1:18080/...
+// Each call is answered after a delay drawn from --latency (msec), with
+// a JSON body of --size bytes, see BenchDistribution for the syntax.
+#include <iostream>
+#include <unistd.h>
+#include "micro_http.h"
+#include "bench_utils.h"
+
+typedef const HttpResponse (*StubHandler)(const HttpRequest &request);
+
+static BenchDistribution *latency = NULL;
+static BenchDistribution *body_size = NULL;
+
+static const HttpResponse answer(const HttpRequest &request)
+{
+    // the workers draw from their own generators
+    static thread_local std::mt19937 rng(std::random_device{}());
+    int delay = (int)latency->next(rng);
+    int size = (int)body_size->next(rng);
+    if (delay > 0)
+        usleep(delay * 1000);
+    std::string body = "{\"status\": \"success\", \"data\": \"";
+    if (size > (int)body.size() + 3)
+        body += std::string(size - body.size() - 3, 'x');
+    body += "\"}";
+    HttpResponse response(HTTP_1_1, 200, _T("OK"));
+    response.set_response_body(body, _T("application/json"));
+    return response;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions defaults;
+    defaults["host"] = "127.0.0.1";
+    defaults["port"] = "18080";
+    defaults["latency"] = "0";
+    defaults["size"] = "200";
+    defaults["workers"] = "64";
+    defaults["paths"] = "/api/bind_card,/api/supply_payment_data,"
+        "/web/start_payment,/api/authorize,/api/status,/api/cancel,"
+        "/api/clear";
+    try {
+        BenchOptions options = parse_bench_options(argc, argv, defaults);
+        BenchDistribution latency_dist(options["latency"]);
+        BenchDistribution size_dist(options["size"]);
+        latency = &latency_dist;
+        body_size = &size_dist;
+
+        HttpServer<StubHandler>::HandlerMap handlers;
+        std::vector<std::string> paths = split_list(options["paths"]);
+        for (size_t i = 0; i < paths.size(); ++i)
+            handlers[WIDEN(paths[i])] = answer;
+        HttpServer<StubHandler> server(
+                options["host"], option_as_int(options, "port"), 128,
+                handlers, NULL, _T("application/json"),
+                "{\"status\": \"error\"}");
+        server.set_mode(HTTP_SERVER_EPOLL);
+        // the delays are slept on the workers
+        server.set_workers(option_as_int(options, "workers"));
+        server.set_keep_alive(60000, 1000000);
+        std::cerr << "stub gateway at http://" << options["host"] << ":"
+                  << options["port"] << "/\n";
+        server.serve();
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "exception: " << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
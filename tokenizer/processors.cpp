@@ -1,12 +1,13 @@
 // -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
 #include <sstream>
+#include <set>
 #include <boost/lexical_cast.hpp>
 
 #include "processors.h"
 #include "card_crypter.h"
 #include "app_class.h"
 #include "servant_utils.h"
-#include "json_object.h"
+#include "json_splicer.h"
 
 static const Yb::StringDict fix_inbound_params(Yb::ILogger &logger,
                                                const Yb::StringDict &params0)
@@ -59,44 +60,22 @@ static const Yb::StringDict fix_inbound_params(Yb::ILogger &logger,
     return params;
 }
 
-void json_extract_params(JsonObject &params_obj,
-                         Yb::StringDict &card_fields)
-{
-    // iterate all over object's elements
-    json_object_object_foreach(params_obj.get(), ckey, cval)
-    {
-        (void)cval;
-        const std::string key = ckey;
-        if (key == "card_number" || key == "cvn" ||
-                key == "expiration_year" || key == "expiration_month" ||
-                key == "cardholder")
-        {
-            card_fields[key] = params_obj.get_str_field(key);
-            params_obj.delete_field(key);
-        }
-    }
-}
-
 const std::string bind_card__fix_json(Yb::ILogger &logger,
                                       const std::string &body)
 {
-    JsonObject obj = JsonObject::parse(body);
-    JsonObject params_obj = obj.get_field("params");
-    Yb::StringDict card_fields;
-    json_extract_params(params_obj, card_fields);
+    static const std::set<std::string> card_field_names = {
+        "card_number", "cvn", "expiration_year", "expiration_month",
+        "cardholder",
+    };
+    // the card fields are cut out of params in a single pass,
+    // the rest of the body is forwarded byte for byte
+    JsonFieldSplicer splicer(body, "params", card_field_names);
 
     // perform the tokenization
-    Yb::StringDict new_card_fields = fix_inbound_params(logger, card_fields);
-
-    // fix JSON object to be forwarded
-    for (auto i = new_card_fields.begin(), iend = new_card_fields.end();
-            i != iend; ++i)
-    {
-        params_obj.add_str_field(i->first, i->second);
-    }
+    Yb::StringDict new_card_fields = fix_inbound_params(logger,
+                                                        splicer.fields());
 
-    // serialize
-    auto input_body_fixed =  obj.serialize();
+    auto input_body_fixed = splicer.splice(new_card_fields);
     logger.debug("fixed body: " + input_body_fixed);
     return input_body_fixed;
 }
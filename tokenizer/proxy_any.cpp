@@ -2,17 +2,18 @@
 #include "proxy_any.h"
 #include "app_class.h"
 #include "servant_utils.h"
+#include "upstream.h"
 #include <util/string_utils.h>
 
-const HttpHeaders convert_headers(const HttpRequest &req)
+const HttpHeaders convert_headers(const HttpRequest &req,
+                                  const std::set<Yb::String> &drop_headers)
 {
     HttpHeaders result;
     auto i = req.headers().begin(), iend = req.headers().end();
     for (; i != iend; ++i) {
-        const auto h_lower = Yb::StrUtils::str_to_lower(i->first);
-        if (h_lower == "host" || h_lower == "x-forwarded-for" || h_lower == "x-real-ip")
-            continue;
-        result[i->first] = i->second;
+        // the parser has normalized the names already
+        if (!drop_headers.count(i->first))
+            result[i->first] = i->second;
     }
     return result;
 }
@@ -28,7 +29,10 @@ void dump_nested_response(const HttpResponse &nested_response,
     for (; i != iend; ++i) {
         nest_logger->debug(i->first + ": " + i->second);
     }
-    nest_logger->debug("body: " + nested_response.body());
+    if (nested_response.body_stream())
+        nest_logger->debug("body: (streamed)");
+    else
+        nest_logger->debug("body: " + nested_response.body());
 }
 
 const HttpResponse convert_response(const HttpResponse &nested_response,
@@ -43,32 +47,63 @@ const HttpResponse convert_response(const HttpResponse &nested_response,
         if (i->first != "Transfer-Encoding")
             response.set_header(i->first, i->second);
     }
-    response.set_response_body(nested_response.body(), "");
+    // a streamed body keeps the upstream's Content-Length, if any
+    if (nested_response.body_stream())
+        response.set_body_stream(nested_response.body_stream());
+    else
+        response.set_response_body(nested_response.body(), "");
     return response;
 }
 
-const HttpResponse proxy_any(Yb::ILogger &logger,
-                             const HttpRequest &request,
-                             const std::string &target_uri,
-                             const std::string &client_cert,
-                             const std::string &client_privkey,
-                             BodyProcessor bproc,
-                             ParamsProcessor pproc)
+// the hedge's own latency counts, not the wait before it was sent
+static void release_hedge(UpstreamTarget &upstream, UpstreamCall &hedge,
+                          const HttpHedgeOutcome &outcome, bool ok,
+                          Yb::MilliSec now)
 {
-    logger.info("proxy pass to " + target_uri);
+    if (!outcome.hedged) {
+        upstream.cancel(hedge);
+        return;
+    }
+    hedge.started = outcome.hedge_started;
+    upstream.release(hedge, ok, now);
+}
 
-    bool ssl_validate = theApp::instance().is_prod();
+static const HttpResponse upstream_unavailable()
+{
+    HttpResponse response(HTTP_1_0, 503, "Service Unavailable");
+    response.set_response_body("{\"status\": \"upstream_unavailable\"}",
+                               "text/json");
+    return response;
+}
+
+static const HttpResponse deadline_exceeded()
+{
+    HttpResponse response(HTTP_1_0, 504, "Gateway Timeout");
+    response.set_response_body("{\"status\": \"deadline_exceeded\"}",
+                               "text/json");
+    return response;
+}
+
+// the service may well answer the next time, or another URI of it
+static bool is_retriable(int resp_code)
+{
+    return resp_code == 502 || resp_code == 503 || resp_code == 504;
+}
 
-    std::string target_uri_fixed = target_uri;
+const HttpResponse proxy_any(Yb::ILogger &logger,
+                             const HttpRequest &request,
+                             const ProxyRoute &route)
+{
+    std::string query;
     std::string body_fixed = request.body();
 
-    if (bproc != NULL) {
-        body_fixed = bproc(logger, body_fixed);
+    if (route.bproc != NULL) {
+        body_fixed = route.bproc(logger, body_fixed);
     }
-    else if (pproc != NULL) {
-        Yb::StringDict new_params = pproc(logger, request.params());
+    else if (route.pproc != NULL) {
+        Yb::StringDict new_params = route.pproc(logger, request.params());
         if (request.method() == "GET") {
-            target_uri_fixed += "?" + serialize_params(new_params);
+            query = "?" + serialize_params(new_params);
             body_fixed = "";
         }
         else {
@@ -76,19 +111,123 @@ const HttpResponse proxy_any(Yb::ILogger &logger,
         }
     }
 
-    HttpHeaders nested_req_headers = convert_headers(request);
-    HttpResponse resp = http_post(
-        target_uri_fixed,
-        &logger,
-        30.0,
-        request.method(),
-        nested_req_headers,
-        HttpParams(),
-        body_fixed,
-        ssl_validate,
-        client_cert,
-        client_privkey);
-    return convert_response(resp, logger);
+    // several URIs of the same service may be configured
+    const std::vector<std::string> &uris = route.uris;
+    UpstreamTargetPtr upstream = route.upstream;
+    const UpstreamSettings &settings = upstream->settings();
+    HttpHeaders nested_req_headers = convert_headers(request,
+                                                     route.drop_headers);
+    int retries = route.idempotent? settings.retries: 0;
+    for (int attempt = 0; ; ++attempt) {
+        Yb::MilliSec now = Yb::get_cur_time_millisec();
+        // what's left of the client's time caps the call
+        int timeout = settings.timeout;
+        if (request.deadline()) {
+            Yb::MilliSec left = request.deadline() - now;
+            if (left <= 0) {
+                logger.warning("no time left for the call: " +
+                               route.target_uri);
+                return deadline_exceeded();
+            }
+            // zero is no timeout, but the client's deadline still holds
+            if (!timeout || left < timeout)
+                timeout = (int)left;
+        }
+        if (timeout)
+            nested_req_headers[HTTP_TIMEOUT_HEADER] = Yb::to_string(timeout);
+        else
+            nested_req_headers.erase(HTTP_TIMEOUT_HEADER);
+        int connect_timeout = settings.connect_timeout;
+        if (timeout && connect_timeout > timeout)
+            connect_timeout = 0;
+
+        UpstreamCall call;
+        if (!upstream->acquire(now, call)) {
+            logger.warning("upstream is unavailable, failing fast: " +
+                           route.target_uri);
+            return upstream_unavailable();
+        }
+        std::string target_uri_fixed = uris[call.endpoint] + query;
+        logger.info("proxy pass to " + uris[call.endpoint]);
+        // the hedge's endpoint is held apart, whichever of them answers
+        // gets the result
+        HttpHedgePolicyPtr hedge_policy;
+        UpstreamCall hedge_call;
+        if (route.idempotent && upstream->hedge_policy() &&
+                upstream->acquire_hedge(call, now, hedge_call))
+            hedge_policy = upstream->hedge_policy();
+        HttpHedgeOutcome outcome;
+
+        bool may_retry = attempt < retries;
+        HttpResponse resp(HTTP_X, 0, "");
+        try {
+            if (hedge_policy)
+                resp = http_post_hedged(
+                    target_uri_fixed,
+                    uris[hedge_call.endpoint] + query,
+                    hedge_policy,
+                    &logger,
+                    timeout / 1000.0,
+                    request.method(),
+                    nested_req_headers,
+                    HttpParams(),
+                    body_fixed,
+                    route.ssl_validate,
+                    route.client_cert,
+                    route.client_privkey,
+                    false,
+                    FiltersMap(),
+                    route.http2,
+                    connect_timeout / 1000.0,
+                    &outcome);
+            else
+                resp = (route.stream_response? http_post_stream: http_post)(
+                    target_uri_fixed,
+                    &logger,
+                    timeout / 1000.0,
+                    request.method(),
+                    nested_req_headers,
+                    HttpParams(),
+                    body_fixed,
+                    route.ssl_validate,
+                    route.client_cert,
+                    route.client_privkey,
+                    false,
+                    FiltersMap(),
+                    route.http2,
+                    connect_timeout / 1000.0);
+        }
+        catch (const std::exception &ex) {
+            // both have failed if the hedge has been sent
+            Yb::MilliSec done = Yb::get_cur_time_millisec();
+            upstream->release(call, false, done);
+            if (hedge_policy)
+                release_hedge(*upstream, hedge_call, outcome, false, done);
+            if (!may_retry || !upstream->spend_retry())
+                throw;
+            logger.warning(std::string("retrying the call: ") + ex.what());
+            continue;
+        }
+        // for a streamed body that's the time to the head
+        bool ok = resp.resp_code() < 500;
+        Yb::MilliSec done = Yb::get_cur_time_millisec();
+        if (!hedge_policy)
+            upstream->release(call, ok, done);
+        else if (outcome.winner == 0) {
+            upstream->release(call, ok, done);
+            // the hedge, if sent, has been cancelled
+            upstream->cancel(hedge_call);
+        }
+        else {
+            upstream->cancel(call);
+            release_hedge(*upstream, hedge_call, outcome, ok, done);
+        }
+        if (ok || !may_retry || !is_retriable(resp.resp_code()) ||
+                !upstream->spend_retry())
+            return convert_response(resp, logger);
+        logger.warning("retrying the call after HTTP " +
+                       Yb::to_string(resp.resp_code()));
+    }
 }
 
 // vim:ts=4:sts=4:sw=4:et:
@@ -7,8 +7,10 @@
 #include "http_post.h"
 #include "micro_http.h"
 #include "processors.h"
+#include "proxy_routes.h"
 
-const HttpHeaders convert_headers(const HttpRequest &req);
+const HttpHeaders convert_headers(const HttpRequest &req,
+                                  const std::set<Yb::String> &drop_headers);
 
 void dump_nested_response(const HttpResponse &nested_response,
                           Yb::ILogger &logger);
@@ -16,13 +18,20 @@ void dump_nested_response(const HttpResponse &nested_response,
 const HttpResponse convert_response(const HttpResponse &nested_response,
                                     Yb::ILogger &logger);
 
+
+// The route's URIs are of the same service: the calls are balanced
+// between them, and they fail fast with 503 while the service looks
+// broken, see UpstreamTarget.  With stream_response the upstream's
+// body is passed to the client as it arrives, not buffered, for the
+// handlers which don't look at it.  The call is limited by the target's
+// timeout and the request's deadline, with 504 if there's no time left.
+// An idempotent call is retried on a failure within the target's retry
+// budget, and a late one is repeated to another URI if
+// Upstream/HedgePercentile is set, the body is buffered then.
+// Nothing is read from the config here, see ProxyRouteTable.
 const HttpResponse proxy_any(Yb::ILogger &logger,
                              const HttpRequest &request,
-                             const std::string &target_uri,
-                             const std::string &client_cert = "",
-                             const std::string &client_privkey = "",
-                             BodyProcessor bproc = NULL,
-                             ParamsProcessor pproc = NULL);
+                             const ProxyRoute &route);
 
 #endif // CARD_PROXY__PROXY_ANY_H
 // vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,145 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "proxy_routes.h"
+#include "proxy_any.h"
+#include "app_class.h"
+#include "utils.h"
+#include <cstring>
+
+static const struct {
+    const char *name;
+    const char *url_key;
+    const char *suffix;         // replaced with "/" + name, if any
+    bool client_cert;           // ProxyUrl/<url_key>_cert and _key
+    BodyProcessor bproc;
+    ParamsProcessor pproc;
+    bool stream_response;
+    bool idempotent;
+} ROUTE_DEFS[] = {
+    { "bind_card", "bind_card_url", NULL, false,
+        bind_card__fix_json, NULL, false, false },
+    { "supply_payment_data", "bind_card_url", "/bind_card", false,
+        bind_card__fix_json, NULL, false, false },
+    { "start_payment", "start_payment_url", NULL, false,
+        NULL, start_payment__fix_params, false, false },
+    { "authorize", "authorize_url", NULL, true,
+        NULL, authorize__fix_params, true, false },
+    // it's only a lookup, so it may be asked again
+    { "status", "authorize_url", "/authorize", true,
+        NULL, NULL, true, true },
+    { "cancel", "authorize_url", "/authorize", true,
+        NULL, NULL, true, false },
+    { "clear", "authorize_url", "/authorize", true,
+        NULL, NULL, true, false },
+};
+
+ProxyRoutePtr new_proxy_route(IConfig &cfg,
+                              const std::string &name,
+                              const std::string &upstream_name,
+                              const std::string &target_uri,
+                              const std::string &client_cert,
+                              const std::string &client_privkey,
+                              BodyProcessor bproc,
+                              ParamsProcessor pproc,
+                              bool stream_response,
+                              bool idempotent)
+{
+    Yb::SharedPtr<ProxyRoute>::Type route(new ProxyRoute());
+    route->name = name;
+    route->target_uri = target_uri;
+    route->uris = UpstreamRegistry::split_uris(target_uri);
+    route->client_cert = client_cert;
+    route->client_privkey = client_privkey;
+    route->ssl_validate = theApp::instance().is_prod();
+    // the gateway calls of all the workers share a few connections
+    route->http2 = cfg.has_key("ProxyUrl/http2") &&
+        cfg.get_value_as_bool("ProxyUrl/http2");
+    route->bproc = bproc;
+    route->pproc = pproc;
+    route->stream_response = stream_response;
+    route->idempotent = idempotent;
+    route->upstream = UpstreamRegistry::instance().get(upstream_name,
+                                                       route->uris);
+    route->drop_headers.insert(_T("Host"));
+    route->drop_headers.insert(_T("X-Forwarded-For"));
+    route->drop_headers.insert(_T("X-Real-Ip"));
+    return route;
+}
+
+ProxyRouteTable &
+ProxyRouteTable::instance()
+{
+    static ProxyRouteTable table;
+    return table;
+}
+
+ProxyRouteTable::ProxyRouteTable()
+    : generation_(-1)
+{}
+
+ProxyRouteTable::RoutesPtr
+ProxyRouteTable::build(IConfig &cfg)
+{
+    Yb::SharedPtr<Routes>::Type routes(new Routes());
+    for (size_t i = 0; i < sizeof(ROUTE_DEFS) / sizeof(ROUTE_DEFS[0]); ++i) {
+        const std::string url_key = std::string("ProxyUrl/") +
+            ROUTE_DEFS[i].url_key;
+        // the routes derived from one URL are calls to one target,
+        // named as in setup_upstream_target(): bind_card_url -> bind_card
+        const std::string upstream_name = std::string(ROUTE_DEFS[i].url_key,
+                strlen(ROUTE_DEFS[i].url_key) - strlen("_url"));
+        if (!cfg.has_key(url_key))
+            continue;
+        std::string uri = cfg.get_value(url_key);
+        if (ROUTE_DEFS[i].suffix) {
+            // a misconfigured derived route is left out, not the others
+            try {
+                uri = UpstreamRegistry::replace_uri_suffix(
+                        uri, ROUTE_DEFS[i].suffix,
+                        std::string("/") + ROUTE_DEFS[i].name);
+            }
+            catch (const ::RunTimeError &ex) {
+                Yb::ILogger::Ptr logger(
+                        theApp::instance().new_logger("proxy_routes"));
+                logger->error(std::string("route ") + ROUTE_DEFS[i].name
+                              + " is not available: " + ex.what());
+                continue;
+            }
+        }
+        std::string cert, key;
+        if (ROUTE_DEFS[i].client_cert) {
+            cert = cfg.get_value(url_key + "_cert");
+            key = cfg.get_value(url_key + "_key");
+        }
+        (*routes)[ROUTE_DEFS[i].name] = new_proxy_route(
+                cfg, ROUTE_DEFS[i].name, upstream_name, uri, cert, key,
+                ROUTE_DEFS[i].bproc, ROUTE_DEFS[i].pproc,
+                ROUTE_DEFS[i].stream_response, ROUTE_DEFS[i].idempotent);
+    }
+    return routes;
+}
+
+ProxyRoutePtr
+ProxyRouteTable::get(const std::string &name)
+{
+    return get(theApp::instance().cfg(), name);
+}
+
+ProxyRoutePtr
+ProxyRouteTable::get(IConfig &cfg, const std::string &name)
+{
+    int generation = cfg.generation();
+    if (generation_ != generation) {
+        Yb::ScopedLock lock(mux_);
+        if (generation_ != generation) {
+            std::atomic_store(&routes_, build(cfg));
+            generation_ = generation;
+        }
+    }
+    RoutesPtr routes = std::atomic_load(&routes_);
+    Routes::const_iterator i = routes->find(name);
+    if (routes->end() == i)
+        throw ::RunTimeError("no route configured: " + name);
+    return i->second;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,76 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__PROXY_ROUTES_H
+#define CARD_PROXY__PROXY_ROUTES_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <atomic>
+#include <util/data_types.h>
+#include <util/thread.h>
+
+#include "conf_reader.h"
+#include "processors.h"
+#include "upstream.h"
+
+// Everything a proxied call needs to know before the request comes
+struct ProxyRoute
+{
+    std::string name;
+    std::string target_uri;             // as configured, for the logs
+    std::vector<std::string> uris;      // of the same service
+    std::string client_cert;
+    std::string client_privkey;
+    bool ssl_validate;
+    bool http2;
+    BodyProcessor bproc;
+    ParamsProcessor pproc;
+    bool stream_response;
+    bool idempotent;
+    UpstreamTargetPtr upstream;
+    // the request headers not passed on, by their normalized names
+    std::set<Yb::String> drop_headers;
+};
+
+typedef Yb::SharedPtr<const ProxyRoute>::Type ProxyRoutePtr;
+
+// Resolves the route for the given target URIs, the upstream target
+// is shared by the routes of the same upstream_name
+ProxyRoutePtr new_proxy_route(IConfig &cfg,
+                              const std::string &name,
+                              const std::string &upstream_name,
+                              const std::string &target_uri,
+                              const std::string &client_cert,
+                              const std::string &client_privkey,
+                              BodyProcessor bproc,
+                              ParamsProcessor pproc,
+                              bool stream_response,
+                              bool idempotent);
+
+// The routes of the proxied calls by their handler names, built from
+// ProxyUrl/* on the first use and again after each config reload, so
+// that the calls don't read the config themselves
+class ProxyRouteTable
+{
+public:
+    static ProxyRouteTable &instance();
+
+    ProxyRouteTable();
+    // throws RunTimeError for a route which is not configured
+    ProxyRoutePtr get(const std::string &name);
+    ProxyRoutePtr get(IConfig &cfg, const std::string &name);
+
+private:
+    typedef std::map<std::string, ProxyRoutePtr> Routes;
+    typedef Yb::SharedPtr<const Routes>::Type RoutesPtr;
+
+    Yb::Mutex mux_;                     // one rebuild at a time
+    std::atomic<int> generation_;
+    RoutesPtr routes_;
+
+    static RoutesPtr build(IConfig &cfg);
+};
+
+#endif // CARD_PROXY__PROXY_ROUTES_H
+// vim:ts=4:sts=4:sw=4:et:
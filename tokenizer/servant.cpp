@@ -47,6 +47,18 @@ inline int run_server_app(const std::string &config_name,
         MyHttpServer server(
                 bind_host, bind_port, 30, handlers, &theApp::instance(),
                 error_content_type, error_body);
+        setup_http_server(server, theApp::instance().cfg());
+        setup_http_client(theApp::instance().cfg());
+        setup_upstreams(theApp::instance().cfg());
+        // the other processing API calls go to the authorize target
+        IConfig &cfg = theApp::instance().cfg();
+        const char *targets[] = { "bind_card", "start_payment", "authorize" };
+        for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i)
+            setup_upstream_target(cfg, targets[i], cfg.get_value(
+                        std::string("ProxyUrl/") + targets[i] + "_url"));
+        // the KeyKeeper reads may be hedged, see Upstream/key_keeper2
+        setup_upstream_target(cfg, "key_keeper2",
+                              cfg.get_value("KeyKeeper2/URL"));
         server.serve();
     }
     catch (const std::exception &ex) {
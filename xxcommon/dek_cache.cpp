@@ -0,0 +1,135 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+
+#include "dek_cache.h"
+#include "utils.h"
+
+DEKCache::DEKCache(int capacity, int ttl)
+    : ttl_((Yb::MilliSec)ttl * 1000)
+    , slots_(capacity > 0? capacity: 0)
+    , keys_(NULL)
+    , keys_size_(0)
+    , locked_(false)
+{
+    if (slots_.empty())
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    keys_size_ = (slots_.size() * DEK_CACHE_KEY_SIZE + page - 1)
+        / page * page;
+    void *p = mmap(NULL, keys_size_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw RunTimeError("can't allocate the DEK cache");
+    keys_ = (char *)p;
+    // an mlock over RLIMIT_MEMLOCK fails, the cache still works then,
+    // see is_locked()
+    locked_ = mlock(keys_, keys_size_) == 0;
+#ifdef MADV_DONTDUMP
+    madvise(keys_, keys_size_, MADV_DONTDUMP);
+#endif
+    free_.reserve(slots_.size());
+    for (size_t i = slots_.size(); i > 0; --i) {
+        slots_[i - 1].used = false;
+        free_.push_back(i - 1);
+    }
+}
+
+DEKCache::~DEKCache()
+{
+    if (!keys_)
+        return;
+    OPENSSL_cleanse(keys_, keys_size_);
+    if (locked_)
+        munlock(keys_, keys_size_);
+    munmap(keys_, keys_size_);
+}
+
+bool DEKCache::get(Yb::LongInt dek_id, int kek_version,
+                   const std::string &dek_crypted, std::string &dek)
+{
+    if (slots_.empty())
+        return false;
+    Yb::ScopedLock lock(mux_);
+    auto it = index_.find(SlotKey(dek_id, kek_version));
+    if (it == index_.end())
+        return false;
+    size_t i = it->second;
+    if (slots_[i].expires_at <= Yb::get_cur_time_millisec() ||
+            slots_[i].dek_crypted != dek_crypted)
+    {
+        erase(i);
+        return false;
+    }
+    dek.assign(keys_ + i * DEK_CACHE_KEY_SIZE, DEK_CACHE_KEY_SIZE);
+    return true;
+}
+
+void DEKCache::put(Yb::LongInt dek_id, int kek_version,
+                   const std::string &dek_crypted, const std::string &dek)
+{
+    if (slots_.empty() || dek.size() != DEK_CACHE_KEY_SIZE)
+        return;
+    Yb::ScopedLock lock(mux_);
+    Yb::MilliSec now = Yb::get_cur_time_millisec();
+    SlotKey key(dek_id, kek_version);
+    auto it = index_.find(key);
+    size_t i = it != index_.end()? it->second: pick_slot();
+    Slot &slot = slots_[i];
+    if (slot.used)
+        order_.erase(slot.pos);
+    slot.dek_id = dek_id;
+    slot.kek_version = kek_version;
+    slot.dek_crypted = dek_crypted;
+    slot.expires_at = now + ttl_;
+    slot.used = true;
+    slot.pos = order_.insert(order_.end(), i);
+    memcpy(keys_ + i * DEK_CACHE_KEY_SIZE, dek.data(), DEK_CACHE_KEY_SIZE);
+    index_[key] = i;
+}
+
+void DEKCache::invalidate_kek(int kek_version)
+{
+    Yb::ScopedLock lock(mux_);
+    for (size_t i = 0; i < slots_.size(); ++i)
+        if (slots_[i].used && slots_[i].kek_version == kek_version)
+            erase(i);
+}
+
+void DEKCache::clear()
+{
+    Yb::ScopedLock lock(mux_);
+    for (size_t i = 0; i < slots_.size(); ++i)
+        if (slots_[i].used)
+            erase(i);
+}
+
+size_t DEKCache::size() const
+{
+    Yb::ScopedLock lock(mux_);
+    return index_.size();
+}
+
+void DEKCache::erase(size_t i)
+{
+    Slot &slot = slots_[i];
+    OPENSSL_cleanse(keys_ + i * DEK_CACHE_KEY_SIZE, DEK_CACHE_KEY_SIZE);
+    index_.erase(SlotKey(slot.dek_id, slot.kek_version));
+    order_.erase(slot.pos);
+    slot.used = false;
+    free_.push_back(i);
+}
+
+size_t DEKCache::pick_slot()
+{
+    // a free slot, else the one to expire first, expired or not
+    if (free_.empty())
+        erase(order_.front());
+    size_t i = free_.back();
+    free_.pop_back();
+    return i;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
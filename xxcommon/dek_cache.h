@@ -0,0 +1,78 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__DEK_CACHE_H
+#define CARD_PROXY__DEK_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <util/data_types.h>
+#include <util/thread.h>
+
+#define DEK_CACHE_SIZE 1024
+#define DEK_CACHE_TTL 300
+#define DEK_CACHE_KEY_SIZE 32
+
+// Decrypted DEKs by DEK id and KEK version.  The key bytes live in
+// a region locked in RAM and excluded from core dumps, and are wiped
+// when an entry expires, gets evicted or invalidated.
+// This is the only place a plaintext DEK is kept between calls.
+// Within a call it is still copied to ordinary heap, not wiped on
+// free: the std::string returned by get() and Tokenizer::get_dek(),
+// the new DEK in DEKPool::generate_new_data_key() until it's
+// encrypted, and the DEKs decrypted by keyapi on rehashing.  The
+// EVP key schedule of the per-call AESCrypter is wiped when freed.
+class DEKCache
+{
+public:
+    // capacity 0 turns the cache off, ttl is in seconds
+    DEKCache(int capacity, int ttl);
+    ~DEKCache();
+
+    // dek_crypted is checked as well, so a DEK that has been
+    // re-encrypted with another KEK since is a miss
+    bool get(Yb::LongInt dek_id, int kek_version,
+             const std::string &dek_crypted, std::string &dek);
+    void put(Yb::LongInt dek_id, int kek_version,
+             const std::string &dek_crypted, const std::string &dek);
+
+    void invalidate_kek(int kek_version);
+    void clear();
+
+    size_t size() const;
+    bool is_locked() const { return locked_; }
+
+private:
+    struct Slot
+    {
+        Yb::LongInt dek_id;
+        int kek_version;
+        std::string dek_crypted;
+        Yb::MilliSec expires_at;
+        bool used;
+        std::list<size_t>::iterator pos;    // in order_ while used
+    };
+    typedef std::pair<Yb::LongInt, int> SlotKey;
+
+    mutable Yb::Mutex mux_;
+    Yb::MilliSec ttl_;
+    std::vector<Slot> slots_;
+    std::map<SlotKey, size_t> index_;
+    // the TTL is the same for all, so the used slots ordered by
+    // the time they were stored are ordered by expiry too
+    std::list<size_t> order_;
+    std::vector<size_t> free_;
+    char *keys_;                    // DEK_CACHE_KEY_SIZE bytes per slot
+    size_t keys_size_;
+    bool locked_;
+
+    // non-copyable
+    DEKCache(const DEKCache &);
+    DEKCache &operator=(const DEKCache &);
+
+    void erase(size_t i);
+    size_t pick_slot();
+};
+
+#endif // CARD_PROXY__DEK_CACHE_H
+// vim:ts=4:sts=4:sw=4:et:
@@ -98,8 +98,8 @@ void DEKPool::generate_enough_deks() {
 Domain::DataKey DEKPool::generate_new_data_key(bool is_hmac) {
     Domain::DataKey data_key;
     std::string dek_value = generate_random_bytes(32);
-    AESCrypter aes_crypter(master_key_);
-    std::string encoded_dek = encode_base64(aes_crypter.encrypt(dek_value));
+    std::string encoded_dek = encode_base64(
+            AESCrypter::for_key(master_key_)->encrypt(dek_value));
     data_key.start_ts = Yb::now();
     if (is_hmac) {
         data_key.finish_ts = Yb::dt_add_seconds(data_key.start_ts,
@@ -3,16 +3,24 @@
 #include <iostream>
 #include <utility>
 #include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <util/string_utils.h>
 
 #include "catch.hpp"
 
 #include "aes_crypter.h"
 #include "utils.h"
+#include "http_parser.h"
+#include "timer_wheel.h"
+#include "upstream.h"
 #include "app_class.h"
 #include "json_object.h"
+#include "json_splicer.h"
 
 #include "card_crypter.h"
+#include "dek_cache.h"
 
 #define B64_TESTS       50
 #define BCD_TESTS       50
@@ -142,6 +150,77 @@ TEST_CASE( "Testing BASE64 random strings", "[base64]" ) {
 }
 
 
+TEST_CASE( "Testing BASE64 against OpenSSL", "[base64]" ) {
+    for (int len = 0; len <= 100; ++len) {
+        std::string data = generate_random_bytes(len);
+        std::string expected(((len + 2) / 3) * 4 + 1, 0);
+        int n = EVP_EncodeBlock((unsigned char *)&expected[0],
+                                (const unsigned char *)data.data(), len);
+        expected.resize(n);
+        CHECK( expected == encode_base64(data) );
+        CHECK( data == decode_base64(expected) );
+    }
+}
+
+static const std::string base64_error(const std::string &b64message)
+{
+    try {
+        decode_base64(b64message);
+    }
+    catch (const std::exception &e) {
+        return e.what();
+    }
+    return "";
+}
+
+TEST_CASE( "Testing BASE64 errors", "[base64]" ) {
+    CHECK( std::string::npos != base64_error("QUJ").find(
+                "BASE64 data of wrong size") );
+    const char *invalid[] = {"QU I", "QUJ-", "Q\xff==", "QUJDRA\n="};
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); ++i)
+        CHECK( std::string::npos != base64_error(invalid[i]).find(
+                    "Invalid BASE64 character") );
+    const char *misplaced[] = {"====", "Q===", "QU=I", "Q=I=", "QQ==QUJD"};
+    for (size_t i = 0; i < sizeof(misplaced)/sizeof(misplaced[0]); ++i)
+        CHECK( std::string::npos != base64_error(misplaced[i]).find(
+                    "Misplaced trailing =") );
+}
+
+TEST_CASE( "Testing random bytes", "[random]" ) {
+    SECTION( "sizes and pool refills" ) {
+        std::set<std::string> seen;
+        size_t sizes[] = {1, 16, 32, RANDOM_POOL_SIZE / 4,
+                          RANDOM_POOL_SIZE / 4 + 1, RANDOM_POOL_SIZE * 2};
+        for (int round = 0; round < 20; ++round)
+            for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+                std::string r = generate_random_bytes(sizes[i]);
+                REQUIRE( sizes[i] == r.size() );
+                if (sizes[i] >= 16)
+                    CHECK( seen.insert(r).second );
+            }
+    }
+    SECTION( "forked child gets other bytes" ) {
+        generate_random_bytes(16);  // the pool is filled
+        int fds[2];
+        REQUIRE( 0 == pipe(fds) );
+        pid_t pid = fork();
+        REQUIRE( pid >= 0 );
+        if (!pid) {
+            std::string r = generate_random_bytes(32);
+            _exit(write(fds[1], r.data(), r.size()) == (ssize_t)r.size()?
+                  0: 1);
+        }
+        std::string parent = generate_random_bytes(32);
+        std::string child(32, 0);
+        CHECK( 32 == read(fds[0], &child[0], child.size()) );
+        int status = 0;
+        waitpid(pid, &status, 0);
+        close(fds[0]);
+        close(fds[1]);
+        CHECK( parent != child );
+    }
+}
+
 TEST_CASE( "Testing BCD encoder output size", "[bcd]" ) {
     CHECK( 4 == std::string(8, 0).substr(1, 4).size() );
     CHECK( 16 == bcd_encode("1234567890123456").size() );
@@ -384,6 +463,88 @@ TEST_CASE( "Testing AES errors", "[aes]") {
     CHECK_THROWS( aes_crypter.encrypt("ABCDEFGHIJKL") );
 }
 
+TEST_CASE( "Testing cached AES crypters", "[aes]") {
+    std::string key = "12345678901234567890123456789012";
+    std::string key2 = "abcdefghijklmnopqrstuvwxyz012345";
+    AESCrypterPtr ecb = AESCrypter::for_key(key);
+    CHECK(ecb.get() == AESCrypter::for_key(key, AES_CRYPTER_ECB).get());
+    AESCrypterPtr cbc = AESCrypter::for_key(key, AES_CRYPTER_CBC);
+    CHECK(ecb.get() != cbc.get());
+    CHECK(ecb.get() != AESCrypter::for_key(key2).get());
+    CHECK_THROWS( AESCrypter::for_key("1234") );
+
+    std::string plain = "ABCDEFGHIJKLMNOPABCDEFGHIJKLMNOP";
+    // each call starts from the zero IV again
+    for (int i = 0; i < 2; ++i) {
+        CHECK("08 7F B2 43 85 52 94 E2 00 2D B9 59 B4 D8 95 27 "
+              "B3 0A 93 0E C3 7E B0 7A 79 26 F7 82 5C D8 80 9F" ==
+              string_to_hexstring(cbc->encrypt(plain)));
+        CHECK(plain == AESCrypter::for_key(key, AES_CRYPTER_CBC)->decrypt(
+                    cbc->encrypt(plain)));
+    }
+
+    // an evicted crypter stays usable by its holders
+    for (int i = 0; i < AES_CRYPTER_CACHE_SIZE; ++i)
+        AESCrypter::for_key(generate_random_string(32));
+    CHECK(ecb.get() != AESCrypter::for_key(key).get());
+    CHECK(plain == ecb->decrypt(ecb->encrypt(plain)));
+}
+
+TEST_CASE( "Testing DEK cache", "[dek_cache]") {
+    std::string dek1(32, 'a'), dek2(32, 'b'), dek;
+    SECTION( "get and put" ) {
+        DEKCache cache(2, 60);
+        CHECK( !cache.get(1, 1, "c1", dek) );
+        cache.put(1, 1, "c1", dek1);
+        cache.put(2, 1, "c2", dek2);
+        CHECK( cache.get(1, 1, "c1", dek) );
+        CHECK( dek1 == dek );
+        CHECK( !cache.get(1, 2, "c1", dek) );
+        // re-encrypted since
+        CHECK( !cache.get(2, 1, "c2new", dek) );
+        CHECK( 1 == cache.size() );
+        cache.put(2, 1, "c2", dek2);
+        cache.put(3, 2, "c3", dek1);
+        CHECK( 2 == cache.size() );
+        CHECK( !cache.get(1, 1, "c1", dek) );
+        CHECK( cache.get(2, 1, "c2", dek) );
+        CHECK( dek2 == dek );
+        cache.invalidate_kek(1);
+        CHECK( !cache.get(2, 1, "c2", dek) );
+        CHECK( cache.get(3, 2, "c3", dek) );
+        cache.clear();
+        CHECK( 0 == cache.size() );
+    }
+    SECTION( "eviction order" ) {
+        DEKCache cache(2, 60);
+        cache.put(1, 1, "c1", dek1);
+        cache.put(2, 1, "c2", dek2);
+        // storing it again makes it the last to expire
+        cache.put(1, 1, "c1", dek1);
+        cache.put(3, 1, "c3", dek2);
+        CHECK( cache.get(1, 1, "c1", dek) );
+        CHECK( !cache.get(2, 1, "c2", dek) );
+        CHECK( cache.get(3, 1, "c3", dek) );
+        // a freed slot is taken before anything is evicted
+        cache.invalidate_kek(1);
+        cache.put(4, 2, "c4", dek1);
+        cache.put(5, 2, "c5", dek2);
+        CHECK( cache.get(4, 2, "c4", dek) );
+        CHECK( cache.get(5, 2, "c5", dek) );
+    }
+    SECTION( "expiration" ) {
+        DEKCache cache(2, 0);
+        cache.put(1, 1, "c1", dek1);
+        CHECK( !cache.get(1, 1, "c1", dek) );
+    }
+    SECTION( "disabled" ) {
+        DEKCache cache(0, 60);
+        cache.put(1, 1, "c1", dek1);
+        CHECK( !cache.get(1, 1, "c1", dek) );
+        CHECK( 0 == cache.size() );
+    }
+}
+
 TEST_CASE( "Testing full coding", "[full][base64][aes][bcd]") {
     std::vector<std::string> cases;
     std::string key = "12345678901234567890123456789012";
@@ -636,6 +797,57 @@ TEST_CASE( "Some tests for JSON", "[full][json]" ) {
     }
 }
 
+TEST_CASE( "Test JSON field splicer", "[full][json]" ) {
+    std::set<std::string> names = {"card_number", "cvn"};
+    SECTION( "splicing fields" ) {
+        const std::string doc =
+            "{\"method\": \"bind_card\",\n \"params\": {\"card_number\": "
+            "\"4111\\u00201111\", \"amount\" : [1, {\"x\": null}], "
+            "\"cvn\":\"1\\\"2\\\\3\", \"s\": \"\\ud83d\\ude00\"}, \"id\": 1.5e3}";
+        JsonFieldSplicer splicer(doc, "params", names);
+        REQUIRE(2 == splicer.fields().size());
+        CHECK("4111 1111" == splicer.fields().get("card_number"));
+        CHECK("1\"2\\3" == splicer.fields().get("cvn"));
+        Yb::StringDict new_fields;
+        new_fields["card_token"] = "t\n\x01";
+        CHECK("{\"method\": \"bind_card\",\n \"params\": {\"amount\" : "
+              "[1, {\"x\": null}], \"s\": \"\\ud83d\\ude00\", "
+              "\"card_token\": \"t\\n\\u0001\"}, \"id\": 1.5e3}" ==
+              splicer.splice(new_fields));
+        // the result must parse
+        JsonObject o = JsonObject::parse(splicer.splice(new_fields));
+        CHECK("t\n\x01" == o.get_field("params").get_str_field("card_token"));
+    }
+    SECTION( "empty params" ) {
+        const std::string doc = "{\"params\": {}}";
+        JsonFieldSplicer splicer(doc, "params", names);
+        CHECK(splicer.fields().empty());
+        CHECK(doc == splicer.splice(Yb::StringDict()));
+        Yb::StringDict new_fields;
+        new_fields["a"] = "b";
+        CHECK("{\"params\": {\"a\": \"b\"}}" == splicer.splice(new_fields));
+    }
+    SECTION( "errors" ) {
+        const std::string no_params = "{\"method\": \"bind_card\"}";
+        CHECK_THROWS_AS( JsonFieldSplicer(no_params, "params", names),
+                         JsonKeyError );
+        const std::string not_a_string = "{\"params\": {\"cvn\": 123}}";
+        CHECK_THROWS_AS( JsonFieldSplicer(not_a_string, "params", names),
+                         JsonKeyError );
+        const char *broken[] = {
+            "", "[]", "{\"params\": {\"cvn\": \"1\"}", "{\"params\": {}} x",
+            "{\"params\": {\"a\": tru}}", "{\"params\": {\"cvn\": \"\\x\"}}",
+            "{\"params\": {\"cvn\": \"\\ud83d\"}}", "{\"params\": {\"a\" 1}}",
+            "{\"params\": {\"a\": 1,}}", "{\"a\": [1 2], \"params\": {}}",
+        };
+        for (size_t i = 0; i < sizeof(broken)/sizeof(broken[0]); ++i) {
+            const std::string doc = broken[i];
+            CHECK_THROWS_AS( JsonFieldSplicer(doc, "params", names),
+                             JsonError );
+        }
+    }
+}
+
 TEST_CASE( "Some tests for SHA256", "[full][hash]" ) {
     int hex_mode = HEX_LOWERCASE|HEX_NOSPACES;
     SECTION( "basic SHA256" ) {
@@ -664,6 +876,22 @@ TEST_CASE( "Some tests for SHA256", "[full][hash]" ) {
                         "f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8+",
                         "The quick brown fox jumps over the lazy dog"), hex_mode) );
     }
+    SECTION( "SHA256 HMAC with precomputed states" ) {
+        const std::string fox = "The quick brown fox jumps over the lazy dog";
+        HmacSha256 hmac("key");
+        // the states are cloned, so it may be reused
+        for (int i = 0; i < 2; ++i)
+            CHECK( "f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8"
+                    == string_to_hexstring(hmac.digest(fox), hex_mode) );
+        HmacSha256 copy(hmac);
+        CHECK( hmac.digest("") == copy.digest("") );
+        // a key longer than the block is hashed first
+        const std::string long_key(100, 'k');
+        CHECK( hmac_sha256_digest(sha256_digest(long_key), fox)
+                == HmacSha256(long_key).digest(fox) );
+        CHECK( hmac_sha256_digest(std::string(64, 'k'), fox)
+                != hmac_sha256_digest(std::string(65, 'k'), fox) );
+    }
 }
 
 TEST_CASE( "Some tests for Luhn algorithm", "[full][luhn]" ) {
@@ -718,6 +946,32 @@ public:
     BackgroundHttpServerThread(TestHttpServer *serv) : serv_(serv) {}
 };
 
+// n pieces of 1000 bytes, the last one is "aaa..."
+class TestBodyStream: public HttpBodyStream
+{
+    int n_;
+public:
+    explicit TestBodyStream(int n): n_(n) {}
+    bool read(std::string &piece)
+    {
+        if (!n_)
+            return false;
+        --n_;
+        piece = std::string(1000, 'a' + n_ % 26);
+        return true;
+    }
+};
+
+static const std::string test_stream_body(int n)
+{
+    std::string result;
+    std::string piece;
+    TestBodyStream stream(n);
+    while (stream.read(piece))
+        result += piece;
+    return result;
+}
+
 class TestHttpServer: public HttpServer<TestHttpHandler>
 {
     static const HttpResponse process(const HttpRequest &request)
@@ -730,17 +984,48 @@ class TestHttpServer: public HttpServer<TestHttpHandler>
         return resp;
     }
 
+    static const HttpResponse stream(const HttpRequest &request)
+    {
+        int n = boost::lexical_cast<int>(request.params()["n"]);
+        HttpResponse resp(HTTP_1_0, 200, "Okay");
+        resp.set_header("Content-Type", "text/plain");
+        resp.set_body_stream(HttpBodyStreamPtr(new TestBodyStream(n)));
+        return resp;
+    }
+
+    static const HttpResponse time_left(const HttpRequest &request)
+    {
+        HttpResponse resp(HTTP_1_0, 200, "Okay");
+        resp.set_response_body(boost::lexical_cast<std::string>(
+                    request.deadline() - Yb::get_cur_time_millisec()),
+                "text/plain");
+        return resp;
+    }
+
+    static const HttpResponse slow(const HttpRequest &request)
+    {
+        sleep(1);
+        HttpResponse resp(HTTP_1_0, 200, "Okay");
+        resp.set_response_body("slow\n", "text/plain");
+        return resp;
+    }
+
     static const HandlerMap mk_handlers()
     {
         HandlerMap m;
         m["/process"] = TestHttpServer::process;
+        m["/stream"] = TestHttpServer::stream;
+        m["/time_left"] = TestHttpServer::time_left;
+        m["/slow"] = TestHttpServer::slow;
         return m;
     }
 
 public:
-    TestHttpServer():
-        HttpServer("127.0.0.1", TEST_PORT, 1, mk_handlers(), NULL)
-    {}
+    TestHttpServer(int mode = HTTP_SERVER_THREADED, int port = TEST_PORT):
+        HttpServer("127.0.0.1", port, 16, mk_handlers(), NULL)
+    {
+        set_mode(mode);
+    }
 
     void start()
     {
@@ -775,6 +1060,813 @@ TEST_CASE( "Test HTTP server/client", "[full][http]" ) {
     CHECK( "<c>42</c>\n" == r.body() );
 }
 
+TEST_CASE( "Test HTTP server/client in epoll mode", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 1);
+    serv.set_workers(2);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    for (int i = 0; i < 3; ++i) {
+        HttpResponse r = http_post("http://127.0.0.1:" +
+                                   boost::lexical_cast<std::string>(TEST_PORT + 1) +
+                                   "/process?b=11&a=" +
+                                   boost::lexical_cast<std::string>(31 + i),
+                                   HTTP_POST_NO_LOGGER, 0, "GET");
+
+        CHECK( 200 == r.resp_code() );
+        CHECK( "application/xyz" == r.get_header("content-type") );
+        CHECK( "<c>" + boost::lexical_cast<std::string>(42 + i) + "</c>\n"
+               == r.body() );
+    }
+
+    HttpResponse r = http_post("http://127.0.0.1:" +
+                               boost::lexical_cast<std::string>(TEST_PORT + 1) +
+                               "/no_such_path",
+                               HTTP_POST_NO_LOGGER, 0, "GET");
+    CHECK( 404 == r.resp_code() );
+    serv.stop();
+}
+
+static int read_test_response(TcpSocket &sock, std::string &body)
+{
+    std::string status = sock.readline();
+    int cont_len = 0;
+    while (1) {
+        std::string line = sock.readline();
+        if (line == "\n" || line == "\r\n" || line.empty())
+            break;
+        if (Yb::StrUtils::starts_with(line, "Content-Length: "))
+            cont_len = boost::lexical_cast<int>(
+                    Yb::StrUtils::trim_trailing_space(line.substr(16)));
+    }
+    body = sock.read(cont_len);
+    return boost::lexical_cast<int>(status.substr(9, 3));
+}
+
+TEST_CASE( "Test HTTP keep-alive and pipelining", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 2);
+    serv.set_keep_alive(5000, 3);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    TcpSocket sock;
+    sock.connect("127.0.0.1", TEST_PORT + 2);
+    // two pipelined requests in a single write
+    sock.write("GET /process?a=1&b=2 HTTP/1.1\r\nHost: x\r\n\r\n"
+               "GET /process?a=3&b=4 HTTP/1.1\r\nHost: x\r\n\r\n");
+    std::string body;
+    CHECK( 200 == read_test_response(sock, body) );
+    CHECK( "<c>3</c>\n" == body );
+    CHECK( 200 == read_test_response(sock, body) );
+    CHECK( "<c>7</c>\n" == body );
+    // the third request reaches the limit, so the server closes
+    sock.write("GET /process?a=5&b=6 HTTP/1.1\r\nHost: x\r\n\r\n");
+    CHECK( 200 == read_test_response(sock, body) );
+    CHECK( "<c>11</c>\n" == body );
+    CHECK( "" == sock.readline() );
+    serv.stop();
+}
+
+TEST_CASE( "Test HTTP server with a full worker queue", "[full][http]" ) {
+
+    const int modes[] = {HTTP_SERVER_THREADED, HTTP_SERVER_EPOLL};
+    for (int k = 0; k < 2; ++k) {
+        int port = TEST_PORT + 15 + k;
+        TestHttpServer serv(modes[k], port);
+        serv.set_workers(1);
+        serv.set_queue_size(1);
+        try {
+            serv.bind();
+        }
+        catch (...) {}
+        REQUIRE( serv.is_bound() );
+        serv.start();
+        sleep(1);
+        REQUIRE( serv.is_serving() );
+
+        // one request keeps the only worker busy and at most one more
+        // waits in the queue, the rest must be turned away at once
+        const int n = 5;
+        TcpSocket socks[n];
+        for (int i = 0; i < n; ++i) {
+            socks[i].connect("127.0.0.1", port);
+            socks[i].write("GET /slow HTTP/1.0\r\n\r\n");
+        }
+        int ok = 0, rejected = 0;
+        for (int i = 0; i < n; ++i) {
+            std::string body;
+            int code = read_test_response(socks[i], body);
+            if (code == 200) {
+                CHECK( "slow\n" == body );
+                ++ok;
+            }
+            else {
+                CHECK( 503 == code );
+                CHECK( "<status>NOT</status>" == body );
+                ++rejected;
+            }
+        }
+        CHECK( ok >= 1 );
+        CHECK( rejected >= n - 2 );
+        // the threads are gone before the server is destroyed
+        serv.stop();
+        CHECK( !serv.is_serving() );
+    }
+}
+
+TEST_CASE( "Test HTTP server with several acceptors", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 3);
+    serv.set_acceptors(3);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    for (int i = 0; i < 6; ++i) {
+        HttpResponse r = http_post("http://127.0.0.1:" +
+                                   boost::lexical_cast<std::string>(TEST_PORT + 3) +
+                                   "/process?b=1&a=" +
+                                   boost::lexical_cast<std::string>(i),
+                                   HTTP_POST_NO_LOGGER, 0, "GET");
+        CHECK( 200 == r.resp_code() );
+        CHECK( "<c>" + boost::lexical_cast<std::string>(i + 1) + "</c>\n"
+               == r.body() );
+    }
+    serv.stop();
+}
+
+TEST_CASE( "Test CPU list parsing", "[utils]" ) {
+    CHECK( parse_cpu_list("").empty() );
+    std::vector<int> cpus = parse_cpu_list("0-2, 5");
+    REQUIRE( 4 == cpus.size() );
+    CHECK( 0 == cpus[0] );
+    CHECK( 1 == cpus[1] );
+    CHECK( 2 == cpus[2] );
+    CHECK( 5 == cpus[3] );
+    CHECK_THROWS( parse_cpu_list("3-1") );
+    CHECK_THROWS( parse_cpu_list("a") );
+}
+
+TEST_CASE( "Test incremental HTTP request parser", "[http]" ) {
+    const std::string req =
+        "POST /process?a=1 HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "content-type:   application/x-www-form-urlencoded  \r\n"
+        "X-Folded: one\r\n"
+        "  two\r\n"
+        "Content-Length: 7\r\n"
+        "\r\n"
+        "b=2&c=3"
+        "GET /next HTTP/1.0\r\n\r\n";
+    HttpRequestParser parser;
+    // feed it byte by byte
+    std::string buf;
+    size_t i = 0;
+    for (; i < req.size(); ++i) {
+        buf.push_back(req[i]);
+        if (parser.parse(buf.data(), buf.size()))
+            break;
+    }
+    REQUIRE( parser.complete() );
+    CHECK( parser.message_length() == i + 1 );
+    CHECK( 7 == parser.body_length() );
+    HttpRequest r = parser.make_request(buf.data());
+    CHECK( "POST" == r.method() );
+    CHECK( "/process" == r.path() );
+    CHECK( HTTP_1_1 == r.proto_ver() );
+    CHECK( "application/x-www-form-urlencoded"
+           == r.get_header("Content-Type") );
+    CHECK( "one    two" == r.get_header("x-folded") );
+    CHECK( "b=2&c=3" == r.body() );
+    // the pipelined request that follows
+    buf = req.substr(parser.message_length());
+    parser.reset();
+    REQUIRE( parser.parse(buf.data(), buf.size()) );
+    CHECK( 0 == parser.body_length() );
+    r = parser.make_request(buf.data());
+    CHECK( "/next" == r.path() );
+    CHECK( HTTP_1_0 == r.proto_ver() );
+    CHECK( r.headers().empty() );
+
+    const char *bad[] = {
+        "GET /\r\n\r\n",
+        "GET / HTTP/2.0\r\n\r\n",
+        "GET / HTTP/1.1\r\nNo colon here\r\n\r\n",
+        "GET / HTTP/1.1\r\n folded first\r\n\r\n",
+        "GET / HTTP/1.1\rHost: x\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+    };
+    for (size_t j = 0; j < sizeof(bad) / sizeof(bad[0]); ++j) {
+        parser.reset();
+        std::string s(bad[j]);
+        CHECK_THROWS( parser.parse(s.data(), s.size()) );
+    }
+    HttpRequestParser small_parser(16);
+    std::string s = "GET /a/very/long/path HTTP/1.1\r\n";
+    CHECK_THROWS( small_parser.parse(s.data(), s.size()) );
+}
+
+TEST_CASE( "Test HTTP request parser body framing", "[http]" ) {
+    // a body sent with GET must be consumed, not taken for the next request
+    std::string s =
+        "GET /a HTTP/1.1\r\nContent-Length: 20\r\n\r\n"
+        "GET /smuggled HTTP/1.1"
+        "GET /b HTTP/1.1\r\n\r\n";
+    HttpRequestParser parser;
+    REQUIRE( parser.parse(s.data(), s.size()) );
+    CHECK( 20 == parser.body_length() );
+    CHECK( "/a" == parser.make_request(s.data()).path() );
+    s.erase(0, parser.message_length());
+    parser.reset();
+    REQUIRE( parser.parse(s.data(), s.size()) );
+    CHECK( "/b" == parser.make_request(s.data()).path() );
+
+    const char *bad[] = {
+        "POST / HTTP/1.1\r\nContent-Length: 3\r\n"
+            "Content-Length: 3\r\n\r\nabc",
+        "POST / HTTP/1.1\r\nContent-Length: 3\r\n"
+            "content-length: 30\r\n\r\nabc",
+        "GET / HTTP/1.1\r\nContent-Length: 1\r\n"
+            "Content-Length: 0\r\n\r\nx",
+        // whitespace in a header name is refused, not trimmed
+        "POST / HTTP/1.1\r\nContent-Length : 3\r\n\r\nabc",
+        "POST / HTTP/1.1\r\nContent-Length\t: 3\r\n\r\nabc",
+        "POST / HTTP/1.1\r\nContent Length: 3\r\n\r\nabc",
+    };
+    for (size_t j = 0; j < sizeof(bad) / sizeof(bad[0]); ++j) {
+        parser.reset();
+        s = bad[j];
+        CHECK_THROWS_AS( parser.parse(s.data(), s.size()), HttpParserError );
+    }
+
+    // an oversized body is refused as soon as the head is complete
+    HttpRequestParser small_parser(1024, 10);
+    s = "POST / HTTP/1.1\r\nContent-Length: 11\r\n\r\n";
+    CHECK_THROWS_AS( small_parser.parse(s.data(), s.size()), HttpParserError );
+    small_parser.reset();
+    s = "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789";
+    CHECK( small_parser.parse(s.data(), s.size()) );
+}
+
+TEST_CASE( "Test HTTP/2 response status lines", "[http]" ) {
+    // the head as curl passes it on for an HTTP/2 reply
+    HttpResponse resp(HTTP_X, 0, "");
+    resp.put_header_line("HTTP/1.1 100 Continue\r\n");
+    resp.put_header_line("\r\n");
+    resp.put_header_line("HTTP/2 201 \r\n");
+    resp.put_header_line("content-type: text/plain\r\n");
+    resp.put_header_line("\r\n");
+    CHECK( 201 == resp.resp_code() );
+    CHECK( "Created" == resp.resp_desc() );
+    CHECK( HTTP_2_0 == resp.proto_ver() );
+    CHECK( "text/plain" == resp.get_header("Content-Type") );
+
+    CHECK( 404 == HttpResponse::parse_status("HTTP/2 404").first );
+    CHECK( "Not Found" == HttpResponse::parse_status("HTTP/2 404").second );
+    CHECK( "No way" == HttpResponse::parse_status("HTTP/1.1 404 No way").second );
+    CHECK( 0 == HttpResponse::parse_status("Content-Type: text/plain").first );
+}
+
+TEST_CASE( "Test timer wheel", "[utils]" ) {
+    TimerWheel wheel(10, 1000);
+    wheel.schedule(1, 1050);
+    wheel.schedule(2, 1005);                      // rounded up to 1010
+    wheel.schedule(3, 1000 + 10 * 64 * 64);       // goes to the third level
+    wheel.schedule(4, 900);                       // already due
+    CHECK( 4 == wheel.size() );
+    std::vector<TimerWheel::Timer> expired;
+    wheel.advance(1009, expired);
+    CHECK( expired.empty() );
+    wheel.advance(1010, expired);
+    REQUIRE( 2 == expired.size() );
+    CHECK( 2 == expired[0].key );
+    CHECK( 4 == expired[1].key );
+    expired.clear();
+    wheel.advance(1049, expired);
+    CHECK( expired.empty() );
+    wheel.advance(1050, expired);
+    REQUIRE( 1 == expired.size() );
+    CHECK( 1 == expired[0].key );
+    expired.clear();
+    wheel.advance(1000 + 10 * 64 * 64 - 1, expired);
+    CHECK( expired.empty() );
+    CHECK( 1 == wheel.size() );
+    wheel.advance(1000 + 10 * 64 * 64, expired);
+    REQUIRE( 1 == expired.size() );
+    CHECK( 3 == expired[0].key );
+    CHECK( wheel.empty() );
+}
+
+TEST_CASE( "Test HTTP server drops slow clients", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 4);
+    serv.set_timeouts(300, 300, 30000, 30000);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    // the head never completes, each byte is sent well within
+    // the socket timeout, still the connection is closed
+    TcpSocket sock;
+    sock.connect("127.0.0.1", TEST_PORT + 4);
+    sock.write("GET /process?a=1&b=2 HTTP/1.1\r\n");
+    for (int i = 0; i < 2; ++i) {
+        sleep_msec(100);
+        sock.write("X");
+    }
+    CHECK( "" == sock.readline() );
+
+    // the one that's quick enough is served
+    TcpSocket sock2;
+    sock2.connect("127.0.0.1", TEST_PORT + 4);
+    sock2.write("GET /process?a=1&b=2 HTTP/1.1\r\nHost: x\r\n\r\n");
+    std::string body;
+    CHECK( 200 == read_test_response(sock2, body) );
+    CHECK( "<c>3</c>\n" == body );
+    serv.stop();
+}
+
+TEST_CASE( "Test HTTP server on a unix socket", "[full][http]" ) {
+
+    const std::string path = "/tmp/card_proxy_core_tests.sock";
+    // the port is not used
+    TestHttpServer serv(HTTP_SERVER_EPOLL);
+    serv.set_unix_socket(path, 0600);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    struct stat st;
+    REQUIRE( 0 == stat(path.c_str(), &st) );
+    CHECK( S_ISSOCK(st.st_mode) );
+    CHECK( 0600 == (st.st_mode & 07777) );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    TcpSocket sock;
+    sock.connect_unix(path);
+    sock.write("GET /process?a=1&b=2 HTTP/1.1\r\nHost: x\r\n\r\n");
+    std::string body;
+    CHECK( 200 == read_test_response(sock, body) );
+    CHECK( "<c>3</c>\n" == body );
+
+    // a live server's socket is not taken over
+    TcpSocket second;
+    CHECK_THROWS_AS( second.bind_unix(path), SocketEx );
+    serv.stop();
+
+    // while the file left behind is
+    const std::string stale_path = path + ".stale";
+    TcpSocket gone;
+    gone.bind_unix(stale_path);
+    gone.listen();
+    gone.close();
+    REQUIRE( 0 == stat(stale_path.c_str(), &st) );
+    TcpSocket third;
+    third.bind_unix(stale_path);
+    third.close();
+    unlink(stale_path.c_str());
+}
+
+// accepts a single connection and serves all of the requests on it
+class OneConnectionServer: public Yb::Thread
+{
+    TcpSocket &listener_;
+    int n_requests_;
+    void on_run()
+    {
+        try {
+            TcpSocket sock(listener_.accept());
+            for (int i = 0; i < n_requests_; ++i) {
+                std::string line;
+                do {
+                    line = sock.readline();
+                } while (line != "\r\n" && !line.empty());
+                sock.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+            }
+        }
+        catch (const std::exception &) {
+            // the client has closed the connection
+        }
+    }
+public:
+    OneConnectionServer(TcpSocket &listener, int n_requests)
+        : listener_(listener), n_requests_(n_requests)
+    {}
+};
+
+TEST_CASE( "Test http_post reuses connections", "[full][http]" ) {
+
+    TcpSocket listener;
+    listener.bind("127.0.0.1", TEST_PORT + 6);
+    listener.listen();
+    OneConnectionServer serv(listener, 3);
+    serv.start();
+    CHECK( HttpClientEngine::default_max_idle() > 0 );
+    for (int i = 0; i < 3; ++i) {
+        // a new connection would never be accepted
+        HttpResponse r = http_post("http://127.0.0.1:" +
+                                   boost::lexical_cast<std::string>(TEST_PORT + 6) +
+                                   "/ping", HTTP_POST_NO_LOGGER, 5, "GET");
+        CHECK( 200 == r.resp_code() );
+        CHECK( "ok" == r.body() );
+    }
+    serv.wait();
+}
+
+TEST_CASE( "Test async HTTP client", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 7);
+    serv.set_keep_alive(5000, 100);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    HttpClientEngine engine(2, 4);
+    std::vector<std::future<HttpResponse> > results;
+    for (int i = 0; i < 6; ++i) {
+        HttpClientRequest request;
+        request.uri = "http://127.0.0.1:" +
+            boost::lexical_cast<std::string>(TEST_PORT + 7) +
+            "/process?b=1&a=" + boost::lexical_cast<std::string>(i);
+        request.method = "GET";
+        request.timeout = 5;
+        results.push_back(engine.submit(request));
+    }
+    for (int i = 0; i < 6; ++i) {
+        HttpResponse r = results[i].get();
+        CHECK( 200 == r.resp_code() );
+        CHECK( "<c>" + boost::lexical_cast<std::string>(i + 1) + "</c>\n"
+               == r.body() );
+    }
+    // nobody listens there
+    HttpClientRequest request;
+    request.uri = "http://127.0.0.1:" +
+        boost::lexical_cast<std::string>(TEST_PORT + 8) + "/";
+    request.timeout = 5;
+    CHECK_THROWS( engine.submit(request).get() );
+    serv.stop();
+}
+
+static void check_streamed_responses(int mode, int port)
+{
+    TestHttpServer serv(mode, port);
+    serv.set_keep_alive(5000, 100);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    const std::string url = "http://127.0.0.1:" +
+        boost::lexical_cast<std::string>(port) + "/stream?n=";
+    // HTTP/1.1 gets it chunked
+    HttpResponse r = http_post(url + "1000", HTTP_POST_NO_LOGGER, 10, "GET");
+    CHECK( 200 == r.resp_code() );
+    CHECK( "chunked" == r.get_header("Transfer-Encoding", "") );
+    CHECK( test_stream_body(1000) == r.body() );
+
+    // the same on the client side, the reader lags behind at first
+    r = http_post_stream(url + "1000", HTTP_POST_NO_LOGGER, 10, "GET");
+    CHECK( 200 == r.resp_code() );
+    REQUIRE( r.body_stream() );
+    CHECK( r.body().empty() );
+    usleep(200000);
+    std::string body, piece;
+    int n_pieces = 0;
+    while (r.body_stream()->read(piece)) {
+        body += piece;
+        ++n_pieces;
+    }
+    CHECK( n_pieces > 1 );
+    CHECK( test_stream_body(1000) == body );
+
+    // HTTP/1.0 knows no chunks, the body ends with the connection
+    TcpSocket sock;
+    sock.connect("127.0.0.1", port);
+    sock.write("GET /stream?n=3 HTTP/1.0\r\n\r\n");
+    std::string resp;
+    while (sock.read_some(resp));
+    size_t head_end = resp.find("\n\n");
+    REQUIRE( std::string::npos != head_end );
+    CHECK( std::string::npos == resp.find("Content-Length") );
+    CHECK( test_stream_body(3) == resp.substr(head_end + 2) );
+    serv.stop();
+}
+
+TEST_CASE( "Test HTTP server streams response bodies", "[full][http]" ) {
+    check_streamed_responses(HTTP_SERVER_THREADED, TEST_PORT + 9);
+    check_streamed_responses(HTTP_SERVER_EPOLL, TEST_PORT + 10);
+}
+
+TEST_CASE( "Test upstream circuit breaker", "[utils]" ) {
+    UpstreamSettings settings;
+    settings.window = 1000;
+    settings.min_requests = 4;
+    settings.error_percent = 50;
+    settings.slow_call = 100;
+    settings.open_time = 500;
+    settings.probes = 2;
+    std::vector<std::string> endpoints(1, "http://a");
+    UpstreamTarget target(endpoints, settings);
+    UpstreamCall call;
+    Yb::MilliSec now = 100000;
+    // 1 of 4 failed, 1 slow: 50% - trips
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE( target.acquire(now, call) );
+        CHECK( !call.probe );
+        target.release(call, i != 0, i == 1? now + 200: now + 10);
+        CHECK( (i < 3? BREAKER_CLOSED: BREAKER_OPEN) == target.state() );
+    }
+    // it has opened at now + 10
+    CHECK( !target.acquire(now + 509, call) );
+    // half-open: the probes only
+    UpstreamCall probe1, probe2;
+    REQUIRE( target.acquire(now + 510, probe1) );
+    CHECK( probe1.probe );
+    REQUIRE( target.acquire(now + 510, probe2) );
+    CHECK( !target.acquire(now + 510, call) );
+    target.release(probe1, true, now + 520);
+    CHECK( BREAKER_HALF_OPEN == target.state() );
+    // a failed probe opens it again
+    target.release(probe2, false, now + 520);
+    CHECK( BREAKER_OPEN == target.state() );
+    CHECK( !target.acquire(now + 600, call) );
+    REQUIRE( target.acquire(now + 1020, probe1) );
+    REQUIRE( target.acquire(now + 1020, probe2) );
+    target.release(probe1, true, now + 1030);
+    target.release(probe2, true, now + 1030);
+    CHECK( BREAKER_CLOSED == target.state() );
+    // the old failures are forgotten
+    REQUIRE( target.acquire(now + 1040, call) );
+    target.release(call, false, now + 1040);
+    CHECK( BREAKER_CLOSED == target.state() );
+}
+
+TEST_CASE( "Test upstream balancing and outlier ejection", "[utils]" ) {
+    UpstreamSettings settings;
+    settings.min_requests = 1000;
+    settings.eject_errors = 2;
+    settings.eject_time = 1000;
+    settings.max_ejected_percent = 50;
+    std::vector<std::string> endpoints;
+    endpoints.push_back("http://a");
+    endpoints.push_back("http://b");
+    endpoints.push_back("http://c");
+    UpstreamTarget target(endpoints, settings);
+    Yb::MilliSec now = 100000;
+    // the least outstanding requests first
+    UpstreamCall calls[6];
+    int counts[3] = {0, 0, 0};
+    for (int i = 0; i < 6; ++i) {
+        REQUIRE( target.acquire(now, calls[i]) );
+        ++counts[calls[i].endpoint];
+    }
+    CHECK( 2 == counts[0] );
+    CHECK( 2 == counts[1] );
+    CHECK( 2 == counts[2] );
+    for (int i = 0; i < 6; ++i)
+        target.release(calls[i], calls[i].endpoint != 0, now);
+    CHECK( target.is_ejected(0, now) );
+    CHECK( 0 == target.outstanding(0) );
+    UpstreamCall call;
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE( target.acquire(now, call) );
+        CHECK( 0 != call.endpoint );
+        target.release(call, true, now);
+    }
+    // no more than a half of them may be out
+    for (int i = 0; i < 2; ++i) {
+        REQUIRE( target.acquire(now, call) );
+        target.release(call, false, now);
+        REQUIRE( target.acquire(now, call) );
+        target.release(call, false, now);
+    }
+    CHECK( !target.is_ejected(1, now) );
+    CHECK( !target.is_ejected(2, now) );
+    // back after eject_time, the next ejection lasts longer
+    CHECK( !target.is_ejected(0, now + 1000) );
+    CHECK( "http://a" == UpstreamRegistry::uri_endpoint("http://A/x/y") );
+    CHECK( 2 == UpstreamRegistry::split_uris(" http://a/x\n http://b/x ").size() );
+}
+
+TEST_CASE( "Test upstream registry", "[utils]" ) {
+    UpstreamRegistry &registry = UpstreamRegistry::instance();
+    std::vector<std::string> bind_card, start_payment, derived;
+    bind_card.push_back("http://appserv/api/bind_card");
+    start_payment.push_back("http://appserv/web/payment");
+    derived.push_back("http://appserv/api/supply_payment_data");
+    UpstreamSettings settings = UpstreamRegistry::default_settings();
+    settings.timeout = 1234;
+    registry.configure("test_bind_card", bind_card, settings);
+    // the same hosts, but another target
+    registry.configure("test_start_payment", start_payment,
+                       UpstreamRegistry::default_settings());
+    UpstreamTargetPtr target = registry.get("test_bind_card", derived);
+    CHECK( 1234 == target->settings().timeout );
+    CHECK( target.get() == registry.get("test_bind_card", bind_card).get() );
+    CHECK( target.get() !=
+           registry.get("test_start_payment", start_payment).get() );
+    CHECK( 1234 != registry.get("test_start_payment", start_payment)
+                        ->settings().timeout );
+}
+
+TEST_CASE( "Test replacing URI suffixes", "[utils]" ) {
+    CHECK( "http://a/api/supply_payment_data http://b/api/supply_payment_data"
+           == UpstreamRegistry::replace_uri_suffix(
+               "http://a/api/bind_card  http://b/api/bind_card",
+               "/bind_card", "/supply_payment_data") );
+    CHECK( "https://processing/api/status"
+           == UpstreamRegistry::replace_uri_suffix(
+               "https://processing/api/authorize", "/authorize", "/status") );
+    // bind_card_url of the sample config, supply_payment_data can't be
+    // derived from it
+    CHECK_THROWS_AS( UpstreamRegistry::replace_uri_suffix(
+                "http://appserv/api/bind", "/bind_card",
+                "/supply_payment_data"), ::RunTimeError );
+    CHECK_THROWS_AS( UpstreamRegistry::replace_uri_suffix(
+                "http://a/api/bind_card http://b/api/bind",
+                "/bind_card", "/supply_payment_data"), ::RunTimeError );
+}
+
+TEST_CASE( "Test upstream hedge accounting", "[utils]" ) {
+    UpstreamSettings settings;
+    settings.eject_errors = 1;
+    settings.max_ejected_percent = 50;
+    std::vector<std::string> endpoints;
+    endpoints.push_back("http://a");
+    endpoints.push_back("http://b");
+    UpstreamTarget target(endpoints, settings);
+    Yb::MilliSec now = 100000;
+    UpstreamCall call, hedge;
+    REQUIRE( target.acquire(now, call) );
+    REQUIRE( target.acquire_hedge(call, now, hedge) );
+    CHECK( call.endpoint != hedge.endpoint );
+    CHECK( 1 == target.outstanding(call.endpoint) );
+    CHECK( 1 == target.outstanding(hedge.endpoint) );
+    // the hedge has answered, the primary has lost
+    target.cancel(call);
+    target.release(hedge, false, now);
+    CHECK( 0 == target.outstanding(call.endpoint) );
+    CHECK( 0 == target.outstanding(hedge.endpoint) );
+    CHECK( !target.is_ejected(call.endpoint, now) );
+    CHECK( target.is_ejected(hedge.endpoint, now) );
+    // no healthy endpoint is left to hedge to
+    REQUIRE( target.acquire(now, call) );
+    CHECK( !target.acquire_hedge(call, now, hedge) );
+    target.release(call, true, now);
+}
+
+TEST_CASE( "Test hedge policy", "[utils]" ) {
+    HttpHedgePolicy policy(90, 10, 5);
+    CHECK( -1 == policy.start() );
+    for (int i = 1; i <= 20; ++i)
+        policy.record(i);
+    CHECK( 18 == policy.start() );
+    // 10% of the calls: the third one so far
+    CHECK( !policy.spend() );
+    for (int i = 0; i < 8; ++i)
+        policy.start();
+    CHECK( policy.spend() );
+    CHECK( !policy.spend() );
+    HttpHedgePolicy fast(50, 10, 5);
+    for (int i = 0; i < 20; ++i)
+        fast.record(1);
+    CHECK( 5 == fast.start() );
+}
+
+TEST_CASE( "Test hedged HTTP request", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 11);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+    // the connection is never accepted, so there's no response
+    TcpSocket listener;
+    listener.bind("127.0.0.1", TEST_PORT + 12);
+    listener.listen();
+
+    HttpHedgePolicyPtr policy(new HttpHedgePolicy(50, 100, 5));
+    for (int i = 0; i < 20; ++i)
+        policy->record(50);
+    HttpClientEngine engine(1, 4);
+    HttpClientRequest request;
+    request.uri = "http://127.0.0.1:" +
+        boost::lexical_cast<std::string>(TEST_PORT + 12) +
+        "/process?a=1&b=2";
+    request.method = "GET";
+    request.timeout = 5;
+    const std::string hedge_uri = "http://127.0.0.1:" +
+        boost::lexical_cast<std::string>(TEST_PORT + 11) +
+        "/process?a=1&b=2";
+    Yb::MilliSec started = Yb::get_cur_time_millisec();
+    HttpHedgeOutcome outcome;
+    HttpResponse r = engine.submit_hedged(
+            request, hedge_uri, policy, &outcome).get();
+    CHECK( 200 == r.resp_code() );
+    CHECK( outcome.hedged );
+    CHECK( 1 == outcome.winner );
+    CHECK( outcome.hedge_started >= started );
+    CHECK( "<c>3</c>\n" == r.body() );
+    CHECK( Yb::get_cur_time_millisec() - started < 2000 );
+    serv.stop();
+}
+
+TEST_CASE( "Test upstream retry budget", "[utils]" ) {
+    UpstreamSettings settings;
+    settings.retry_budget = 50;
+    std::vector<std::string> endpoints(1, "http://a");
+    UpstreamTarget target(endpoints, settings);
+    CHECK( !target.spend_retry() );
+    UpstreamCall call;
+    Yb::MilliSec now = 100000;
+    for (int i = 0; i < 2; ++i) {
+        REQUIRE( target.acquire(now, call) );
+        target.release(call, false, now);
+    }
+    CHECK( target.spend_retry() );
+    CHECK( !target.spend_retry() );
+}
+
+TEST_CASE( "Test request deadlines", "[full][http]" ) {
+
+    TestHttpServer serv(HTTP_SERVER_EPOLL, TEST_PORT + 13);
+    serv.set_timeouts(10000, 10000, 5000, 10000);
+    try {
+        serv.bind();
+    }
+    catch (...) {}
+    REQUIRE( serv.is_bound() );
+    serv.start();
+    sleep(1);
+    REQUIRE( serv.is_serving() );
+
+    const std::string url = "http://127.0.0.1:" +
+        boost::lexical_cast<std::string>(TEST_PORT + 13) + "/time_left";
+    HttpResponse r = http_post(url, HTTP_POST_NO_LOGGER, 5, "GET");
+    int left = boost::lexical_cast<int>(r.body());
+    CHECK( left > 4000 );
+    CHECK( left <= 5000 );
+    // the client's own limit is shorter
+    HttpHeaders headers;
+    headers[HTTP_TIMEOUT_HEADER] = "300";
+    r = http_post(url, HTTP_POST_NO_LOGGER, 5, "GET", headers);
+    left = boost::lexical_cast<int>(r.body());
+    CHECK( left > 0 );
+    CHECK( left <= 300 );
+    serv.stop();
+
+    // a sub-second timeout is not lost, nobody answers there
+    TcpSocket listener;
+    listener.bind("127.0.0.1", TEST_PORT + 14);
+    listener.listen();
+    Yb::MilliSec started = Yb::get_cur_time_millisec();
+    CHECK_THROWS( http_post("http://127.0.0.1:" +
+                            boost::lexical_cast<std::string>(TEST_PORT + 14) +
+                            "/", HTTP_POST_NO_LOGGER, 0.3, "GET") );
+    CHECK( Yb::get_cur_time_millisec() - started < 2000 );
+}
+
 TEST_CASE( "Test replace_str correctness", "[full][replace_str]" ) {
     CHECK( "" == replace_str("", "", "") );
     CHECK( "abc" == replace_str("abc", "x", "y") );
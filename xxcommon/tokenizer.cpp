@@ -3,6 +3,7 @@
 #include "tokenizer.h"
 #include "utils.h"
 #include "http_post.h"
+#include "upstream.h"
 #include "aes_crypter.h"
 #include "dek_pool.h"
 #include "tcp_socket.h"
@@ -28,6 +29,18 @@ boost::tuple<std::string, double, int, std::string> get_keykeeper_controller(
     return boost::make_tuple(uri, timeout, part, secret);
 }
 
+KeyKeeperAPI::KeyKeeperAPI(const std::string &uri, double timeout, int part,
+                           Yb::ILogger *logger, bool ssl_validate_cert)
+    : logger_(logger)
+    , replicas_(UpstreamRegistry::split_uris(uri))
+    , timeout_(timeout), part_(part)
+    , ssl_validate_cert_(ssl_validate_cert)
+{
+    YB_ASSERT(!replicas_.empty());
+    YB_ASSERT(part_ == 1 || part_ == 2);
+    uri_ = replicas_[0];
+}
+
 const HttpHeaders KeyKeeperAPI::get_headers() const{
     HttpHeaders res;
     res["X-AUTH"] = secret_;
@@ -44,12 +57,26 @@ const std::string
     double key_keeper_timeout = timeout_;
     std::string key_keeper_uri = uri_;
     std::string target_id = get_target_id(kek_version);
-    HttpResponse resp = http_post(key_keeper_uri + "read",
-                                  logger_,
-                                  key_keeper_timeout,
-                                  "GET",
-                                  get_headers(), HttpParams(), "",
-                                  ssl_validate_cert_);
+    // a read changes nothing, so a late one is worth asking a replica
+    HttpHedgePolicyPtr hedge_policy;
+    if (replicas_.size() > 1)
+        hedge_policy = UpstreamRegistry::instance()
+            .get("key_keeper2", replicas_)->hedge_policy();
+    HttpResponse resp = hedge_policy?
+        http_post_hedged(key_keeper_uri + "read",
+                         replicas_[1] + "read",
+                         hedge_policy,
+                         logger_,
+                         key_keeper_timeout,
+                         "GET",
+                         get_headers(), HttpParams(), "",
+                         ssl_validate_cert_):
+        http_post(key_keeper_uri + "read",
+                  logger_,
+                  key_keeper_timeout,
+                  "GET",
+                  get_headers(), HttpParams(), "",
+                  ssl_validate_cert_);
     validate_status(resp.resp_code());
     const std::string &body = resp.body();
     auto root = Yb::ElementTree::parse(body);
@@ -412,6 +439,12 @@ const std::string TokenizerConfig::get_master_key(int version, bool valid_only)
     throw Yb::KeyError("master key not valid: " + Yb::to_string(version));
 }
 
+bool TokenizerConfig::has_valid_master_key(int version) const
+{
+    Yb::ScopedLock lock(mux_);
+    return master_keys_.count(version) && is_kek_valid(version);
+}
+
 const VersionMap TokenizerConfig::get_master_keys(bool valid_only) const
 {
     Yb::ScopedLock lock(mux_);
@@ -458,6 +491,21 @@ const std::vector<int> TokenizerConfig::get_hmac_versions() const
     return versions;
 }
 
+const std::string TokenizerConfig::hmac_digest(int version,
+                                              const std::string &s) const
+{
+    // hash on a copy of the precomputed states, outside of the lock
+    const HmacSha256 hmac = [this, version]() -> HmacSha256 {
+        Yb::ScopedLock lock(mux_);
+        auto i = hmac_ctxs_.find(version);
+        if (hmac_ctxs_.end() == i)
+            throw Yb::KeyError("hmac key not found: "
+                    + Yb::to_string(version));
+        return i->second;
+    }();
+    return hmac.digest(s);
+}
+
 void TokenizerConfig::reload(bool hmac_needed)
 {
     Yb::ILogger::Ptr logger(
@@ -488,6 +536,9 @@ void TokenizerConfig::reload(bool hmac_needed)
         hmac_keys = load_hmac_keys(
                 *logger, db_params, *session, master_keys);
     session.reset(NULL);
+    HmacMap hmac_ctxs;
+    for (auto i = hmac_keys.begin(), iend = hmac_keys.end(); i != iend; ++i)
+        hmac_ctxs.insert(HmacMap::value_type(i->first, HmacSha256(i->second)));
 
     Yb::ScopedLock lock(mux_);
     std::swap(xml_params, xml_params_);
@@ -498,6 +549,7 @@ void TokenizerConfig::reload(bool hmac_needed)
     std::swap(master_keys, master_keys_);
     std::swap(valid_master_keys, valid_master_keys_);
     std::swap(hmac_keys, hmac_keys_);
+    std::swap(hmac_ctxs, hmac_ctxs_);
     if (at_least_one_valid)
         ts_ = time(NULL);
 }
@@ -669,14 +721,15 @@ const std::string Tokenizer::tokenize(const std::string &plain_text,
 const std::string Tokenizer::detokenize(const std::string &token_string)
 {
     std::string dek_crypted, data_crypted;
+    Yb::LongInt dek_id;
     int kek_version;
     try {
         if (card_tokenizer_)
             do_detokenize<Domain::DataToken>(token_string,
-                    dek_crypted, kek_version, data_crypted);
+                    dek_id, dek_crypted, kek_version, data_crypted);
         else
             do_detokenize<Domain::SecureVault>(token_string,
-                    dek_crypted, kek_version, data_crypted);
+                    dek_id, dek_crypted, kek_version, data_crypted);
         logger_->info("Token decoded: " + token_string);
     }
     catch (const Yb::NoDataFound &) {
@@ -684,7 +737,7 @@ const std::string Tokenizer::detokenize(const std::string &token_string)
         throw TokenNotFound();
     }
     tokenizer_config(false);
-    std::string dek = decrypt_dek(dek_crypted, kek_version);
+    std::string dek = get_dek(dek_id, dek_crypted, kek_version);
     return decode_data(decrypt_data(dek, data_crypted, card_tokenizer_));
 }
 
@@ -736,7 +789,9 @@ const std::string Tokenizer::encrypt_data(const std::string &dek,
                                           const std::string &data,
                                           bool card_tokenizer)
 {
-    AESCrypter data_encrypter(dek, card_tokenizer? AES_CRYPTER_ECB: AES_CRYPTER_CBC);
+    // not AESCrypter::for_key(): a DEK is only kept in DEKCache
+    AESCrypter data_encrypter(
+            dek, card_tokenizer? AES_CRYPTER_ECB: AES_CRYPTER_CBC);
     return encode_base64(data_encrypter.encrypt(data));
 }
 
@@ -744,24 +799,25 @@ const std::string Tokenizer::decrypt_data(const std::string &dek,
                                           const std::string &data_crypted,
                                           bool card_tokenizer)
 {
-    AESCrypter data_encrypter(dek, card_tokenizer? AES_CRYPTER_ECB: AES_CRYPTER_CBC);
+    AESCrypter data_encrypter(
+            dek, card_tokenizer? AES_CRYPTER_ECB: AES_CRYPTER_CBC);
     return data_encrypter.decrypt(decode_base64(data_crypted));
 }
 
 const std::string Tokenizer::encrypt_dek(const std::string &dek,
                                         int kek_version)
 {
-    AESCrypter data_encrypter(tokenizer_config().get_master_key(kek_version),
-                              AES_CRYPTER_ECB);
-    return encode_base64(data_encrypter.encrypt(dek));
+    AESCrypterPtr data_encrypter = AESCrypter::for_key(
+            tokenizer_config().get_master_key(kek_version), AES_CRYPTER_ECB);
+    return encode_base64(data_encrypter->encrypt(dek));
 }
 
 const std::string Tokenizer::decrypt_dek(const std::string &dek_crypted,
                                         int kek_version)
 {
-    AESCrypter data_encrypter(tokenizer_config().get_master_key(kek_version),
-                              AES_CRYPTER_ECB);
-    return data_encrypter.decrypt(decode_base64(dek_crypted));
+    AESCrypterPtr data_encrypter = AESCrypter::for_key(
+            tokenizer_config().get_master_key(kek_version), AES_CRYPTER_ECB);
+    return data_encrypter->decrypt(decode_base64(dek_crypted));
 }
 
 TokenizerConfig &Tokenizer::tokenizer_config(bool hmac_needed)
@@ -788,11 +844,48 @@ DEKPool &Tokenizer::dek_pool()
     return *dek_pool_;
 }
 
+DEKCache &Tokenizer::dek_cache()
+{
+    // one per process, set up by the first tokenizer
+    static DEKCache cache(
+            config_.has_key("Dek/CacheSize")?
+                config_.get_value_as_int("Dek/CacheSize"): DEK_CACHE_SIZE,
+            config_.has_key("Dek/CacheTTL")?
+                config_.get_value_as_int("Dek/CacheTTL"): DEK_CACHE_TTL);
+    static const bool checked = [this]() {
+        if (!cache.is_locked())
+            logger_->warning("DEK cache is not locked in RAM, "
+                             "check RLIMIT_MEMLOCK");
+        return true;
+    }();
+    (void)checked;
+    return cache;
+}
+
+const std::string Tokenizer::get_dek(Yb::LongInt dek_id,
+                                     const std::string &dek_crypted,
+                                     int kek_version)
+{
+    std::string dek;
+    DEKCache &cache = dek_cache();
+    // a KEK no longer valid must fail as before, in decrypt_dek()
+    if (tokenizer_config().has_valid_master_key(kek_version)) {
+        if (cache.get(dek_id, kek_version, dek_crypted, dek))
+            return dek;
+    }
+    else
+        cache.invalidate_kek(kek_version);
+    dek = decrypt_dek(dek_crypted, kek_version);
+    cache.put(dek_id, kek_version, dek_crypted, dek);
+    return dek;
+}
+
 Domain::DataKey Tokenizer::use_dek(
         const std::string &plain_text, std::string &out)
 {
     Domain::DataKey data_key = dek_pool().get_active_data_key();
-    std::string dek = decrypt_dek(data_key.dek_crypted, data_key.kek_version);
+    std::string dek = get_dek(data_key.id.value(), data_key.dek_crypted,
+                              data_key.kek_version);
     std::string crypted = encrypt_data(dek, plain_text, card_tokenizer_);
     std::swap(crypted, out);
     data_key.counter = data_key.counter + 1;
@@ -810,8 +903,8 @@ const std::string Tokenizer::count_hmac(const std::string &plain_text,
 const std::string Tokenizer::count_hmac(const std::string &plain_text,
                                         int hmac_version)
 {
-    std::string hk = tokenizer_config().get_hmac_key(hmac_version);
-    return count_hmac(plain_text, hk);
+    return encode_base64(
+            tokenizer_config().hmac_digest(hmac_version, plain_text));
 }
 
 // vim:ts=4:sts=4:sw=4:et:
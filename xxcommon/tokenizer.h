@@ -4,6 +4,7 @@
 
 #include "http_post.h"
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <boost/tuple/tuple.hpp>
 #include <util/data_types.h>
@@ -11,14 +12,17 @@
 #include <orm/data_object.h>
 
 #include "utils.h"
+#include "aes_crypter.h"
 #include "conf_reader.h"
 #include "dek_pool.h"
+#include "dek_cache.h"
 
 #define TOKENIZER_CONFIG_SINGLETON
 
 typedef std::map<std::string, std::string> ConfigMap;
 typedef std::map<int, std::string> VersionMap;
 typedef std::map<int, bool> CheckMap;
+typedef std::map<int, HmacSha256> HmacMap;
 
 
 boost::tuple<std::string, double, int, std::string> get_keykeeper_controller(
@@ -27,14 +31,10 @@ boost::tuple<std::string, double, int, std::string> get_keykeeper_controller(
 class KeyKeeperAPI
 {
 public:
+    // uri may list the replicas separated with spaces, the first one
+    // is used, and the key reads may be hedged to the second one
     KeyKeeperAPI(const std::string &uri, double timeout, int part,
-                 Yb::ILogger *logger = NULL, bool ssl_validate_cert = true)
-        : logger_(logger), uri_(uri), timeout_(timeout), part_(part)
-        , ssl_validate_cert_(ssl_validate_cert)
-    {
-        YB_ASSERT(!uri_.empty());
-        YB_ASSERT(part_ == 1 || part_ == 2);
-    }
+                 Yb::ILogger *logger = NULL, bool ssl_validate_cert = true);
     const std::string recv_key_from_server(int kek_version);
     const std::string &get_key_by_version(int kek_version);
     void send_key_to_server(const std::string &key, int kek_version);
@@ -47,6 +47,7 @@ private:
     Yb::ILogger *logger_;
     Yb::String secret_;
     std::string uri_;
+    std::vector<std::string> replicas_;
     double timeout_;
     int part_;
     bool ssl_validate_cert_;
@@ -68,6 +69,7 @@ class TokenizerConfig
     VersionMap master_keys_;
     CheckMap valid_master_keys_;
     VersionMap hmac_keys_;
+    HmacMap hmac_ctxs_;
 
     mutable Yb::Mutex mux_;
     time_t ts_;
@@ -118,6 +120,7 @@ public:
         return get_master_key(get_active_master_key_version(), valid_only);
     }
     const VersionMap get_master_keys(bool valid_only = true) const;
+    bool has_valid_master_key(int version) const;
 
     int get_active_hmac_key_version() const;
     const std::string get_hmac_key(int version) const;
@@ -126,6 +129,8 @@ public:
     }
     const VersionMap get_hmac_keys() const;
     const std::vector<int> get_hmac_versions() const;
+    // HMAC-SHA256 of s with the key of the version, raw
+    const std::string hmac_digest(int version, const std::string &s) const;
 
     time_t get_ts() const { return ts_; }
     void reload(bool hmac_needed = true);
@@ -193,6 +198,11 @@ private:
 
     TokenizerConfig &tokenizer_config(bool hmac_needed = true);
     DEKPool &dek_pool();
+    DEKCache &dek_cache();
+
+    const std::string get_dek(Yb::LongInt dek_id,
+                              const std::string &dek_crypted,
+                              int kek_version);
 
     Domain::DataKey use_dek(
             const std::string &plain_text, std::string &out);
@@ -252,8 +262,8 @@ private:
 
     template <typename TokenClass>
     void do_detokenize(const std::string &token_string,
-                       std::string &dek_crypted, int &kek_version,
-                       std::string &data_crypted)
+                       Yb::LongInt &dek_id, std::string &dek_crypted,
+                       int &kek_version, std::string &data_crypted)
     {
         TokenClass data_token;
         data_token = Yb::template query<TokenClass>(session_)
@@ -261,6 +271,7 @@ private:
             .template join<Domain::DataKey>()
             .filter_by(TokenClass::c.token_string == token_string)
             .one();
+        dek_id = data_token.dek->id.value();
         dek_crypted = data_token.dek->dek_crypted;
         kek_version = data_token.dek->kek_version;
         data_crypted = data_token.data_crypted;
@@ -1,5 +1,6 @@
 // -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
-#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
 #include <openssl/sha.h>
 #include <iostream>
 #include <util/string_utils.h>
@@ -7,23 +8,68 @@
 #include "aes_crypter.h"
 #include "utils.h"
 
-#define TO_CONST_AES_KEY(s) reinterpret_cast<const AES_KEY *>((s).c_str())
 #define TO_CONST_UCHAR(s) reinterpret_cast<const unsigned char *>((s).c_str())
 
+static EVP_CIPHER_CTX *new_cipher_ctx(const std::string &key, int mode,
+                                      int enc)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        throw RunTimeError("can't allocate a cipher context");
+    const EVP_CIPHER *cipher = mode == AES_CRYPTER_CBC?
+        EVP_aes_256_cbc(): EVP_aes_256_ecb();
+    if (EVP_CipherInit_ex(ctx, cipher, NULL, TO_CONST_UCHAR(key),
+                          NULL, enc) != 1)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        throw RunTimeError("can't set up the AES key");
+    }
+    // the input is always a whole number of blocks
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    return ctx;
+}
+
 AESCrypter::AESCrypter(const std::string &key, int mode)
     : mode_(mode)
+    , encrypt_ctx_(NULL)
+    , decrypt_ctx_(NULL)
 {
     if (key.size() != AES_CRYPTER_KEY_SIZE_BYTES)
         throw AESBlockSizeException(AES_CRYPTER_KEY_SIZE_BYTES,
                 "expected AES key block size");
-    AES_KEY keybuf;
-    AES_set_encrypt_key(TO_CONST_UCHAR(key), AES_CRYPTER_KEY_SIZE,
-                        &keybuf);
-    encrypt_key_ = std::string((const char *)&keybuf, sizeof(AES_KEY));
-    AES_set_decrypt_key(TO_CONST_UCHAR(key), AES_CRYPTER_KEY_SIZE,
-                        &keybuf);
-    decrypt_key_ = std::string((const char *)&keybuf, sizeof(AES_KEY));
-    memset(&keybuf, 0, sizeof(AES_KEY));  // TODO: secure_erase
+    encrypt_ctx_ = new_cipher_ctx(key, mode_, 1);
+    try {
+        decrypt_ctx_ = new_cipher_ctx(key, mode_, 0);
+    }
+    catch (...) {
+        EVP_CIPHER_CTX_free(encrypt_ctx_);
+        throw;
+    }
+}
+
+AESCrypter::~AESCrypter()
+{
+    // this also wipes the key schedules
+    EVP_CIPHER_CTX_free(encrypt_ctx_);
+    EVP_CIPHER_CTX_free(decrypt_ctx_);
+}
+
+std::string AESCrypter::process(EVP_CIPHER_CTX *ctx, const std::string &input)
+{
+    // every call starts a new chain with the zero IV,
+    // the key schedule is kept
+    static const unsigned char zero_iv[AES_CRYPTER_BLOCK_SIZE_BYTES] = {0};
+    std::string result(input.size(), 0);
+    int out_len = 0;
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, zero_iv, -1) != 1 ||
+            EVP_CipherUpdate(ctx, (unsigned char *)&result[0], &out_len,
+                             TO_CONST_UCHAR(input), (int)input.size()) != 1 ||
+            out_len != (int)input.size())
+    {
+        OPENSSL_cleanse(&result[0], result.size());
+        throw RunTimeError("AES operation failed");
+    }
+    return result;
 }
 
 std::string AESCrypter::encrypt(const std::string &input_text)
@@ -34,39 +80,7 @@ std::string AESCrypter::encrypt(const std::string &input_text)
         throw AESBlockSizeException(AES_CRYPTER_BLOCK_SIZE_BYTES,
                 "input text size must be a multiple of AES block size");
     }
-    unsigned char *result = new unsigned char[input_text.size()];
-    try {
-        memset(result, 0, input_text.size());
-        unsigned char iv[AES_CRYPTER_BLOCK_SIZE_BYTES];
-        memset(iv, 0, AES_CRYPTER_BLOCK_SIZE_BYTES);
-        for (size_t offs = 0; offs < input_text.size();
-                offs += AES_CRYPTER_BLOCK_SIZE_BYTES)
-        {
-            if (mode_ == AES_CRYPTER_CBC)
-            {
-                memxor(iv, TO_CONST_UCHAR(input_text) + offs, AES_CRYPTER_BLOCK_SIZE_BYTES);
-            }
-            else
-            {
-                memcpy(iv, TO_CONST_UCHAR(input_text) + offs, AES_CRYPTER_BLOCK_SIZE_BYTES);
-            }
-            AES_encrypt(iv,
-                        result + offs, TO_CONST_AES_KEY(encrypt_key_));
-            if (mode_ == AES_CRYPTER_CBC)
-            {
-                memcpy(iv, result + offs, AES_CRYPTER_BLOCK_SIZE_BYTES);
-            }
-        }
-        std::string r((const char *)result, input_text.size());
-        memset(result, 0, input_text.size());  // TODO: secure_erase
-        delete [] result;
-        return r;
-    }
-    catch (...) {
-        memset(result, 0, input_text.size());  // TODO: secure_erase
-        delete [] result;
-        throw;
-    }
+    return process(encrypt_ctx_, input_text);
 }
 
 std::string AESCrypter::decrypt(const std::string &input_cipher)
@@ -77,36 +91,50 @@ std::string AESCrypter::decrypt(const std::string &input_cipher)
         throw AESBlockSizeException(AES_CRYPTER_BLOCK_SIZE_BYTES,
                 "input cipher size must be a multiple of AES block size");
     }
-    unsigned char *result = new unsigned char[input_cipher.size()];
-    try {
-        memset(result, 0, input_cipher.size());
-        unsigned char iv[AES_CRYPTER_BLOCK_SIZE_BYTES];
-        memset(iv, 0, AES_CRYPTER_BLOCK_SIZE_BYTES);
-        unsigned char iv_next[AES_CRYPTER_BLOCK_SIZE_BYTES];
-        memset(iv_next, 0, AES_CRYPTER_BLOCK_SIZE_BYTES);
-        for (size_t offs = 0; offs < input_cipher.size();
-                offs += AES_CRYPTER_BLOCK_SIZE_BYTES)
-        {
-            memcpy(iv_next, TO_CONST_UCHAR(input_cipher) + offs,
-                    AES_CRYPTER_BLOCK_SIZE_BYTES);
-            AES_decrypt(iv_next,
-                        result + offs, TO_CONST_AES_KEY(decrypt_key_));
-            if (mode_ == AES_CRYPTER_CBC)
-            {
-                memxor(result + offs, iv, AES_CRYPTER_BLOCK_SIZE_BYTES);
-                memcpy(iv, iv_next, AES_CRYPTER_BLOCK_SIZE_BYTES);
-            }
-        }
-        std::string r((const char *)result, input_cipher.size());
-        memset(result, 0, input_cipher.size());  // TODO: secure_erase
-        delete [] result;
-        return r;
+    return process(decrypt_ctx_, input_cipher);
+}
+
+struct AESCrypterCacheSlot
+{
+    std::string key;
+    int mode;
+    AESCrypterPtr crypter;
+};
+
+struct AESCrypterCache
+{
+    AESCrypterCacheSlot slots[AES_CRYPTER_CACHE_SIZE];
+    size_t next_victim;
+
+    AESCrypterCache(): next_victim(0) {}
+
+    ~AESCrypterCache()
+    {
+        for (size_t i = 0; i < AES_CRYPTER_CACHE_SIZE; ++i)
+            if (!slots[i].key.empty())
+                OPENSSL_cleanse(&slots[i].key[0], slots[i].key.size());
     }
-    catch (...) {
-        memset(result, 0, input_cipher.size());  // TODO: secure_erase
-        delete [] result;
-        throw;
+};
+
+AESCrypterPtr AESCrypter::for_key(const std::string &key, int mode)
+{
+    static thread_local AESCrypterCache cache;
+    for (size_t i = 0; i < AES_CRYPTER_CACHE_SIZE; ++i) {
+        AESCrypterCacheSlot &slot = cache.slots[i];
+        if (slot.crypter.get() && slot.mode == mode && slot.key == key)
+            return slot.crypter;
     }
+    AESCrypterPtr crypter(new AESCrypter(key, mode));
+    // the slots are reused round robin, a key that is still
+    // in use somewhere is simply expanded again next time
+    AESCrypterCacheSlot &slot = cache.slots[cache.next_victim];
+    cache.next_victim = (cache.next_victim + 1) % AES_CRYPTER_CACHE_SIZE;
+    if (!slot.key.empty())
+        OPENSSL_cleanse(&slot.key[0], slot.key.size());
+    slot.key = key;
+    slot.mode = mode;
+    slot.crypter = crypter;
+    return crypter;
 }
 
 AESBlockSizeException::AESBlockSizeException(int expected_size, const std::string &msg)
@@ -147,17 +175,47 @@ std::string &xor_buffer(std::string &buf, const std::string &second)
 
 const std::string hmac_sha256_digest(const std::string &hk, const std::string &s)
 {
-    const size_t block_size = 64;
-    std::string key = hk;
-    if (key.size() > block_size)
-        key = sha256_digest(key);
-    if (key.size() < block_size)
-        key += std::string(block_size - key.size(), 0);
-    std::string o_key_pad(block_size, 0x5c);
-    xor_buffer(o_key_pad, key);
-    std::string i_key_pad(block_size, 0x36);
-    xor_buffer(i_key_pad, key);
-    return sha256_digest(o_key_pad + sha256_digest(i_key_pad + s));
+    return HmacSha256(hk).digest(s);
+}
+
+HmacSha256::HmacSha256(const std::string &hk)
+{
+    unsigned char pad[SHA256_CBLOCK];
+    memset(pad, 0, sizeof(pad));
+    if (hk.size() > SHA256_CBLOCK)
+        SHA256((const unsigned char *)hk.data(), hk.size(), pad);
+    else
+        memcpy(pad, hk.data(), hk.size());
+    for (size_t i = 0; i < SHA256_CBLOCK; ++i)
+        pad[i] ^= 0x36;
+    SHA256_Init(&inner_);
+    SHA256_Update(&inner_, pad, SHA256_CBLOCK);
+    // 0x36 ^ 0x5c turns the inner pad into the outer one
+    for (size_t i = 0; i < SHA256_CBLOCK; ++i)
+        pad[i] ^= 0x36 ^ 0x5c;
+    SHA256_Init(&outer_);
+    SHA256_Update(&outer_, pad, SHA256_CBLOCK);
+    OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+HmacSha256::~HmacSha256()
+{
+    OPENSSL_cleanse(&inner_, sizeof(inner_));
+    OPENSSL_cleanse(&outer_, sizeof(outer_));
+}
+
+const std::string HmacSha256::digest(const std::string &s) const
+{
+    std::string out;
+    out.resize(SHA256_DIGEST_LENGTH);
+    unsigned char *md = (unsigned char *)&out[0];
+    SHA256_CTX ctx = inner_;
+    SHA256_Update(&ctx, s.data(), s.size());
+    SHA256_Final(md, &ctx);
+    ctx = outer_;
+    SHA256_Update(&ctx, md, SHA256_DIGEST_LENGTH);
+    SHA256_Final(md, &ctx);
+    return out;
 }
 
 std::string bcd_decode(const std::string &bcd_input)
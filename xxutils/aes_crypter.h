@@ -4,6 +4,9 @@
 
 #include <string>
 #include <stdexcept>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <util/data_types.h>
 #include "utils.h"
 
 #define AES_CRYPTER_BLOCK_SIZE 128
@@ -12,18 +15,38 @@
 #define AES_CRYPTER_KEY_SIZE_BYTES (AES_CRYPTER_KEY_SIZE / 8)
 #define AES_CRYPTER_ECB 0
 #define AES_CRYPTER_CBC 1
+#define AES_CRYPTER_CACHE_SIZE 16
 
+class AESCrypter;
+typedef Yb::SharedPtr<AESCrypter>::Type AESCrypterPtr;
+
+// AES-256 over EVP, which picks AES-NI where the CPU has it.
+// The key schedules are expanded once in the constructor, each call
+// then processes the whole buffer at once.  Not for concurrent use.
 class AESCrypter
 {
 public:
     AESCrypter(const std::string &key, int mode = AES_CRYPTER_ECB);
+    ~AESCrypter();
 
     std::string encrypt(const std::string &input_text);
     std::string decrypt(const std::string &input_cipher);
 
+    // a crypter kept by the calling thread for the last few keys used,
+    // so that a KEK is not expanded again on every call.  For the KEKs
+    // only: the slots are plain heap without expiry, DEKs are cached
+    // in DEKCache and get a crypter of their own per call
+    static AESCrypterPtr for_key(const std::string &key,
+                                 int mode = AES_CRYPTER_ECB);
+
 private:
     int mode_;
-    std::string encrypt_key_, decrypt_key_;
+    EVP_CIPHER_CTX *encrypt_ctx_, *decrypt_ctx_;
+
+    AESCrypter(const AESCrypter &);
+    AESCrypter &operator=(const AESCrypter &);
+
+    std::string process(EVP_CIPHER_CTX *ctx, const std::string &input);
 };
 
 class AESBlockSizeException: public RunTimeError
@@ -37,6 +60,20 @@ const std::string sha256_digest(const std::string &s);
 std::string &xor_buffer(std::string &buf, const std::string &second);
 const std::string hmac_sha256_digest(const std::string &hk, const std::string &s);
 
+// HMAC-SHA256 with the key absorbed into the inner and the outer hash
+// states once, a digest then only clones them
+class HmacSha256
+{
+public:
+    explicit HmacSha256(const std::string &hk);
+    ~HmacSha256();
+
+    const std::string digest(const std::string &s) const;
+
+private:
+    SHA256_CTX inner_, outer_;
+};
+
 std::string bcd_decode(const std::string &bcd_input);
 std::string bcd_encode(const std::string &ascii_input);
 
@@ -4,6 +4,8 @@
 #include "conf_reader.h"
 #include "utils.h"
 
+IConfig::IConfig(): generation_(0) {}
+
 IConfig::~IConfig() {}
 
 void IConfig::reload() {}
@@ -50,6 +52,7 @@ void XmlConfig::reload()
 {
     Yb::ScopedLock lock(config_mux_);
     config_ = load_tree(fname_);
+    ++generation_;
 }
 
 const Yb::String XmlConfig::get_value(const Yb::String &key)
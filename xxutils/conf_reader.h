@@ -4,6 +4,7 @@
 
 #include <memory>
 #include <string>
+#include <atomic>
 #include <util/element_tree.h>
 #include <util/thread.h>
 
@@ -12,6 +13,7 @@ class IConfig
 public:
     typedef std::auto_ptr<IConfig> Ptr;
 
+    IConfig();
     virtual ~IConfig();
     virtual void reload();
     virtual const Yb::String get_value(const Yb::String &key) = 0;
@@ -19,6 +21,12 @@ public:
 
     int get_value_as_int(const Yb::String &key);
     bool get_value_as_bool(const Yb::String &key);
+    // changes with each reload, the values cached elsewhere are
+    // to be read again then
+    int generation() const { return generation_; }
+
+protected:
+    std::atomic<int> generation_;
 };
 
 Yb::ElementTree::ElementPtr copy_etree(Yb::ElementTree::ElementPtr node0);
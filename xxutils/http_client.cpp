@@ -0,0 +1,982 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "http_client.h"
+#include <set>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <condition_variable>
+#include <cstring>
+#include <cmath>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <curl/multi.h>
+#include <util/thread.h>
+#include <util/utility.h>
+#include <util/string_utils.h>
+#include "tcp_socket.h"
+
+using namespace std;
+using namespace Yb;
+
+static const int MAX_EVENTS = 64;
+static const int MAX_WAIT_MSEC = 1000;
+// a streamed transfer is paused when its reader is this much behind
+static const size_t MAX_STREAM_BUFFER = 256 * 1024;
+
+static atomic<int> default_threads_(1);
+static atomic<int> default_max_idle_(32);
+static atomic<Yb::ILogger *> default_logger_(NULL);
+static atomic<unsigned long long> next_transfer_id_(1);
+
+HttpClientError::HttpClientError(const std::string &msg):
+    runtime_error(msg)
+{}
+
+struct HttpClientShare
+{
+    CURLSH *share;
+    Mutex mux[CURL_LOCK_DATA_LAST];
+
+    static void lock(CURL *, curl_lock_data data, curl_lock_access,
+                     void *self)
+    {
+        ((HttpClientShare *)self)->mux[data].lock();
+    }
+
+    static void unlock(CURL *, curl_lock_data data, void *self)
+    {
+        ((HttpClientShare *)self)->mux[data].unlock();
+    }
+
+    HttpClientShare(): share(curl_share_init())
+    {
+        if (!share)
+            throw HttpClientError("curl_share_init() failed");
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    ~HttpClientShare()
+    {
+        curl_share_cleanup(share);
+    }
+};
+
+// a request in flight, owns everything curl points to
+struct HttpTransfer
+{
+    unsigned long long id;      // tells a transfer from a reused address
+    CURL *curl;
+    curl_slist *hlist;
+    string body;
+    HttpResponse response;
+    HttpClientCallback callback;
+    SharedPtr<HttpStreamState>::Type stream;   // for open()
+
+    HttpTransfer()
+        : id(next_transfer_id_++), curl(NULL), hlist(NULL)
+        , response(HTTP_X, 0, "")
+    {}
+    ~HttpTransfer()
+    {
+        if (curl)
+            curl_easy_cleanup(curl);
+        if (hlist)
+            curl_slist_free_all(hlist);
+    }
+};
+
+typedef SharedPtr<HttpStreamState>::Type HttpStreamStatePtr;
+
+// shared by a streamed transfer and its reader
+struct HttpStreamState
+{
+    Mutex mux;
+    condition_variable_any cond;
+    HttpResponse head;
+    bool head_done;
+    string data;
+    bool paused;            // curl waits for the reader to take the data
+    bool done;
+    string error;
+    HttpClientLoop *loop;
+    HttpTransfer *transfer;     // only to be passed to the loop
+    unsigned long long transfer_id;
+
+    HttpStreamState(HttpClientLoop *owner, HttpTransfer *running)
+        : head(HTTP_X, 0, ""), head_done(false), paused(false)
+        , done(false), loop(owner), transfer(running)
+        , transfer_id(running->id)
+    {}
+};
+
+typedef std::function<void ()> HttpLoopAction;
+
+class HttpClientLoop: public Thread
+{
+public:
+    HttpClientLoop(int max_idle, Yb::ILogger *root_logger);
+    ~HttpClientLoop();
+    // called from the other threads, takes the ownership; once the
+    // loop is over the transfer fails at once
+    void post(HttpTransfer *transfer);
+    // these do nothing if the transfer is over already
+    void resume(HttpTransfer *transfer, unsigned long long id);
+    void cancel(HttpTransfer *transfer, unsigned long long id);
+    // runs the action on the loop thread, not before the given time
+    void post_timer(MilliSec at, const HttpLoopAction &action);
+    void stop();
+
+private:
+    int epfd_;
+    int evfd_;
+    CURLM *multi_;
+    MilliSec timer_at_;     // when curl wants its timeout action, or zero
+    int running_;
+    atomic<bool> stopping_;
+    Yb::ILogger::Ptr log_;
+    Mutex posted_mux_;
+    string exit_error_;     // the loop is over, if not empty
+    vector<HttpTransfer *> posted_;
+    struct Control
+    {
+        HttpTransfer *transfer;
+        unsigned long long id;
+        bool cancel;
+    };
+    vector<Control> controls_;
+    vector<pair<MilliSec, HttpLoopAction> > posted_timers_;
+    set<HttpTransfer *> active_;
+    multimap<MilliSec, HttpLoopAction> timers_;
+
+    void on_run();
+    void add_posted();
+    void post_control(HttpTransfer *transfer, unsigned long long id,
+                      bool cancel);
+    void run_timers();
+    void check_done();
+    void finish(HttpTransfer *transfer, const string &error);
+    void fail_all(const string &error);
+    static int on_socket(CURL *, curl_socket_t s, int what, void *loop,
+                         void *);
+    static int on_timer(CURLM *, long timeout_ms, void *loop);
+};
+
+HttpClientLoop::HttpClientLoop(int max_idle, Yb::ILogger *root_logger)
+    : epfd_(-1)
+    , evfd_(-1)
+    , multi_(NULL)
+    , timer_at_(0)
+    , running_(0)
+    , stopping_(false)
+    , log_(root_logger? root_logger->new_logger("http_client").release(): NULL)
+{
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ == -1)
+        throw HttpClientError("epoll_create1: " + TcpSocket::get_last_error());
+    evfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (evfd_ == -1) {
+        ::close(epfd_);
+        throw HttpClientError("eventfd: " + TcpSocket::get_last_error());
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = evfd_;
+    multi_ = curl_multi_init();
+    if (!multi_ || ::epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev) == -1) {
+        if (multi_)
+            curl_multi_cleanup(multi_);
+        ::close(evfd_);
+        ::close(epfd_);
+        throw HttpClientError("can't set up the HTTP client loop");
+    }
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, on_socket);
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, on_timer);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+    curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS, (long)max_idle);
+    curl_multi_setopt(multi_, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+}
+
+HttpClientLoop::~HttpClientLoop()
+{
+    fail_all("HTTP client is stopped");
+    curl_multi_cleanup(multi_);
+    ::close(evfd_);
+    ::close(epfd_);
+}
+
+void
+HttpClientLoop::post(HttpTransfer *transfer)
+{
+    string error;
+    {
+        ScopedLock lock(posted_mux_);
+        if (exit_error_.empty())
+            posted_.push_back(transfer);
+        else
+            error = exit_error_;
+    }
+    if (!error.empty()) {
+        finish(transfer, error);
+        return;
+    }
+    ::eventfd_write(evfd_, 1);
+}
+
+void
+HttpClientLoop::post_control(HttpTransfer *transfer, unsigned long long id,
+                             bool cancel)
+{
+    {
+        ScopedLock lock(posted_mux_);
+        Control control;
+        control.transfer = transfer;
+        control.id = id;
+        control.cancel = cancel;
+        controls_.push_back(control);
+    }
+    ::eventfd_write(evfd_, 1);
+}
+
+void
+HttpClientLoop::resume(HttpTransfer *transfer, unsigned long long id)
+{
+    post_control(transfer, id, false);
+}
+
+void
+HttpClientLoop::cancel(HttpTransfer *transfer, unsigned long long id)
+{
+    post_control(transfer, id, true);
+}
+
+void
+HttpClientLoop::post_timer(MilliSec at, const HttpLoopAction &action)
+{
+    {
+        ScopedLock lock(posted_mux_);
+        posted_timers_.push_back(make_pair(at, action));
+    }
+    ::eventfd_write(evfd_, 1);
+}
+
+void
+HttpClientLoop::stop()
+{
+    stopping_ = true;
+    ::eventfd_write(evfd_, 1);
+}
+
+int
+HttpClientLoop::on_socket(CURL *, curl_socket_t s, int what, void *loop,
+                          void *)
+{
+    HttpClientLoop *self = (HttpClientLoop *)loop;
+    if (what == CURL_POLL_REMOVE) {
+        ::epoll_ctl(self->epfd_, EPOLL_CTL_DEL, s, NULL);
+        return 0;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((what & CURL_POLL_IN)? EPOLLIN: 0) |
+        ((what & CURL_POLL_OUT)? EPOLLOUT: 0);
+    ev.data.fd = s;
+    if (::epoll_ctl(self->epfd_, EPOLL_CTL_MOD, s, &ev) == -1 &&
+            errno == ENOENT)
+        ::epoll_ctl(self->epfd_, EPOLL_CTL_ADD, s, &ev);
+    return 0;
+}
+
+int
+HttpClientLoop::on_timer(CURLM *, long timeout_ms, void *loop)
+{
+    HttpClientLoop *self = (HttpClientLoop *)loop;
+    self->timer_at_ = timeout_ms < 0? 0:
+        get_cur_time_millisec() + timeout_ms;
+    return 0;
+}
+
+void
+HttpClientLoop::add_posted()
+{
+    eventfd_t value;
+    ::eventfd_read(evfd_, &value);
+    vector<HttpTransfer *> posted;
+    vector<Control> controls;
+    vector<pair<MilliSec, HttpLoopAction> > timers;
+    {
+        ScopedLock lock(posted_mux_);
+        posted.swap(posted_);
+        controls.swap(controls_);
+        timers.swap(posted_timers_);
+    }
+    for (size_t i = 0; i < timers.size(); ++i)
+        timers_.insert(timers[i]);
+    for (size_t i = 0; i < posted.size(); ++i) {
+        CURLMcode mres = curl_multi_add_handle(multi_, posted[i]->curl);
+        if (mres != CURLM_OK)
+            finish(posted[i], "curl_multi_add_handle() failed: " +
+                   string(curl_multi_strerror(mres)));
+        else
+            active_.insert(posted[i]);
+    }
+    for (size_t i = 0; i < controls.size(); ++i) {
+        HttpTransfer *transfer = controls[i].transfer;
+        // the transfer may be over already
+        if (!active_.count(transfer) || transfer->id != controls[i].id)
+            continue;
+        if (controls[i].cancel) {
+            curl_multi_remove_handle(multi_, transfer->curl);
+            active_.erase(transfer);
+            finish(transfer, "transfer cancelled");
+        }
+        else
+            curl_easy_pause(transfer->curl, CURLPAUSE_CONT);
+    }
+}
+
+void
+HttpClientLoop::finish(HttpTransfer *transfer, const string &error)
+{
+    try {
+        transfer->callback(transfer->response, error);
+    }
+    catch (const std::exception &) {
+        // nowhere to report it
+    }
+    delete transfer;
+}
+
+void
+HttpClientLoop::run_timers()
+{
+    MilliSec now = get_cur_time_millisec();
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+        HttpLoopAction action = timers_.begin()->second;
+        timers_.erase(timers_.begin());
+        try {
+            action();
+        }
+        catch (const std::exception &) {
+            // nowhere to report it
+        }
+    }
+}
+
+void
+HttpClientLoop::check_done()
+{
+    CURLMsg *m;
+    int msgq = 0;
+    while ((m = curl_multi_info_read(multi_, &msgq)) != NULL) {
+        if (m->msg != CURLMSG_DONE)
+            continue;
+        CURL *curl = m->easy_handle;
+        CURLcode res = m->data.result;
+        char *priv = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+        HttpTransfer *transfer = (HttpTransfer *)priv;
+        curl_multi_remove_handle(multi_, curl);
+        active_.erase(transfer);
+        string error;
+        if (res != CURLE_OK)
+            error = "curl failed: " + to_stdstring((int)res) + ", " +
+                string(curl_easy_strerror(res));
+        finish(transfer, error);
+    }
+}
+
+void
+HttpClientLoop::fail_all(const string &error)
+{
+    for (set<HttpTransfer *>::iterator i = active_.begin();
+         i != active_.end(); ++i)
+    {
+        curl_multi_remove_handle(multi_, (*i)->curl);
+        finish(*i, error);
+    }
+    active_.clear();
+    vector<HttpTransfer *> posted;
+    {
+        ScopedLock lock(posted_mux_);
+        posted.swap(posted_);
+    }
+    for (size_t i = 0; i < posted.size(); ++i)
+        finish(posted[i], error);
+}
+
+void
+HttpClientLoop::on_run()
+{
+    struct epoll_event events[MAX_EVENTS];
+    string error = "HTTP client is stopped";
+    while (!stopping_) {
+        int wait_msec = MAX_WAIT_MSEC;
+        MilliSec wake_at = timer_at_;
+        if (!timers_.empty() && (!wake_at || timers_.begin()->first < wake_at))
+            wake_at = timers_.begin()->first;
+        if (wake_at) {
+            MilliSec left = wake_at - get_cur_time_millisec();
+            wait_msec = left <= 0? 0: (left < wait_msec? (int)left: wait_msec);
+        }
+        int n = ::epoll_wait(epfd_, events, MAX_EVENTS, wait_msec);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            error = "HTTP client loop failed: epoll_wait: " +
+                TcpSocket::get_last_error();
+            if (log_.get())
+                log_->error(error);
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == evfd_) {
+                add_posted();
+                continue;
+            }
+            int flags = 0;
+            if (events[i].events & EPOLLIN)
+                flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT)
+                flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(multi_, events[i].data.fd, flags,
+                                     &running_);
+        }
+        if (timer_at_ && timer_at_ <= get_cur_time_millisec()) {
+            timer_at_ = 0;
+            curl_multi_socket_action(multi_, CURL_SOCKET_TIMEOUT, 0,
+                                     &running_);
+        }
+        check_done();
+        run_timers();
+    }
+    // nothing is going to drive the transfers any more, neither
+    // the running ones nor those posted from now on
+    {
+        ScopedLock lock(posted_mux_);
+        exit_error_ = error;
+    }
+    fail_all(error);
+}
+
+HttpClientEngine &
+HttpClientEngine::instance()
+{
+    static HttpClientEngine engine(default_threads_, default_max_idle_,
+                                   default_logger_);
+    return engine;
+}
+
+void
+HttpClientEngine::set_default_threads(int n_threads)
+{
+    default_threads_ = n_threads;
+}
+
+void
+HttpClientEngine::set_default_max_idle(int max_idle)
+{
+    default_max_idle_ = max_idle;
+}
+
+int
+HttpClientEngine::default_max_idle()
+{
+    return default_max_idle_;
+}
+
+void
+HttpClientEngine::set_default_logger(Yb::ILogger *root_logger)
+{
+    default_logger_ = root_logger;
+}
+
+HttpClientEngine::HttpClientEngine(int n_threads, int max_idle,
+                                   Yb::ILogger *root_logger)
+    : share_(NULL)
+    , next_loop_(0)
+    , max_idle_(max_idle > 0? max_idle: 0)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    share_ = new HttpClientShare();
+    try {
+        for (int i = 0; i < (n_threads > 0? n_threads: 1); ++i)
+            loops_.push_back(new HttpClientLoop(max_idle_, root_logger));
+    }
+    catch (...) {
+        for (size_t i = 0; i < loops_.size(); ++i)
+            delete loops_[i];
+        delete share_;
+        throw;
+    }
+    for (size_t i = 0; i < loops_.size(); ++i)
+        loops_[i]->start();
+}
+
+HttpClientEngine::~HttpClientEngine()
+{
+    for (size_t i = 0; i < loops_.size(); ++i)
+        loops_[i]->stop();
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        loops_[i]->wait();
+        delete loops_[i];
+    }
+    delete share_;
+}
+
+static size_t store_body(char *data, size_t size, size_t nmemb,
+                         HttpResponse *writerData)
+{
+    if (writerData == NULL)
+        return 0;
+    writerData->put_body_piece(std::string(data, size * nmemb));
+    return size * nmemb;
+}
+
+static size_t store_header(char *data, size_t size, size_t nmemb,
+                           HttpResponse *writerData)
+{
+    if (writerData == NULL)
+        return 0;
+    writerData->put_header_line(std::string(data, size * nmemb));
+    return size * nmemb;
+}
+
+static curl_slist *append_header(curl_slist *hlist, const string &line)
+{
+    curl_slist *new_hlist = curl_slist_append(hlist, line.c_str());
+    if (!new_hlist)
+        throw HttpClientError("curl_slist_append() failed!");
+    return new_hlist;
+}
+
+static size_t stream_body(char *data, size_t size, size_t nmemb,
+                          HttpTransfer *transfer)
+{
+    HttpStreamState &stream = *transfer->stream;
+    {
+        ScopedLock lock(stream.mux);
+        if (stream.data.size() >= MAX_STREAM_BUFFER) {
+            // curl will offer the same data again after resume()
+            stream.paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        stream.data.append(data, size * nmemb);
+        if (!stream.head_done) {
+            stream.head = transfer->response;
+            stream.head_done = true;
+        }
+    }
+    stream.cond.notify_all();
+    return size * nmemb;
+}
+
+static size_t stream_header(char *data, size_t size, size_t nmemb,
+                            HttpTransfer *transfer)
+{
+    std::string line(data, size * nmemb);
+    transfer->response.put_header_line(line);
+    if (line != "\r\n" && line != "\n")
+        return size * nmemb;
+    // the end of the head, unless it's "100 Continue" or the like,
+    // or the reply of a proxy to CONNECT, which has no response code
+    long code = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code >= 200) {
+        HttpStreamState &stream = *transfer->stream;
+        {
+            ScopedLock lock(stream.mux);
+            if (!stream.head_done) {
+                stream.head = transfer->response;
+                stream.head_done = true;
+            }
+        }
+        stream.cond.notify_all();
+    }
+    return size * nmemb;
+}
+
+HttpTransfer *
+HttpClientEngine::new_transfer(const HttpClientRequest &request)
+{
+    std::auto_ptr<HttpTransfer> transfer(new HttpTransfer());
+    transfer->body = request.body;
+    CURL *curl = transfer->curl = curl_easy_init();
+    if (!curl)
+        throw HttpClientError("curl_easy_init() failed");
+    curl_easy_setopt(curl, CURLOPT_SHARE, share_->share);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (char *)transfer.get());
+    CURLcode res = curl_easy_setopt(curl, CURLOPT_URL, request.uri.c_str());
+    if (res != CURLE_OK)
+        throw HttpClientError(
+            "curl_easy_setopt(curl, CURLOPT_URL, uri) failed: " +
+            std::string(curl_easy_strerror(res)));
+
+    // curl sends the body right from the transfer, without copying it
+    if (!transfer->body.empty()) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE,
+                         (long)transfer->body.size());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, transfer->body.data());
+    }
+
+    // Content-Length is set by curl, and an empty Expect header saves
+    // the round trip of "100 Continue" for the larger bodies
+    auto i = request.headers.begin(), iend = request.headers.end();
+    for (; i != iend; ++i) {
+        if (StrUtils::str_to_lower(i->first) == "content-length")
+            continue;
+        transfer->hlist = append_header(transfer->hlist,
+                                        i->first + ": " + i->second);
+    }
+    if (!transfer->body.empty())
+        transfer->hlist = append_header(transfer->hlist, "Expect:");
+    if (transfer->hlist)
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->hlist);
+
+    if (request.http2) {
+        // plain http:// stays HTTP/1.1; the requests started while
+        // the first connection is being set up wait for it to tell
+        // whether it can multiplex, instead of opening their own
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    }
+    else
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_1_1);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 0L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    // rounded up, as zero would mean no timeout at all
+    if (request.timeout > 0)
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS,
+                         (long)std::ceil(request.timeout * 1000));
+    if (request.connect_timeout > 0)
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                         (long)std::ceil(request.connect_timeout * 1000));
+
+    // set client certificate
+    if (!request.client_cer.empty()) {
+        curl_easy_setopt(curl, CURLOPT_SSLCERT, request.client_cer.c_str());
+        curl_easy_setopt(curl, CURLOPT_SSLKEY, request.client_key.c_str());
+    }
+    if (!request.ssl_validate) {
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer->response);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, store_header);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer->response);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, store_body);
+    return transfer.release();
+}
+
+HttpClientLoop *
+HttpClientEngine::next_loop()
+{
+    return loops_[next_loop_++ % loops_.size()];
+}
+
+void
+HttpClientEngine::submit(const HttpClientRequest &request,
+                         const HttpClientCallback &callback)
+{
+    HttpTransfer *transfer = new_transfer(request);
+    transfer->callback = callback;
+    next_loop()->post(transfer);
+}
+
+typedef SharedPtr<std::promise<HttpResponse> >::Type ResponsePromisePtr;
+
+static HttpClientCallback fulfil(ResponsePromisePtr promise)
+{
+    return [promise](HttpResponse &response, const string &error) {
+        if (error.empty())
+            promise->set_value(response);
+        else
+            promise->set_exception(
+                    std::make_exception_ptr(HttpClientError(error)));
+    };
+}
+
+std::future<HttpResponse>
+HttpClientEngine::submit(const HttpClientRequest &request)
+{
+    ResponsePromisePtr promise(new std::promise<HttpResponse>());
+    std::future<HttpResponse> result = promise->get_future();
+    submit(request, fulfil(promise));
+    return result;
+}
+
+HttpHedgePolicy::HttpHedgePolicy(int percentile, int budget_percent,
+                                 int min_delay)
+    : percentile_(percentile < 1? 1: (percentile > 100? 100: percentile))
+    , earn_(budget_percent)
+    , min_delay_(min_delay)
+    , next_sample_(0)
+    , n_recorded_(0)
+    , delay_(-1)
+    , budget_(0)
+{}
+
+int
+HttpHedgePolicy::start()
+{
+    ScopedLock lock(mux_);
+    // let a few hedges be saved up for a burst
+    budget_ = std::min(budget_ + earn_, 1000);
+    return delay_;
+}
+
+bool
+HttpHedgePolicy::spend()
+{
+    ScopedLock lock(mux_);
+    if (budget_ < 100)
+        return false;
+    budget_ -= 100;
+    return true;
+}
+
+void
+HttpHedgePolicy::record(int latency)
+{
+    ScopedLock lock(mux_);
+    if (samples_.size() < SAMPLES)
+        samples_.push_back(latency);
+    else
+        samples_[next_sample_] = latency;
+    next_sample_ = (next_sample_ + 1) % SAMPLES;
+    ++n_recorded_;
+    // the percentile needn't follow each call
+    if (samples_.size() >= MIN_SAMPLES &&
+            (delay_ < 0 || !(n_recorded_ % RECALC_EVERY)))
+        recalc();
+}
+
+void
+HttpHedgePolicy::recalc()
+{
+    vector<int> sorted(samples_);
+    size_t idx = (sorted.size() * percentile_ + 99) / 100;
+    idx = idx? idx - 1: 0;
+    nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+    delay_ = std::max(sorted[idx], min_delay_);
+}
+
+// a request sent to one replica, and to another one if it's slow
+struct HttpHedgedCall
+{
+    Mutex mux;
+    HttpClientLoop *loop;
+    HttpClientRequest hedge_request;
+    HttpHedgePolicyPtr policy;
+    HttpHedgedCallback callback;
+    MilliSec started;
+    MilliSec hedge_started;
+    bool done;
+    int running;
+    HttpTransfer *transfers[2];     // only to be passed to the loop
+    unsigned long long ids[2];
+};
+
+typedef SharedPtr<HttpHedgedCall>::Type HttpHedgedCallPtr;
+
+static void complete_hedged(HttpHedgedCallPtr call, int idx,
+                            HttpResponse &response, const string &error)
+{
+    HttpTransfer *other = NULL;
+    unsigned long long other_id = 0;
+    HttpHedgeOutcome outcome;
+    {
+        ScopedLock lock(call->mux);
+        call->transfers[idx] = NULL;
+        --call->running;
+        if (call->done)
+            return;
+        // an error is only reported if the other one can't do better
+        if (!error.empty() && call->running > 0)
+            return;
+        call->done = true;
+        other = call->transfers[1 - idx];
+        other_id = call->ids[1 - idx];
+        outcome.hedged = call->ids[1] != 0;
+        outcome.winner = idx;
+        outcome.hedge_started = call->hedge_started;
+    }
+    if (other)
+        call->loop->cancel(other, other_id);
+    if (error.empty())
+        call->policy->record(get_cur_time_millisec() - call->started);
+    call->callback(response, error, outcome);
+}
+
+void
+HttpClientEngine::submit_hedged(const HttpClientRequest &request,
+                                const std::string &hedge_uri,
+                                HttpHedgePolicyPtr policy,
+                                const HttpHedgedCallback &callback)
+{
+    int delay = policy? policy->start(): -1;
+    if (delay < 0 || hedge_uri.empty()) {
+        // there's nothing to tell how slow is slow yet
+        MilliSec started = get_cur_time_millisec();
+        submit(request, [policy, callback, started]
+               (HttpResponse &response, const string &error) {
+            if (policy && error.empty())
+                policy->record(get_cur_time_millisec() - started);
+            callback(response, error, HttpHedgeOutcome());
+        });
+        return;
+    }
+    HttpHedgedCallPtr call(new HttpHedgedCall());
+    call->loop = next_loop();
+    call->hedge_request = request;
+    call->hedge_request.uri = hedge_uri;
+    call->policy = policy;
+    call->callback = callback;
+    call->started = get_cur_time_millisec();
+    call->hedge_started = 0;
+    call->done = false;
+    call->running = 1;
+    call->transfers[1] = NULL;
+    call->ids[1] = 0;
+    HttpTransfer *transfer = new_transfer(request);
+    transfer->callback = [call](HttpResponse &response, const string &error) {
+        complete_hedged(call, 0, response, error);
+    };
+    call->transfers[0] = transfer;
+    call->ids[0] = transfer->id;
+    call->loop->post(transfer);
+    call->loop->post_timer(call->started + delay, [this, call]() {
+        send_hedge(call);
+    });
+}
+
+void
+HttpClientEngine::send_hedge(HttpHedgedCallPtr call)
+{
+    ScopedLock lock(call->mux);
+    if (call->done || !call->policy->spend())
+        return;
+    HttpTransfer *transfer = new_transfer(call->hedge_request);
+    transfer->callback = [call](HttpResponse &response, const string &error) {
+        complete_hedged(call, 1, response, error);
+    };
+    call->transfers[1] = transfer;
+    call->ids[1] = transfer->id;
+    call->hedge_started = get_cur_time_millisec();
+    ++call->running;
+    call->loop->post(transfer);
+}
+
+std::future<HttpResponse>
+HttpClientEngine::submit_hedged(const HttpClientRequest &request,
+                                const std::string &hedge_uri,
+                                HttpHedgePolicyPtr policy,
+                                HttpHedgeOutcome *outcome)
+{
+    ResponsePromisePtr promise(new std::promise<HttpResponse>());
+    std::future<HttpResponse> result = promise->get_future();
+    HttpClientCallback done = fulfil(promise);
+    submit_hedged(request, hedge_uri, policy, [done, outcome]
+                  (HttpResponse &response, const string &error,
+                   const HttpHedgeOutcome &call_outcome) {
+        if (outcome)
+            *outcome = call_outcome;
+        done(response, error);
+    });
+    return result;
+}
+
+HttpClientStreamPtr
+HttpClientEngine::open(const HttpClientRequest &request)
+{
+    std::auto_ptr<HttpTransfer> transfer(new_transfer(request));
+    HttpClientLoop *loop = next_loop();
+    HttpStreamStatePtr state(new HttpStreamState(loop, transfer.get()));
+    transfer->stream = state;
+    CURL *curl = transfer->curl;
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer.get());
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, stream_header);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer.get());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_body);
+    transfer->callback = [state](HttpResponse &response,
+                                 const string &error) {
+        {
+            ScopedLock lock(state->mux);
+            if (!state->head_done && error.empty()) {
+                state->head = response;
+                state->head_done = true;
+            }
+            state->done = true;
+            state->error = error;
+        }
+        state->cond.notify_all();
+    };
+    HttpClientStreamPtr stream(new HttpClientStream(state));
+    loop->post(transfer.release());
+    return stream;
+}
+
+HttpClientStream::HttpClientStream(HttpStreamStatePtr state)
+    : state_(state)
+{}
+
+HttpClientStream::~HttpClientStream()
+{
+    bool running;
+    {
+        ScopedLock lock(state_->mux);
+        running = !state_->done;
+    }
+    if (running)
+        state_->loop->cancel(state_->transfer, state_->transfer_id);
+}
+
+const HttpResponse
+HttpClientStream::head()
+{
+    ScopedLock lock(state_->mux);
+    while (!state_->head_done && !state_->done)
+        state_->cond.wait(lock);
+    if (!state_->head_done)
+        throw HttpClientError(state_->error);
+    return state_->head;
+}
+
+bool
+HttpClientStream::read(std::string &piece)
+{
+    bool resume;
+    {
+        ScopedLock lock(state_->mux);
+        while (state_->data.empty() && !state_->done)
+            state_->cond.wait(lock);
+        if (state_->data.empty()) {
+            if (!state_->error.empty())
+                throw HttpClientError(state_->error);
+            return false;
+        }
+        piece.clear();
+        piece.swap(state_->data);
+        resume = state_->paused;
+        state_->paused = false;
+    }
+    if (resume)
+        state_->loop->resume(state_->transfer, state_->transfer_id);
+    return true;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
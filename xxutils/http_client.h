@@ -0,0 +1,187 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__HTTP_CLIENT_H
+#define CARD_PROXY__HTTP_CLIENT_H
+
+#include <string>
+#include <vector>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <stdexcept>
+#include <util/nlogger.h>
+#include <util/thread.h>
+#include "http_message.h"
+
+class HttpClientError: public std::runtime_error
+{
+public:
+    HttpClientError(const std::string &msg);
+};
+
+// What is to be sent, the URI already includes the query string
+struct HttpClientRequest
+{
+    std::string uri;
+    std::string method;
+    Yb::StringDict headers;
+    std::string body;
+    double timeout;             // seconds, zero for none
+    double connect_timeout;     // seconds, zero for curl's default
+    bool ssl_validate;
+    std::string client_cer;
+    std::string client_key;
+    // negotiate HTTP/2 for https:// and multiplex the concurrent
+    // requests to the same host over one connection
+    bool http2;
+
+    HttpClientRequest()
+        : method("POST"), timeout(0), connect_timeout(0)
+        , ssl_validate(true), http2(false)
+    {}
+};
+
+// Called on an engine thread when the transfer is over, the error is
+// empty on success.  It must not block: the other transfers of the same
+// thread wait for it.
+typedef std::function<void (HttpResponse &response, const std::string &error)>
+    HttpClientCallback;
+
+class HttpClientLoop;
+struct HttpClientShare;
+struct HttpTransfer;
+struct HttpStreamState;
+struct HttpHedgedCall;
+
+// When a request to a target is worth a second copy to another replica:
+// after the given percentile of the target's recent latencies.  Each
+// call earns budget_percent of a hedge, so the extra load stays within
+// that share of the calls.  Shared by all the calls to the target.
+class HttpHedgePolicy
+{
+public:
+    HttpHedgePolicy(int percentile, int budget_percent, int min_delay);
+    // msec to wait for the response before hedging, -1 for no hedging:
+    // there are too few latencies known yet; counts the call
+    int start();
+    // a hedge is about to be sent, false if it's over the budget
+    bool spend();
+    // the latency of the response which has won
+    void record(int latency);
+
+private:
+    enum { SAMPLES = 256, MIN_SAMPLES = 20, RECALC_EVERY = 16 };
+
+    Yb::Mutex mux_;
+    int percentile_;
+    int earn_;
+    int min_delay_;
+    std::vector<int> samples_;
+    size_t next_sample_;
+    int n_recorded_;
+    int delay_;
+    int budget_;                // in percent of a hedge
+
+    void recalc();
+};
+
+typedef Yb::SharedPtr<HttpHedgePolicy>::Type HttpHedgePolicyPtr;
+
+// Which transfer of a hedged call has made its response or its error:
+// 0 - the one to the first URI, 1 - the hedge.  The loser, if the hedge
+// has been sent at all, has been cancelled.
+struct HttpHedgeOutcome
+{
+    bool hedged;
+    int winner;
+    Yb::MilliSec hedge_started;
+
+    HttpHedgeOutcome(): hedged(false), winner(0), hedge_started(0) {}
+};
+
+typedef std::function<void (HttpResponse &response, const std::string &error,
+                            const HttpHedgeOutcome &outcome)>
+    HttpHedgedCallback;
+
+// The response of a transfer started with HttpClientEngine::open(),
+// its body is handed out while it's still being received.  When the
+// reader falls behind, the transfer is paused.
+class HttpClientStream: public HttpBodyStream
+{
+public:
+    explicit HttpClientStream(Yb::SharedPtr<HttpStreamState>::Type state);
+    // cancels the transfer if it's still running
+    ~HttpClientStream();
+    // blocks until the status line and the headers have arrived,
+    // throws HttpClientError if the transfer has failed before that
+    const HttpResponse head();
+    // throws HttpClientError if the transfer fails in the middle
+    bool read(std::string &piece);
+
+private:
+    Yb::SharedPtr<HttpStreamState>::Type state_;
+};
+
+typedef Yb::SharedPtr<HttpClientStream>::Type HttpClientStreamPtr;
+
+// Asynchronous HTTP client: a few event loop threads, each of them
+// driving its own curl multi handle with curl_multi_socket_action()
+// and epoll.  The connections stay in the multi handles' caches between
+// the requests, DNS and TLS session caches are shared by all the loops.
+class HttpClientEngine
+{
+public:
+    // the process-wide engine, it's started on the first use
+    static HttpClientEngine &instance();
+    // these only have effect before the first instance() call
+    static void set_default_threads(int n_threads);
+    static void set_default_max_idle(int max_idle);
+    static int default_max_idle();
+    // where the loop threads report their failures, not owned
+    static void set_default_logger(Yb::ILogger *root_logger);
+
+    // max_idle is the number of idle connections kept by each thread
+    HttpClientEngine(int n_threads, int max_idle,
+                     Yb::ILogger *root_logger = NULL);
+    ~HttpClientEngine();
+
+    // throws HttpClientError if the request can't be set up,
+    // the transfer errors are passed to the callback, as well as the
+    // failure of the loop thread, which fails the transfers at once
+    void submit(const HttpClientRequest &request,
+                const HttpClientCallback &callback);
+    // the future throws HttpClientError on a transfer error
+    std::future<HttpResponse> submit(const HttpClientRequest &request);
+    // starts the transfer and returns at once, the response is to be
+    // read from the stream
+    HttpClientStreamPtr open(const HttpClientRequest &request);
+    // For the idempotent requests only: if there's no response after
+    // the policy's delay, the same request is sent to hedge_uri too.
+    // The first response wins and the other transfer is cancelled.
+    void submit_hedged(const HttpClientRequest &request,
+                       const std::string &hedge_uri,
+                       HttpHedgePolicyPtr policy,
+                       const HttpHedgedCallback &callback);
+    // the outcome, if given, is filled in before the future is ready
+    std::future<HttpResponse> submit_hedged(const HttpClientRequest &request,
+                                            const std::string &hedge_uri,
+                                            HttpHedgePolicyPtr policy,
+                                            HttpHedgeOutcome *outcome = NULL);
+    int max_idle() const { return max_idle_; }
+
+private:
+    HttpClientShare *share_;
+    std::vector<HttpClientLoop *> loops_;
+    std::atomic<size_t> next_loop_;
+    int max_idle_;
+
+    HttpTransfer *new_transfer(const HttpClientRequest &request);
+    HttpClientLoop *next_loop();
+    void send_hedge(Yb::SharedPtr<HttpHedgedCall>::Type call);
+
+    // non-copyable
+    HttpClientEngine(const HttpClientEngine &);
+    HttpClientEngine &operator=(const HttpClientEngine &);
+};
+
+#endif // CARD_PROXY__HTTP_CLIENT_H
+// vim:ts=4:sts=4:sw=4:et:
@@ -1,5 +1,6 @@
 #include "http_message.h"
 #include <stdio.h>
+#include <ctype.h>
 #include <sstream>
 #include <util/string_utils.h>
 
@@ -65,6 +66,7 @@ HttpRequest::HttpRequest(const Yb::String &method, const Yb::String &uri, int pr
     : HttpMessage(proto_ver)
     , method_(Yb::StrUtils::str_to_upper(method))
     , uri_(uri)
+    , deadline_(0)
 {
     if (!Yb::str_length(method))
         throw HttpParserError("HttpRequest", "Empty HTTP method");
@@ -178,16 +180,22 @@ HttpResponse::HttpResponse(int proto_ver, int resp_code, const Yb::String &resp_
 }
 
 const std::string
-HttpResponse::serialize() const
+HttpResponse::serialize_head() const
 {
     std::ostringstream out;
     out << NARROW(get_proto_str()) << " "
         << resp_code_ << " "
         << NARROW(resp_desc_) << "\n"
-        << serialize_headers() << "\n" << body();
+        << serialize_headers() << "\n";
     return out.str();
 }
 
+const std::string
+HttpResponse::serialize() const
+{
+    return serialize_head() + body();
+}
+
 void
 HttpResponse::set_response_body(const std::string &body,
                                 const Yb::String &content_type,
@@ -205,23 +213,73 @@ HttpResponse::parse_status(const Yb::String &line)
 {
     std::vector<Yb::String> parts;
     split_str_by_chars(trim_trailing_space(line), _T(" "), parts, 3);
-    if (parts.size() == 3
+    // HTTP/2 has no reason phrase, curl passes on "HTTP/2 200 "
+    if ((parts.size() == 2 || parts.size() == 3)
             && starts_with(str_to_upper(parts[0]), _T("HTTP/")))
     {
         int http_code;
         Yb::from_string(parts[1], http_code);
-        Yb::String reason_phrase = trim_trailing_space(parts[2]);
+        Yb::String reason_phrase;
+        if (parts.size() == 3)
+            reason_phrase = trim_trailing_space(parts[2]);
+        if (!Yb::str_length(reason_phrase))
+            reason_phrase = default_reason(http_code);
         return std::make_pair(http_code, reason_phrase);
     }
     return std::make_pair(0, Yb::String());
 }
 
+const Yb::String
+HttpResponse::default_reason(int resp_code)
+{
+    switch (resp_code) {
+        case 100: return _T("Continue");
+        case 200: return _T("OK");
+        case 201: return _T("Created");
+        case 202: return _T("Accepted");
+        case 204: return _T("No Content");
+        case 206: return _T("Partial Content");
+        case 301: return _T("Moved Permanently");
+        case 302: return _T("Found");
+        case 304: return _T("Not Modified");
+        case 400: return _T("Bad Request");
+        case 401: return _T("Unauthorized");
+        case 403: return _T("Forbidden");
+        case 404: return _T("Not Found");
+        case 405: return _T("Method Not Allowed");
+        case 408: return _T("Request Timeout");
+        case 409: return _T("Conflict");
+        case 413: return _T("Payload Too Large");
+        case 429: return _T("Too Many Requests");
+        case 500: return _T("Internal Server Error");
+        case 501: return _T("Not Implemented");
+        case 502: return _T("Bad Gateway");
+        case 503: return _T("Service Unavailable");
+        case 504: return _T("Gateway Timeout");
+    }
+    return resp_code < 200? _T("Informational"):
+           resp_code < 300? _T("Success"):
+           resp_code < 400? _T("Redirection"):
+           resp_code < 500? _T("Client Error"): _T("Server Error");
+}
+
+// "HTTP/1.0", "HTTP/1.1", "HTTP/2" and the like, the prefix is checked
+static int status_proto_ver(const std::string &line)
+{
+    if (line.size() < 6 || !isdigit((unsigned char)line[5]))
+        return HTTP_1_1;
+    int ver = (line[5] - '0') * 10;
+    if (line.size() > 7 && line[6] == '.' && isdigit((unsigned char)line[7]))
+        ver += line[7] - '0';
+    return ver;
+}
+
 void
 HttpResponse::put_header_line(const std::string &line)
 {
     std::pair<int, Yb::String> st = parse_status(WIDEN(line));
     if (st.first) {
-        proto_ver_ = HTTP_1_1;
+        proto_ver_ = status_proto_ver(line);
         resp_code_ = st.first;
         resp_desc_ = st.second;
         headers_ = Yb::StringDict();
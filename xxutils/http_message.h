@@ -7,8 +7,13 @@ enum {
     HTTP_X = 0,
     HTTP_1_0 = 10,
     HTTP_1_1 = 11,
+    HTTP_2_0 = 20,
 };
 
+// The time left for the request in millisec, as the client sees it.
+// It's passed on to the upstream calls with what's left of it.
+#define HTTP_TIMEOUT_HEADER "X-Request-Timeout-Ms"
+
 
 class HttpParserError: public std::runtime_error
 {
@@ -31,6 +36,20 @@ public:
 };
 
 
+// A body which is produced while it's being sent,
+// see HttpResponse::set_body_stream()
+class HttpBodyStream
+{
+public:
+    virtual ~HttpBodyStream() {}
+    // blocks until the next piece is there, returns false at the end
+    // of the body, throws if the body can't be completed
+    virtual bool read(std::string &piece) = 0;
+};
+
+typedef Yb::SharedPtr<HttpBodyStream>::Type HttpBodyStreamPtr;
+
+
 class HttpMessage
 {
 public:
@@ -40,6 +59,8 @@ public:
 
     int proto_ver() const { return proto_ver_; }
 
+    void set_proto_ver(int proto_ver) { proto_ver_ = proto_ver; }
+
     const Yb::String get_proto_str() const
     {
         return _T("HTTP/") + Yb::to_string(proto_ver_ / 10) +
@@ -63,6 +84,11 @@ public:
         headers_[normalize_header_name(header)] = value;
     }
 
+    void remove_header(const Yb::String &header)
+    {
+        headers_.erase(normalize_header_name(header));
+    }
+
     void set_headers(const Yb::StringDict &h)
     {
         headers_ = h;
@@ -147,6 +173,11 @@ public:
 
     const Yb::StringDict &params() const { return params_; }
 
+    // when the response is due, in millisec since the epoch, zero for
+    // no limit; the upstream calls made for the request are capped by it
+    long long deadline() const { return deadline_; }
+
+    void set_deadline(long long deadline) { deadline_ = deadline; }
 
     static const Yb::StringDict parse_params(const Yb::String &s);
 
@@ -160,6 +191,7 @@ private:
     Yb::String uri_;
     Yb::String path_;
     Yb::StringDict params_;
+    long long deadline_;
 };
 
 
@@ -170,13 +202,19 @@ public:
 
     virtual const std::string serialize() const;
 
+    // the status line and the headers, up to the body
+    const std::string serialize_head() const;
+
     void set_response_body(const std::string &body,
                            const Yb::String &content_type,
                            bool set_content_length=true);
 
+    // the reason phrase, if missing, is the standard one for the code
     static const std::pair<int, Yb::String>
         parse_status(const Yb::String &line);
 
+    static const Yb::String default_reason(int resp_code);
+
     void put_header_line(const std::string &line);
     void put_body_piece(const std::string &line);
 
@@ -184,9 +222,16 @@ public:
 
     const Yb::String &resp_desc() const { return resp_desc_; }
 
+    // the body is sent piece by piece as the stream yields it,
+    // body() is ignored then
+    void set_body_stream(HttpBodyStreamPtr stream) { body_stream_ = stream; }
+
+    HttpBodyStreamPtr body_stream() const { return body_stream_; }
+
 private:
     int resp_code_;  // 200 404 ...
     Yb::String resp_desc_;
+    HttpBodyStreamPtr body_stream_;
 };
 
 #endif // _AUTH__HTTP_MESSAGE_H_
@@ -0,0 +1,279 @@
+#include "http_parser.h"
+#include <cstring>
+#include <climits>
+
+static inline char
+lower_char(char c)
+{
+    return (c >= 'A' && c <= 'Z')? c - 'A' + 'a': c;
+}
+
+static inline bool
+is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+bool
+HttpStrRef::equals_nocase(const char *buf, const char *s) const
+{
+    size_t i = 0;
+    for (; i < len && s[i]; ++i)
+        if (lower_char(buf[pos + i]) != lower_char(s[i]))
+            return false;
+    return i == len && !s[i];
+}
+
+HttpRequestParser::HttpRequestParser(size_t max_head_size,
+                                     size_t max_body_size)
+    : max_head_size_(max_head_size)
+    , max_body_size_(max_body_size)
+{
+    reset();
+}
+
+void
+HttpRequestParser::reset()
+{
+    state_ = S_START;
+    pos_ = 0;
+    token_start_ = token_end_ = 0;
+    method_ = uri_ = version_ = cur_name_ = HttpStrRef();
+    proto_ver_ = HTTP_X;
+    headers_.clear();
+    head_len_ = body_len_ = 0;
+    in_value_ = folded_ = false;
+}
+
+bool
+HttpRequestParser::parse(const char *buf, size_t size)
+{
+    while (pos_ < size && state_ < S_BODY) {
+        char c = buf[pos_];
+        switch (state_) {
+        case S_START:
+            // some clients send an extra CRLF after a POST body
+            if (c == '\r' || c == '\n')
+                break;
+            if (is_blank(c))
+                throw HttpParserError("parse", "bad request line");
+            token_start_ = pos_;
+            state_ = S_METHOD;
+            break;
+        case S_METHOD:
+            if (c == ' ') {
+                method_.pos = token_start_;
+                method_.len = pos_ - token_start_;
+                state_ = S_URI_START;
+            }
+            else if (c == '\r' || c == '\n' || c == '\t')
+                throw HttpParserError("parse", "bad request line");
+            break;
+        case S_URI_START:
+        case S_VERSION_START:
+            if (c == '\r' || c == '\n')
+                throw HttpParserError("parse", "bad request line");
+            if (!is_blank(c)) {
+                token_start_ = pos_;
+                token_end_ = pos_ + 1;
+                state_ = state_ == S_URI_START? S_URI: S_VERSION;
+            }
+            break;
+        case S_URI:
+            if (is_blank(c)) {
+                uri_.pos = token_start_;
+                uri_.len = pos_ - token_start_;
+                state_ = S_VERSION_START;
+            }
+            else if (c == '\r' || c == '\n')
+                throw HttpParserError("parse", "bad request line");
+            break;
+        case S_VERSION:
+            if (c == '\r' || c == '\n') {
+                finish_request_line(buf);
+                state_ = c == '\r'? S_LINE_LF: S_HEADER_START;
+            }
+            else if (!is_blank(c))
+                token_end_ = pos_ + 1;
+            break;
+        case S_LINE_LF:
+        case S_HEADER_LF:
+            if (c != '\n')
+                throw HttpParserError("parse", "bare CR in request head");
+            state_ = S_HEADER_START;
+            break;
+        case S_HEADER_START:
+            if (c == '\r')
+                state_ = S_HEAD_END_LF;
+            else if (c == '\n')
+                finish_head(buf);
+            else if (is_blank(c)) {
+                // obs-fold: the previous header value continues
+                if (headers_.empty())
+                    throw HttpParserError("parse_header_line",
+                                          "Header format is wrong");
+                const HttpHeaderRef &h = headers_.back();
+                cur_name_ = h.name;
+                in_value_ = h.value.len > 0;
+                token_start_ = h.value.pos;
+                token_end_ = h.value.pos + h.value.len;
+                folded_ = true;
+                headers_.pop_back();
+                state_ = S_VALUE_START;
+            }
+            else if (c == ':')
+                throw HttpParserError("parse_header_line",
+                                      "Header format is wrong");
+            else {
+                token_start_ = pos_;
+                token_end_ = pos_ + 1;
+                state_ = S_HEADER_NAME;
+            }
+            break;
+        case S_HEADER_NAME:
+            if (c == ':') {
+                cur_name_.pos = token_start_;
+                cur_name_.len = token_end_ - token_start_;
+                in_value_ = folded_ = false;
+                state_ = S_VALUE_START;
+            }
+            else if (c == '\r' || c == '\n')
+                throw HttpParserError("parse_header_line",
+                                      "Header format is wrong");
+            // RFC 7230 3.2.4: other parsers may read "Name :" otherwise
+            else if (is_blank(c))
+                throw HttpParserError("parse_header_line",
+                                      "whitespace in header name");
+            else
+                token_end_ = pos_ + 1;
+            break;
+        case S_VALUE_START:
+        case S_VALUE:
+            if (c == '\r' || c == '\n') {
+                finish_header();
+                state_ = c == '\r'? S_HEADER_LF: S_HEADER_START;
+            }
+            else if (!is_blank(c)) {
+                if (!in_value_) {
+                    token_start_ = pos_;
+                    in_value_ = true;
+                }
+                token_end_ = pos_ + 1;
+                state_ = S_VALUE;
+            }
+            break;
+        case S_HEAD_END_LF:
+            if (c != '\n')
+                throw HttpParserError("parse", "bare CR in request head");
+            finish_head(buf);
+            break;
+        }
+        ++pos_;
+    }
+    if (state_ < S_BODY) {
+        if (pos_ > max_head_size_)
+            throw HttpParserError("parse", "request head is too long");
+        return false;
+    }
+    if (state_ == S_BODY && size >= head_len_ + body_len_)
+        state_ = S_DONE;
+    return state_ == S_DONE;
+}
+
+void
+HttpRequestParser::finish_request_line(const char *buf)
+{
+    version_.pos = token_start_;
+    version_.len = token_end_ - token_start_;
+    const char *v = buf + version_.pos;
+    if (!version_.equals_nocase(buf, "HTTP/1.0") &&
+            !version_.equals_nocase(buf, "HTTP/1.1"))
+        throw HttpParserError("parse_version", "Unrecognized HTTP version: " +
+                              version_.str(buf));
+    proto_ver_ = (v[5] - '0') * 10 + (v[7] - '0');
+}
+
+void
+HttpRequestParser::finish_header()
+{
+    HttpHeaderRef h;
+    h.name = cur_name_;
+    if (in_value_) {
+        h.value.pos = token_start_;
+        h.value.len = token_end_ - token_start_;
+    }
+    h.folded = folded_;
+    headers_.push_back(h);
+}
+
+void
+HttpRequestParser::finish_head(const char *buf)
+{
+    head_len_ = pos_ + 1;
+    body_len_ = 0;
+    state_ = S_BODY;
+    // Content-Length is honored for any method, even for a GET:
+    // a body left unread would be taken for the next pipelined request
+    bool has_length = false;
+    for (size_t i = 0; i < headers_.size(); ++i) {
+        const HttpHeaderRef &h = headers_[i];
+        if (h.name.equals_nocase(buf, "Transfer-Encoding"))
+            throw HttpParserError("parse",
+                                  "Transfer-Encoding is not supported");
+        if (!h.name.equals_nocase(buf, "Content-Length"))
+            continue;
+        if (has_length)
+            throw HttpParserError("parse", "duplicate Content-Length");
+        has_length = true;
+        if (!h.value.len)
+            throw HttpParserError("parse", "invalid Content-Length");
+        size_t len = 0;
+        for (size_t j = 0; j < h.value.len; ++j) {
+            char c = buf[h.value.pos + j];
+            if (c < '0' || c > '9' || len > (INT_MAX - 9) / 10)
+                throw HttpParserError("parse", "invalid Content-Length");
+            len = len * 10 + (c - '0');
+        }
+        if (len > max_body_size_)
+            throw HttpParserError("parse", "request body is too large");
+        body_len_ = len;
+    }
+}
+
+HttpRequest
+HttpRequestParser::make_request(const char *buf) const
+{
+    if (!head_complete())
+        throw HttpParserError("make_request", "request is not complete");
+    HttpRequest request(WIDEN(method_.str(buf)), WIDEN(uri_.str(buf)),
+                        proto_ver_);
+    Yb::StringDict headers;
+    std::string name, value;
+    for (size_t i = 0; i < headers_.size(); ++i) {
+        const HttpHeaderRef &h = headers_[i];
+        // same as HttpMessage::normalize_header_name(), but in one pass
+        name.assign(buf + h.name.pos, h.name.len);
+        for (size_t j = 0; j < name.size(); ++j) {
+            if (!j || name[j - 1] == '-')
+                name[j] = (name[j] >= 'a' && name[j] <= 'z')?
+                    name[j] - 'a' + 'A': name[j];
+            else
+                name[j] = lower_char(name[j]);
+        }
+        value.assign(buf + h.value.pos, h.value.len);
+        if (h.folded) {
+            for (size_t j = 0; j < value.size(); ++j)
+                if (value[j] == '\r' || value[j] == '\n' || value[j] == '\t')
+                    value[j] = ' ';
+        }
+        headers[WIDEN(name)] = WIDEN(value);
+    }
+    request.set_headers(headers);
+    if (body_len_) {
+        std::string body(buf + head_len_, body_len_);
+        request.set_body(body);
+    }
+    return request;
+}
+
+// vim:ts=4:sts=4:sw=4:et:
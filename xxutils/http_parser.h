@@ -0,0 +1,110 @@
+#ifndef _AUTH__HTTP_PARSER_H_
+#define _AUTH__HTTP_PARSER_H_
+
+#include <string>
+#include <vector>
+#include "http_message.h"
+
+// A piece of the buffer being parsed.  Offsets are kept instead of
+// pointers, so the buffer may be reallocated while it grows.
+struct HttpStrRef
+{
+    size_t pos;
+    size_t len;
+
+    HttpStrRef(): pos(0), len(0) {}
+    const std::string str(const char *buf) const
+    {
+        return std::string(buf + pos, len);
+    }
+    bool equals_nocase(const char *buf, const char *s) const;
+};
+
+struct HttpHeaderRef
+{
+    HttpStrRef name;
+    HttpStrRef value;
+    bool folded;  // value spans over obs-fold line breaks
+};
+
+// Incremental HTTP request parser.  It is fed with the same buffer
+// again and again, as more data is appended to it, and it resumes
+// scanning from where it stopped the previous time.  Nothing is copied
+// until make_request() is called, the request line and the headers
+// are only recorded as offsets into the buffer.
+#define HTTP_MAX_HEAD_SIZE (64 * 1024)
+#define HTTP_MAX_BODY_SIZE (1024 * 1024)
+
+class HttpRequestParser
+{
+public:
+    explicit HttpRequestParser(size_t max_head_size = HTTP_MAX_HEAD_SIZE,
+                               size_t max_body_size = HTTP_MAX_BODY_SIZE);
+
+    // forget the current request to start parsing the next one
+    void reset();
+
+    // buf[0 .. size) holds the request, maybe incomplete;
+    // returns true when the whole request including the body is there;
+    // throws HttpParserError on a malformed request
+    bool parse(const char *buf, size_t size);
+
+    bool started() const { return state_ != S_START || pos_ != 0; }
+    bool head_complete() const { return state_ >= S_BODY; }
+    bool complete() const { return state_ == S_DONE; }
+    // valid once the head is complete
+    size_t head_length() const { return head_len_; }
+    size_t body_length() const { return body_len_; }
+    size_t message_length() const { return head_len_ + body_len_; }
+
+    const HttpStrRef &method() const { return method_; }
+    const HttpStrRef &uri() const { return uri_; }
+    int proto_ver() const { return proto_ver_; }
+    const std::vector<HttpHeaderRef> &headers() const { return headers_; }
+
+    // materialize the parsed request, buf must be the same as in parse()
+    HttpRequest make_request(const char *buf) const;
+
+private:
+    enum State {
+        S_START = 0,
+        S_METHOD,
+        S_URI_START,
+        S_URI,
+        S_VERSION_START,
+        S_VERSION,
+        S_LINE_LF,
+        S_HEADER_START,
+        S_HEADER_NAME,
+        S_VALUE_START,
+        S_VALUE,
+        S_HEADER_LF,
+        S_HEAD_END_LF,
+        S_BODY,
+        S_DONE,
+    };
+
+    size_t max_head_size_;
+    size_t max_body_size_;
+    int state_;
+    size_t pos_;
+    size_t token_start_;
+    size_t token_end_;
+    HttpStrRef method_;
+    HttpStrRef uri_;
+    HttpStrRef version_;
+    int proto_ver_;
+    std::vector<HttpHeaderRef> headers_;
+    HttpStrRef cur_name_;
+    bool in_value_;
+    bool folded_;
+    size_t head_len_;
+    size_t body_len_;
+
+    void finish_request_line(const char *buf);
+    void finish_header();
+    void finish_head(const char *buf);
+};
+
+#endif // _AUTH__HTTP_PARSER_H_
+// vim:ts=4:sts=4:sw=4:et:
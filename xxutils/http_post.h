@@ -7,17 +7,11 @@
 #include <stdexcept>
 #include <util/nlogger.h>
 #include "http_message.h"
+#include "http_client.h"
 #include "servant_utils.h"
 
 #define HTTP_POST_NO_LOGGER ((Yb::ILogger *)-1)
 
-class HttpClientError: public std::runtime_error
-{
-public:
-    HttpClientError(const std::string &msg);
-};
-
-
 typedef Yb::StringDict HttpParams;
 typedef Yb::StringDict HttpHeaders;
 
@@ -26,6 +20,9 @@ const HttpResponse mk_http_resp(int http_code, const std::string &http_desc,
                                 std::string &body);
 
 
+// Synchronous call, the transfer itself is done by HttpClientEngine,
+// so the connections are reused between the calls.  The timeouts are
+// in seconds, the fractions are honoured to a millisecond.
 const HttpResponse http_post(const std::string &uri,
     Yb::ILogger *logger = NULL,
     double timeout = 0,
@@ -37,7 +34,49 @@ const HttpResponse http_post(const std::string &uri,
     const std::string &client_cer = "",
     const std::string &client_key = "",
     bool dump_headers = false,
-    const FiltersMap &filters = FiltersMap());
+    const FiltersMap &filters = FiltersMap(),
+    bool http2 = false,
+    double connect_timeout = 0);
+
+// Same as http_post(), but returns as soon as the response head has
+// arrived.  The body is not stored: it's read from body_stream()
+// of the response while it's still coming.
+const HttpResponse http_post_stream(const std::string &uri,
+    Yb::ILogger *logger = NULL,
+    double timeout = 0,
+    const std::string &method = "POST",
+    const HttpHeaders &headers = HttpHeaders(),
+    const HttpParams &params = HttpParams(),
+    const std::string &body = "",
+    bool ssl_validate = true,
+    const std::string &client_cer = "",
+    const std::string &client_key = "",
+    bool dump_headers = false,
+    const FiltersMap &filters = FiltersMap(),
+    bool http2 = false,
+    double connect_timeout = 0);
+
+// Same as http_post(), for the idempotent calls only: if the response
+// from uri is late according to the policy, the request is sent to
+// hedge_uri as well, and the first response wins, see HttpHedgeOutcome
+// for which one it was
+const HttpResponse http_post_hedged(const std::string &uri,
+    const std::string &hedge_uri,
+    HttpHedgePolicyPtr policy,
+    Yb::ILogger *logger = NULL,
+    double timeout = 0,
+    const std::string &method = "POST",
+    const HttpHeaders &headers = HttpHeaders(),
+    const HttpParams &params = HttpParams(),
+    const std::string &body = "",
+    bool ssl_validate = true,
+    const std::string &client_cer = "",
+    const std::string &client_key = "",
+    bool dump_headers = false,
+    const FiltersMap &filters = FiltersMap(),
+    bool http2 = false,
+    double connect_timeout = 0,
+    HttpHedgeOutcome *outcome = NULL);
 
 #endif // CARD_PROXY__HTTP_POST_H
 // vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,984 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "http_reactor.h"
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <exception>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <util/string_utils.h>
+#include "micro_http.h"
+#include "timer_wheel.h"
+
+#define LOG_ERROR(msg) do { if (logger) logger->error(msg); } while (0)
+#define LOG_WARN(msg) do { if (logger) logger->warning(msg); } while (0)
+#define LOG_INFO(msg) do { if (logger) logger->info(msg); } while (0)
+#define LOG_DEBUG(msg) do { if (logger) logger->debug(msg); } while (0)
+
+using namespace std;
+using namespace Yb;
+
+typedef unsigned long long ConnId;
+
+static const ConnId LISTENER_ID = 0;
+static const ConnId WAKEUP_ID = 1;
+static const ConnId FIRST_CONN_ID = 2;
+
+static const int TIMER_TICK_MSEC = 100;
+static const size_t MAX_HEAD_SIZE = 64 * 1024;
+static const size_t READ_CHUNK = 16 * 1024;
+// how much of a streamed body a worker may put ahead of the client
+static const size_t MAX_PIPE_SIZE = 256 * 1024;
+static const int MAX_EVENTS = 256;
+
+enum {
+    CONN_READING = 0,
+    CONN_PROCESSING,
+    CONN_WRITING,
+};
+
+// which deadline is running for a connection
+enum {
+    PHASE_IDLE = 0,     // keep-alive, waiting for the next request
+    PHASE_HEAD,
+    PHASE_BODY,
+    PHASE_HANDLER,
+    PHASE_WRITE,
+};
+
+// A streamed response body on its way from the worker to the I/O loop
+struct HttpBodyPipe
+{
+    Mutex mux;
+    condition_variable_any cond;
+    string data;
+    bool eof;           // the worker has put everything
+    bool failed;        // the body can't be completed
+    bool closed;        // nobody is going to take the data
+
+    HttpBodyPipe(): eof(false), failed(false), closed(false) {}
+
+    void close()
+    {
+        {
+            ScopedLock lock(mux);
+            closed = true;
+        }
+        cond.notify_all();
+    }
+};
+
+typedef SharedPtr<HttpBodyPipe>::Type HttpBodyPipePtr;
+
+struct HttpConnection
+{
+    ConnId id;
+    SOCKET s;
+    string peer;
+    int state;
+    string in_buf;
+    HttpRequestParser parser;
+    SharedPtr<HttpRequest>::Type request;
+    string out_head;
+    string out_body;
+    size_t out_pos;     // counts over out_head, then out_body
+    HttpBodyPipePtr pipe;   // more of the body is coming from there
+    bool keep_alive;
+    int n_served;
+    int phase;
+    MilliSec deadline;  // zero for none
+    MilliSec timer_at;  // the pending timer, may be earlier than deadline
+
+    HttpConnection(ConnId conn_id, SOCKET cl_s, const string &peer_addr)
+        : id(conn_id), s(cl_s), peer(peer_addr), state(CONN_READING)
+        , parser(MAX_HEAD_SIZE), out_pos(0), keep_alive(false)
+        , n_served(0), phase(PHASE_HEAD), deadline(0), timer_at(0)
+    {}
+};
+
+typedef SharedPtr<HttpConnection>::Type HttpConnectionPtr;
+
+class HttpIoLoop: public Thread
+{
+public:
+    HttpIoLoop(HttpReactor *reactor, int idx);
+    ~HttpIoLoop();
+    void add_listener(SOCKET listen_s);
+    // the following two are called from the other threads
+    void post_connection(SOCKET cl_s, const string &peer);
+    // takes the contents of head and body, leaving them empty;
+    // with a pipe the rest of the body follows
+    void post_response(ConnId id, string &head, string &body,
+                       bool keep_alive,
+                       HttpBodyPipePtr pipe = HttpBodyPipePtr());
+    // there is something new in the connection's pipe
+    void post_stream(ConnId id);
+    void wakeup();
+    void run_loop();
+
+private:
+    typedef map<ConnId, HttpConnectionPtr> Connections;
+    typedef vector<pair<SOCKET, string> > NewConnections;
+    struct PostedResponse
+    {
+        ConnId id;
+        string head;
+        string body;
+        bool keep_alive;
+        HttpBodyPipePtr pipe;
+    };
+    typedef vector<PostedResponse> Responses;
+
+    HttpReactor *reactor_;
+    int idx_;
+    ILogger::Ptr log_;
+    int epfd_;
+    int evfd_;
+    SOCKET listen_s_;
+    ConnId next_id_;
+    Connections conns_;
+    Mutex posted_mux_;
+    NewConnections new_conns_;
+    Responses responses_;
+    vector<ConnId> streams_;
+    bool stopped_;
+    TimerWheel timers_;
+    vector<TimerWheel::Timer> expired_;
+
+    void on_run() { run_loop(); }
+    void accept_all();
+    void process_posted();
+    void add_connection(SOCKET cl_s, const string &peer);
+    void close_connection(HttpConnectionPtr conn);
+    void set_events(HttpConnectionPtr conn, unsigned events);
+    void on_readable(HttpConnectionPtr conn);
+    void on_writable(HttpConnectionPtr conn);
+    bool parse_request(HttpConnectionPtr conn);
+    void dispatch_request(HttpConnectionPtr conn);
+    void start_response(HttpConnectionPtr conn, string &head, string &body,
+                        bool keep_alive,
+                        HttpBodyPipePtr pipe = HttpBodyPipePtr());
+    bool take_piece(HttpConnectionPtr conn);
+    void close_pipes();
+    void process_input(HttpConnectionPtr conn, bool eof);
+    void finish_response(HttpConnectionPtr conn);
+    void send_error(HttpConnectionPtr conn, int code, const String &desc);
+    void arm(HttpConnectionPtr conn, int phase, int timeout);
+    void expire_timers();
+    void on_deadline(HttpConnectionPtr conn);
+};
+
+class HttpRequestTask: public WorkerTask
+{
+    HttpReactor *reactor_;
+    HttpIoLoop *loop_;
+    ConnId id_;
+    int n_served_;
+    SharedPtr<HttpRequest>::Type request_;
+public:
+    HttpRequestTask(HttpReactor *reactor, HttpIoLoop *loop, ConnId id,
+                    int n_served, SharedPtr<HttpRequest>::Type request)
+        : reactor_(reactor), loop_(loop), id_(id), n_served_(n_served)
+        , request_(request)
+    {}
+    void run()
+    {
+        HttpResponse response = reactor_->handle_request(*request_);
+        bool keep_alive = reactor_->prepare_response(
+                *request_, n_served_, response);
+        string head = response.serialize_head();
+        string body;
+        HttpBodyStreamPtr stream = response.body_stream();
+        if (stream) {
+            HttpBodyPipePtr pipe(new HttpBodyPipe());
+            loop_->post_response(id_, head, body, keep_alive, pipe);
+            pump(*stream, *pipe);
+            return;
+        }
+        // take the body out of the response instead of copying it
+        response.set_body(body);
+        loop_->post_response(id_, head, body, keep_alive);
+    }
+
+    // the worker stays with a streamed response until it's sent
+    void pump(HttpBodyStream &stream, HttpBodyPipe &pipe)
+    {
+        ILogger *logger = reactor_->logger();
+        bool failed = false;
+        try {
+            string piece;
+            while (stream.read(piece)) {
+                bool was_empty;
+                {
+                    ScopedLock lock(pipe.mux);
+                    // don't read on while the client is behind
+                    while (!pipe.closed && pipe.data.size() >= MAX_PIPE_SIZE)
+                        pipe.cond.wait(lock);
+                    if (pipe.closed)
+                        return;
+                    was_empty = pipe.data.empty();
+                    pipe.data += piece;
+                }
+                if (was_empty)
+                    loop_->post_stream(id_);
+            }
+        }
+        catch (const std::exception &ex) {
+            LOG_ERROR(string("streamed body: ") + ex.what());
+            failed = true;
+        }
+        {
+            ScopedLock lock(pipe.mux);
+            pipe.eof = true;
+            pipe.failed = failed;
+        }
+        loop_->post_stream(id_);
+    }
+};
+
+static void
+set_nonblocking(SOCKET s)
+{
+    int flags = ::fcntl(s, F_GETFL, 0);
+    if (flags == -1 || ::fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1)
+        throw SocketEx("fcntl(O_NONBLOCK)", TcpSocket::get_last_error());
+}
+
+HttpIoLoop::HttpIoLoop(HttpReactor *reactor, int idx)
+    : reactor_(reactor)
+    , idx_(idx)
+    , log_(reactor->logger()?
+           reactor->logger()->new_logger("io_loop" + to_stdstring(idx)).release():
+           NULL)
+    , epfd_(-1)
+    , evfd_(-1)
+    , listen_s_(INVALID_SOCKET)
+    , next_id_(FIRST_CONN_ID)
+    , stopped_(false)
+    , timers_(TIMER_TICK_MSEC, get_cur_time_millisec())
+{
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ == -1)
+        throw SocketEx("epoll_create1", TcpSocket::get_last_error());
+    evfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (evfd_ == -1) {
+        ::close(epfd_);
+        throw SocketEx("eventfd", TcpSocket::get_last_error());
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = WAKEUP_ID;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev) == -1) {
+        ::close(evfd_);
+        ::close(epfd_);
+        throw SocketEx("epoll_ctl", TcpSocket::get_last_error());
+    }
+}
+
+HttpIoLoop::~HttpIoLoop()
+{
+    for (Connections::iterator i = conns_.begin(); i != conns_.end(); ++i)
+        ::close(i->second->s);
+    conns_.clear();
+    for (size_t i = 0; i < new_conns_.size(); ++i)
+        ::close(new_conns_[i].first);
+    new_conns_.clear();
+    ::close(evfd_);
+    ::close(epfd_);
+}
+
+void
+HttpIoLoop::add_listener(SOCKET listen_s)
+{
+    set_nonblocking(listen_s);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTENER_ID;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, listen_s, &ev) == -1)
+        throw SocketEx("epoll_ctl", TcpSocket::get_last_error());
+    listen_s_ = listen_s;
+}
+
+void
+HttpIoLoop::wakeup()
+{
+    eventfd_t one = 1;
+    ::eventfd_write(evfd_, one);
+}
+
+void
+HttpIoLoop::post_connection(SOCKET cl_s, const string &peer)
+{
+    {
+        ScopedLock lock(posted_mux_);
+        new_conns_.push_back(make_pair(cl_s, peer));
+    }
+    wakeup();
+}
+
+void
+HttpIoLoop::post_response(ConnId id, string &head, string &body,
+                          bool keep_alive, HttpBodyPipePtr pipe)
+{
+    {
+        ScopedLock lock(posted_mux_);
+        if (stopped_) {
+            if (pipe)
+                pipe->close();
+            return;
+        }
+        responses_.push_back(PostedResponse());
+        PostedResponse &resp = responses_.back();
+        resp.id = id;
+        resp.head.swap(head);
+        resp.body.swap(body);
+        resp.keep_alive = keep_alive;
+        resp.pipe = pipe;
+    }
+    wakeup();
+}
+
+void
+HttpIoLoop::post_stream(ConnId id)
+{
+    {
+        ScopedLock lock(posted_mux_);
+        streams_.push_back(id);
+    }
+    wakeup();
+}
+
+void
+HttpIoLoop::accept_all()
+{
+    ILogger *logger = log_.get();
+    while (1) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        socklen_t addr_len = sizeof(addr);
+        SOCKET cl_s = ::accept4(listen_s_, (struct sockaddr *)&addr,
+                                &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (INVALID_SOCKET == cl_s) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR("accept: " + TcpSocket::get_last_error());
+            return;
+        }
+        char buf[100];
+        if (addr.sin_family == AF_INET) {
+            unsigned ip = ntohl(addr.sin_addr.s_addr);
+            snprintf(buf, sizeof(buf), "%d.%d.%d.%d:%d",
+                     ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255,
+                     (int)ntohs(addr.sin_port));
+        }
+        else
+            strcpy(buf, "unix");
+        buf[sizeof(buf) - 1] = 0;
+        LOG_INFO(string("accepted from ") + buf);
+        // a loop with its own listening socket keeps what it accepts
+        HttpIoLoop *loop = reactor_->shared_listener()?
+            reactor_->next_loop(): this;
+        if (loop == this)
+            add_connection(cl_s, buf);
+        else
+            loop->post_connection(cl_s, buf);
+    }
+}
+
+void
+HttpIoLoop::add_connection(SOCKET cl_s, const string &peer)
+{
+    ILogger *logger = log_.get();
+    try {
+        HttpConnectionPtr conn(new HttpConnection(next_id_++, cl_s, peer));
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = conn->id;
+        if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, cl_s, &ev) == -1)
+            throw SocketEx("epoll_ctl", TcpSocket::get_last_error());
+        conns_[conn->id] = conn;
+        arm(conn, PHASE_HEAD, reactor_->server()->header_timeout());
+    }
+    catch (const std::exception &ex) {
+        LOG_ERROR(string("exception: ") + ex.what());
+        ::close(cl_s);
+    }
+}
+
+void
+HttpIoLoop::process_posted()
+{
+    eventfd_t value;
+    ::eventfd_read(evfd_, &value);
+    NewConnections new_conns;
+    Responses responses;
+    vector<ConnId> streams;
+    {
+        ScopedLock lock(posted_mux_);
+        new_conns.swap(new_conns_);
+        responses.swap(responses_);
+        streams.swap(streams_);
+    }
+    for (size_t i = 0; i < new_conns.size(); ++i)
+        add_connection(new_conns[i].first, new_conns[i].second);
+    for (size_t i = 0; i < responses.size(); ++i) {
+        PostedResponse &resp = responses[i];
+        Connections::iterator it = conns_.find(resp.id);
+        // the client may have gone away in the meantime
+        if (it != conns_.end() && it->second->state == CONN_PROCESSING)
+            start_response(it->second, resp.head, resp.body,
+                           resp.keep_alive, resp.pipe);
+        else if (resp.pipe)
+            resp.pipe->close();
+    }
+    for (size_t i = 0; i < streams.size(); ++i) {
+        Connections::iterator it = conns_.find(streams[i]);
+        if (it == conns_.end())
+            continue;
+        HttpConnectionPtr conn = it->second;
+        // unless it's still busy with the previous piece
+        if (conn->state == CONN_WRITING && conn->pipe &&
+                conn->phase == PHASE_HANDLER)
+            on_writable(conn);
+    }
+}
+
+void
+HttpIoLoop::close_pipes()
+{
+    Responses responses;
+    {
+        ScopedLock lock(posted_mux_);
+        stopped_ = true;
+        responses.swap(responses_);
+    }
+    for (size_t i = 0; i < responses.size(); ++i)
+        if (responses[i].pipe)
+            responses[i].pipe->close();
+    for (Connections::iterator i = conns_.begin(); i != conns_.end(); ++i)
+        if (i->second->pipe)
+            i->second->pipe->close();
+}
+
+void
+HttpIoLoop::close_connection(HttpConnectionPtr conn)
+{
+    if (conn->pipe)
+        conn->pipe->close();
+    ::epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->s, NULL);
+    ::shutdown(conn->s, SHUT_RDWR);
+    ::close(conn->s);
+    conns_.erase(conn->id);
+}
+
+void
+HttpIoLoop::set_events(HttpConnectionPtr conn, unsigned events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = conn->id;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_MOD, conn->s, &ev) == -1)
+        throw SocketEx("epoll_ctl", TcpSocket::get_last_error());
+}
+
+bool
+HttpIoLoop::parse_request(HttpConnectionPtr conn)
+{
+    HttpRequestParser &parser = conn->parser;
+    if (!parser.parse(conn->in_buf.data(), conn->in_buf.size()))
+        return false;
+    conn->request.reset(new HttpRequest(reactor_->build_request(
+                    parser, conn->in_buf.data(), log_.get())));
+    // keep the pipelined requests which may follow
+    conn->in_buf.erase(0, parser.message_length());
+    parser.reset();
+    return true;
+}
+
+void
+HttpIoLoop::dispatch_request(HttpConnectionPtr conn)
+{
+    ILogger *logger = log_.get();
+    conn->state = CONN_PROCESSING;
+    // don't watch the socket while the handler is running
+    set_events(conn, 0);
+    WorkerTaskPtr task(new HttpRequestTask(
+                reactor_, this, conn->id, conn->n_served + 1, conn->request));
+    conn->request.reset();
+    arm(conn, PHASE_HANDLER, reactor_->server()->handler_timeout());
+    if (!reactor_->pool().try_push(task)) {
+        LOG_WARN("worker queue is full, rejecting request from " + conn->peer);
+        send_error(conn, 503, _T("Service unavailable"));
+    }
+}
+
+void
+HttpIoLoop::send_error(HttpConnectionPtr conn, int code, const String &desc)
+{
+    HttpResponse response = reactor_->error_response(code, desc);
+    string head = response.serialize_head();
+    string body = response.body();
+    start_response(conn, head, body, false);
+}
+
+void
+HttpIoLoop::start_response(HttpConnectionPtr conn, string &head,
+                           string &body, bool keep_alive,
+                           HttpBodyPipePtr pipe)
+{
+    conn->state = CONN_WRITING;
+    conn->out_head.swap(head);
+    conn->out_body.swap(body);
+    conn->out_pos = 0;
+    conn->pipe = pipe;
+    conn->keep_alive = keep_alive;
+    arm(conn, PHASE_WRITE, reactor_->server()->write_timeout());
+    on_writable(conn);
+}
+
+void
+HttpIoLoop::on_readable(HttpConnectionPtr conn)
+{
+    ILogger *logger = log_.get();
+    bool eof = false;
+    string &in_buf = conn->in_buf;
+    while (1) {
+        // receive right into the connection buffer, the parser works there
+        size_t old_size = in_buf.size();
+        in_buf.resize(old_size + READ_CHUNK);
+        ssize_t res = ::recv(conn->s, &in_buf[old_size], READ_CHUNK, 0);
+        in_buf.resize(old_size + (res > 0? res: 0));
+        if (res > 0) {
+            if ((size_t)res < READ_CHUNK)
+                break;
+        }
+        else if (res == 0) {
+            eof = true;
+            break;
+        }
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else {
+            LOG_ERROR("socket error: " + TcpSocket::get_last_error());
+            close_connection(conn);
+            return;
+        }
+    }
+    process_input(conn, eof);
+}
+
+void
+HttpIoLoop::process_input(HttpConnectionPtr conn, bool eof)
+{
+    ILogger *logger = log_.get();
+    const HttpServerBase *server = reactor_->server();
+    if (conn->phase == PHASE_IDLE && !conn->in_buf.empty())
+        arm(conn, PHASE_HEAD, server->header_timeout());
+    try {
+        if (parse_request(conn)) {
+            dispatch_request(conn);
+            return;
+        }
+    }
+    catch (const std::exception &ex) {
+        LOG_ERROR(string("parser error: ") + ex.what());
+        send_error(conn, 400, _T("Bad request"));
+        return;
+    }
+    // the head has arrived in time, now the body is waited for
+    if (conn->phase == PHASE_HEAD && conn->parser.head_complete())
+        arm(conn, PHASE_BODY, server->body_timeout());
+    if (eof) {
+        if (conn->in_buf.empty()) {
+            close_connection(conn);
+        }
+        else {
+            LOG_ERROR("socket error: short read");
+            send_error(conn, 400, _T("Short read"));
+        }
+    }
+}
+
+void
+HttpIoLoop::on_writable(HttpConnectionPtr conn)
+{
+    ILogger *logger = log_.get();
+    const string &head = conn->out_head, &body = conn->out_body;
+    while (conn->out_pos < head.size() + body.size() ||
+           (conn->pipe && take_piece(conn)))
+    {
+        // gather the head and the body, they are never concatenated
+        struct iovec iov[2];
+        int n = 0;
+        if (conn->out_pos < head.size()) {
+            iov[n].iov_base = const_cast<char *>(head.data() + conn->out_pos);
+            iov[n].iov_len = head.size() - conn->out_pos;
+            ++n;
+        }
+        size_t body_pos = conn->out_pos > head.size()?
+            conn->out_pos - head.size(): 0;
+        if (body_pos < body.size()) {
+            iov[n].iov_base = const_cast<char *>(body.data() + body_pos);
+            iov[n].iov_len = body.size() - body_pos;
+            ++n;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t res = ::sendmsg(conn->s, &msg, MSG_NOSIGNAL);
+        if (res >= 0) {
+            conn->out_pos += res;
+        }
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            set_events(conn, EPOLLOUT);
+            return;
+        }
+        else {
+            LOG_ERROR("write: " + TcpSocket::get_last_error());
+            close_connection(conn);
+            return;
+        }
+    }
+    // a streamed body waits for the worker
+    if (!conn->pipe)
+        finish_response(conn);
+}
+
+bool
+HttpIoLoop::take_piece(HttpConnectionPtr conn)
+{
+    ILogger *logger = log_.get();
+    HttpBodyPipe &pipe = *conn->pipe;
+    bool eof, failed;
+    {
+        ScopedLock lock(pipe.mux);
+        // the buffer just sent goes back to the worker
+        conn->out_body.clear();
+        conn->out_body.swap(pipe.data);
+        eof = pipe.eof;
+        failed = pipe.failed;
+    }
+    pipe.cond.notify_all();
+    conn->out_pos = conn->out_head.size();
+    if (!conn->out_body.empty()) {
+        arm(conn, PHASE_WRITE, reactor_->server()->write_timeout());
+        return true;
+    }
+    if (failed) {
+        // the head is gone already, so the only way to tell the client
+        LOG_WARN("streamed body failed, closing connection from " +
+                 conn->peer);
+        close_connection(conn);
+        return false;
+    }
+    if (eof) {
+        conn->pipe.reset();
+        return false;
+    }
+    set_events(conn, 0);
+    arm(conn, PHASE_HANDLER, reactor_->server()->handler_timeout());
+    return false;
+}
+
+void
+HttpIoLoop::finish_response(HttpConnectionPtr conn)
+{
+    if (!conn->keep_alive) {
+        close_connection(conn);
+        return;
+    }
+    conn->state = CONN_READING;
+    conn->out_head.clear();
+    conn->out_body.clear();
+    conn->out_pos = 0;
+    ++conn->n_served;
+    arm(conn, PHASE_IDLE, reactor_->server()->keep_alive_timeout());
+    set_events(conn, EPOLLIN);
+    // a pipelined request may be waiting in the buffer already
+    if (!conn->in_buf.empty())
+        process_input(conn, false);
+}
+
+void
+HttpIoLoop::arm(HttpConnectionPtr conn, int phase, int timeout)
+{
+    conn->phase = phase;
+    conn->deadline = timeout > 0? get_cur_time_millisec() + timeout: 0;
+    // a pending timer which fires no later than the new deadline
+    // will be re-scheduled when it fires, so most of the phase changes
+    // don't touch the wheel at all
+    if (conn->deadline && (!conn->timer_at || conn->deadline < conn->timer_at)) {
+        timers_.schedule(conn->id, conn->deadline);
+        conn->timer_at = conn->deadline;
+    }
+}
+
+void
+HttpIoLoop::expire_timers()
+{
+    ILogger *logger = log_.get();
+    MilliSec now = get_cur_time_millisec();
+    expired_.clear();
+    timers_.advance(now, expired_);
+    for (size_t i = 0; i < expired_.size(); ++i) {
+        Connections::iterator it = conns_.find(expired_[i].key);
+        // skip closed connections and superseded timers
+        if (it == conns_.end() || it->second->timer_at != expired_[i].deadline)
+            continue;
+        HttpConnectionPtr conn = it->second;
+        conn->timer_at = 0;
+        if (!conn->deadline)
+            continue;
+        if (conn->deadline > now) {
+            timers_.schedule(conn->id, conn->deadline);
+            conn->timer_at = conn->deadline;
+            continue;
+        }
+        try {
+            on_deadline(conn);
+        }
+        catch (const std::exception &ex) {
+            LOG_ERROR(string("exception: ") + ex.what());
+            if (conns_.count(conn->id))
+                close_connection(conn);
+        }
+    }
+}
+
+void
+HttpIoLoop::on_deadline(HttpConnectionPtr conn)
+{
+    ILogger *logger = log_.get();
+    switch (conn->phase) {
+    case PHASE_IDLE:
+        LOG_DEBUG("keep-alive timeout, closing connection from " + conn->peer);
+        close_connection(conn);
+        break;
+    case PHASE_HEAD:
+        LOG_WARN("timeout reading request head, closing connection from " +
+                 conn->peer);
+        close_connection(conn);
+        break;
+    case PHASE_BODY:
+        LOG_WARN("timeout reading request body, closing connection from " +
+                 conn->peer);
+        close_connection(conn);
+        break;
+    case PHASE_HANDLER:
+        if (conn->pipe) {
+            LOG_WARN("timeout streaming response, closing connection from " +
+                     conn->peer);
+            close_connection(conn);
+            break;
+        }
+        // the worker can't be interrupted, its response will be dropped
+        LOG_WARN("handler timeout, request from " + conn->peer);
+        send_error(conn, 503, _T("Service unavailable"));
+        break;
+    default:
+        LOG_WARN("timeout writing response, closing connection from " +
+                 conn->peer);
+        close_connection(conn);
+    }
+}
+
+void
+HttpIoLoop::run_loop()
+{
+    ILogger *logger = log_.get();
+    try {
+        reactor_->pin_loop(idx_);
+    }
+    catch (const std::exception &ex) {
+        LOG_WARN(ex.what());
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while (!reactor_->stopping()) {
+        int n = ::epoll_wait(epfd_, events, MAX_EVENTS,
+                             timers_.empty()? 1000: TIMER_TICK_MSEC);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("epoll_wait: " + TcpSocket::get_last_error());
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            ConnId id = events[i].data.u64;
+            if (LISTENER_ID == id) {
+                accept_all();
+                continue;
+            }
+            if (WAKEUP_ID == id) {
+                process_posted();
+                continue;
+            }
+            Connections::iterator it = conns_.find(id);
+            if (it == conns_.end())
+                continue;
+            HttpConnectionPtr conn = it->second;
+            try {
+                if (conn->state == CONN_PROCESSING) {
+                    // only EPOLLHUP or EPOLLERR can come here
+                    LOG_WARN("client " + conn->peer + " has gone away");
+                    close_connection(conn);
+                }
+                else if (conn->state == CONN_WRITING)
+                    on_writable(conn);
+                else
+                    on_readable(conn);
+            }
+            catch (const std::exception &ex) {
+                LOG_ERROR(string("exception: ") + ex.what());
+                if (conns_.count(id))
+                    close_connection(conn);
+            }
+        }
+        expire_timers();
+    }
+    // release the workers still streaming, the pool is stopped next
+    close_pipes();
+}
+
+HttpReactor::HttpReactor(HttpServerBase *server, int n_io_threads,
+                         int n_workers, int max_queue,
+                         ILogger *root_logger)
+    : server_(server)
+    , log_(root_logger? root_logger->new_logger("reactor").release(): NULL)
+    , pool_(n_workers, max_queue > 0? max_queue: 1, root_logger)
+    , next_loop_(0)
+    , shared_listener_(true)
+    , stopping_(false)
+    , running_(false)
+{
+    if (n_io_threads < 1)
+        n_io_threads = 1;
+    pool_.set_cpus(server_->cpus_);
+    try {
+        for (int i = 0; i < n_io_threads; ++i)
+            loops_.push_back(new HttpIoLoop(this, i));
+    }
+    catch (...) {
+        for (size_t i = 0; i < loops_.size(); ++i)
+            delete loops_[i];
+        throw;
+    }
+}
+
+HttpReactor::~HttpReactor()
+{
+    stop();
+    for (size_t i = 0; i < loops_.size(); ++i)
+        delete loops_[i];
+}
+
+HttpRequest
+HttpReactor::build_request(const HttpRequestParser &parser, const char *buf,
+                           ILogger *logger)
+{
+    HttpRequest request = HttpServerBase::build_request(parser, buf, logger);
+    server_->set_deadline(request);
+    return request;
+}
+
+const HttpResponse
+HttpReactor::handle_request(const HttpRequest &request)
+{
+    ILogger *root_logger = server_->log_.get();
+    ILogger::Ptr logger(root_logger?
+            root_logger->new_logger("worker").release(): NULL);
+    return server_->handle_request(request, logger.get());
+}
+
+bool
+HttpReactor::prepare_response(const HttpRequest &request, int n_served,
+                              HttpResponse &response)
+{
+    return server_->prepare_response(request, n_served, response);
+}
+
+void
+HttpReactor::pin_loop(int idx)
+{
+    server_->pin_thread(idx);
+}
+
+const HttpResponse
+HttpReactor::error_response(int code, const String &desc)
+{
+    return server_->error_response(code, desc);
+}
+
+HttpIoLoop *
+HttpReactor::next_loop()
+{
+    HttpIoLoop *loop = loops_[next_loop_];
+    next_loop_ = (next_loop_ + 1) % loops_.size();
+    return loop;
+}
+
+void
+HttpReactor::run(const vector<SOCKET> &listen_socks)
+{
+    {
+        ScopedLock lock(run_mux_);
+        if (running_ || stopping_)
+            return;
+        running_ = true;
+    }
+    exception_ptr error;
+    try {
+        if (listen_socks.empty())
+            throw std::runtime_error("no listening sockets");
+        // either there is only one listening socket and loop 0
+        // hands out the connections, or each loop accepts on its own
+        shared_listener_ = listen_socks.size() == 1;
+        for (size_t i = 0; i < listen_socks.size() && i < loops_.size(); ++i)
+            loops_[i]->add_listener(listen_socks[i]);
+        pool_.start();
+        for (size_t i = 1; i < loops_.size(); ++i)
+            loops_[i]->start();
+        loops_[0]->run_loop();
+    }
+    catch (...) {
+        error = current_exception();
+    }
+    stopping_ = true;
+    for (size_t i = 1; i < loops_.size(); ++i) {
+        loops_[i]->wakeup();
+        loops_[i]->wait();
+    }
+    pool_.stop();
+    {
+        ScopedLock lock(run_mux_);
+        running_ = false;
+    }
+    run_cond_.notify_all();
+    if (error)
+        rethrow_exception(error);
+}
+
+void
+HttpReactor::stop()
+{
+    stopping_ = true;
+    for (size_t i = 0; i < loops_.size(); ++i)
+        loops_[i]->wakeup();
+    ScopedLock lock(run_mux_);
+    while (running_)
+        run_cond_.wait(lock);
+}
+
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,67 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__HTTP_REACTOR_H
+#define CARD_PROXY__HTTP_REACTOR_H
+
+#include <vector>
+#include <condition_variable>
+#include <atomic>
+#include <util/nlogger.h>
+#include <util/thread.h>
+#include "http_message.h"
+#include "http_parser.h"
+#include "tcp_socket.h"
+#include "worker_pool.h"
+
+class HttpServerBase;
+class HttpIoLoop;
+
+// Non-blocking server core: a few I/O threads multiplex all of the client
+// sockets with epoll, and only completely read requests are passed
+// to a bounded worker pool, where the server's handlers are called.
+class HttpReactor
+{
+public:
+    HttpReactor(HttpServerBase *server, int n_io_threads,
+                int n_workers, int max_queue, Yb::ILogger *root_logger);
+    ~HttpReactor();
+    // blocks the caller, which becomes the first I/O thread;
+    // given several listening sockets the loop i accepts on the i-th one
+    void run(const std::vector<SOCKET> &listen_socks);
+    // asks all the loops to finish and waits for run() to return
+    void stop();
+
+    bool stopping() const { return stopping_; }
+    HttpServerBase *server() const { return server_; }
+    WorkerPool &pool() { return pool_; }
+    Yb::ILogger *logger() const { return log_.get(); }
+    HttpIoLoop *next_loop();
+    bool shared_listener() const { return shared_listener_; }
+
+    // access to the request processing of the owning server
+    HttpRequest build_request(const HttpRequestParser &parser,
+                              const char *buf, Yb::ILogger *logger);
+    const HttpResponse handle_request(const HttpRequest &request);
+    bool prepare_response(const HttpRequest &request, int n_served,
+                          HttpResponse &response);
+    const HttpResponse error_response(int code, const Yb::String &desc);
+    void pin_loop(int idx);
+
+private:
+    HttpServerBase *server_;
+    Yb::ILogger::Ptr log_;
+    WorkerPool pool_;
+    std::vector<HttpIoLoop *> loops_;
+    size_t next_loop_;
+    bool shared_listener_;
+    std::atomic<bool> stopping_;
+    Yb::Mutex run_mux_;
+    std::condition_variable_any run_cond_;
+    bool running_;
+
+    // non-copyable
+    HttpReactor(const HttpReactor &);
+    HttpReactor &operator=(const HttpReactor &);
+};
+
+#endif // CARD_PROXY__HTTP_REACTOR_H
+// vim:ts=4:sts=4:sw=4:et:
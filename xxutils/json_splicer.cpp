@@ -0,0 +1,305 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "json_splicer.h"
+#include "json_object.h"
+
+#include <cstring>
+#include <cctype>
+#include <boost/lexical_cast.hpp>
+
+#define MAX_JSON_DEPTH 64
+
+JsonFieldSplicer::JsonFieldSplicer(const std::string &doc,
+                                   const std::string &object_key,
+                                   const std::set<std::string> &names)
+    : doc_(doc)
+    , object_begin_(std::string::npos)
+    , object_end_(std::string::npos)
+{
+    size_t pos = skip_ws(0);
+    if (pos >= doc_.size() || doc_[pos] != '{')
+        fail("object expected", pos);
+    pos = skip_ws(pos + 1);
+    while (pos >= doc_.size() || doc_[pos] != '}') {
+        std::string key;
+        pos = skip_ws(scan_string(pos, &key));
+        if (pos >= doc_.size() || doc_[pos] != ':')
+            fail("':' expected", pos);
+        pos = skip_ws(pos + 1);
+        if (key == object_key) {
+            if (object_begin_ != std::string::npos)
+                throw JsonKeyError("JSON key '" + key + "' is duplicated");
+            if (pos >= doc_.size() || doc_[pos] != '{')
+                throw JsonKeyError("JSON key '" + key
+                        + "' expected to contain an object");
+            pos = scan_object(pos, names);
+        }
+        else
+            pos = skip_value(pos, 1);
+        pos = skip_ws(pos);
+        if (pos < doc_.size() && doc_[pos] == '}')
+            break;
+        if (pos >= doc_.size() || doc_[pos] != ',')
+            fail("',' expected", pos);
+        pos = skip_ws(pos + 1);
+    }
+    if (skip_ws(pos + 1) != doc_.size())
+        fail("garbage after the document", pos + 1);
+    if (object_begin_ == std::string::npos)
+        throw JsonKeyError("JSON has no '" + object_key + "' key");
+}
+
+const std::string JsonFieldSplicer::splice(
+        const Yb::StringDict &new_fields) const
+{
+    std::string out;
+    out.reserve(doc_.size() + 64 * new_fields.size());
+    out.append(doc_, 0, object_begin_ + 1);
+    bool first = true;
+    for (size_t i = 0; i < kept_.size(); ++i) {
+        if (!first)
+            out += ", ";
+        first = false;
+        out.append(doc_, kept_[i].begin, kept_[i].end - kept_[i].begin);
+    }
+    for (auto i = new_fields.begin(), iend = new_fields.end();
+            i != iend; ++i)
+    {
+        if (!first)
+            out += ", ";
+        first = false;
+        append_quoted(out, i->first);
+        out += ": ";
+        append_quoted(out, i->second);
+    }
+    out.append(doc_, object_end_, std::string::npos);
+    return out;
+}
+
+void JsonFieldSplicer::append_quoted(std::string &out, const std::string &s)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    size_t plain = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        out.append(s, plain, i - plain);
+        plain = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+        }
+    }
+    out.append(s, plain, std::string::npos);
+    out += '"';
+}
+
+size_t JsonFieldSplicer::skip_ws(size_t pos) const
+{
+    while (pos < doc_.size() && (doc_[pos] == ' ' || doc_[pos] == '\n' ||
+                                 doc_[pos] == '\r' || doc_[pos] == '\t'))
+        ++pos;
+    return pos;
+}
+
+size_t JsonFieldSplicer::skip_value(size_t pos, int depth) const
+{
+    if (depth > MAX_JSON_DEPTH)
+        fail("nesting is too deep", pos);
+    if (pos >= doc_.size())
+        fail("value expected", pos);
+    char c = doc_[pos];
+    if (c == '"')
+        return scan_string(pos, NULL);
+    if (c == '{' || c == '[') {
+        char close = c == '{'? '}': ']';
+        pos = skip_ws(pos + 1);
+        if (pos < doc_.size() && doc_[pos] == close)
+            return pos + 1;
+        while (true) {
+            if (c == '{') {
+                pos = skip_ws(scan_string(pos, NULL));
+                if (pos >= doc_.size() || doc_[pos] != ':')
+                    fail("':' expected", pos);
+                pos = skip_ws(pos + 1);
+            }
+            pos = skip_ws(skip_value(pos, depth + 1));
+            if (pos < doc_.size() && doc_[pos] == close)
+                return pos + 1;
+            if (pos >= doc_.size() || doc_[pos] != ',')
+                fail("',' expected", pos);
+            pos = skip_ws(pos + 1);
+        }
+    }
+    static const char *literals[] = {"true", "false", "null"};
+    for (size_t i = 0; i < 3; ++i)
+        if (!doc_.compare(pos, strlen(literals[i]), literals[i]))
+            return pos + strlen(literals[i]);
+    size_t start = pos;
+    while (pos < doc_.size() && (isdigit((unsigned char)doc_[pos]) ||
+                                 (doc_[pos] && strchr("+-.eE", doc_[pos]))))
+        ++pos;
+    if (pos == start)
+        fail("value expected", pos);
+    return pos;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static void append_utf8(std::string &out, unsigned code)
+{
+    if (code < 0x80)
+        out += (char)code;
+    else if (code < 0x800) {
+        out += (char)(0xC0 | (code >> 6));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000) {
+        out += (char)(0xE0 | (code >> 12));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+    else {
+        out += (char)(0xF0 | (code >> 18));
+        out += (char)(0x80 | ((code >> 12) & 0x3F));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+}
+
+size_t JsonFieldSplicer::scan_string(size_t pos, std::string *value) const
+{
+    if (pos >= doc_.size() || doc_[pos] != '"')
+        fail("string expected", pos);
+    ++pos;
+    size_t plain = pos;
+    while (true) {
+        if (pos >= doc_.size())
+            fail("unterminated string", pos);
+        unsigned char c = doc_[pos];
+        if (c == '"')
+            break;
+        if (c < 0x20)
+            fail("control character in a string", pos);
+        if (c != '\\') {
+            ++pos;
+            continue;
+        }
+        if (value)
+            value->append(doc_, plain, pos - plain);
+        if (pos + 1 >= doc_.size())
+            fail("unterminated string", pos);
+        char e = doc_[pos + 1];
+        pos += 2;
+        if (e == 'u') {
+            unsigned code = 0;
+            for (int k = 0; k < 2; ++k) {
+                if (k) {
+                    // the low half of a surrogate pair must follow
+                    if (code < 0xD800 || code > 0xDBFF)
+                        break;
+                    if (doc_.compare(pos, 2, "\\u"))
+                        fail("bad surrogate pair", pos);
+                    pos += 2;
+                }
+                unsigned half = 0;
+                for (int j = 0; j < 4; ++j, ++pos) {
+                    int d = pos < doc_.size()? hex_digit(doc_[pos]): -1;
+                    if (d < 0)
+                        fail("bad \\u escape", pos);
+                    half = half * 16 + d;
+                }
+                if (!k)
+                    code = half;
+                else if (half >= 0xDC00 && half <= 0xDFFF)
+                    code = 0x10000 + ((code - 0xD800) << 10) + (half - 0xDC00);
+                else
+                    fail("bad surrogate pair", pos);
+            }
+            if (code >= 0xDC00 && code <= 0xDFFF)
+                fail("bad surrogate pair", pos);
+            if (value)
+                append_utf8(*value, code);
+        }
+        else {
+            const char *from = "\"\\/bfnrt", *to = "\"\\/\b\f\n\r\t";
+            const char *p = strchr(from, e);
+            if (!e || !p)
+                fail("bad escape", pos - 1);
+            if (value)
+                *value += to[p - from];
+        }
+        plain = pos;
+    }
+    if (value)
+        value->append(doc_, plain, pos - plain);
+    return pos + 1;
+}
+
+size_t JsonFieldSplicer::scan_object(size_t pos,
+                                     const std::set<std::string> &names)
+{
+    object_begin_ = pos;
+    pos = skip_ws(pos + 1);
+    if (pos < doc_.size() && doc_[pos] == '}') {
+        object_end_ = pos;
+        return pos + 1;
+    }
+    while (true) {
+        Span member;
+        member.begin = pos;
+        std::string key;
+        pos = skip_ws(scan_string(pos, &key));
+        if (pos >= doc_.size() || doc_[pos] != ':')
+            fail("':' expected", pos);
+        pos = skip_ws(pos + 1);
+        if (names.count(key)) {
+            if (pos >= doc_.size() || doc_[pos] != '"')
+                throw JsonKeyError("JSON key '" + key
+                        + "' expected to contain a string");
+            std::string value;
+            pos = scan_string(pos, &value);
+            fields_[key] = value;
+        }
+        else {
+            pos = skip_value(pos, 2);
+            member.end = pos;
+            kept_.push_back(member);
+        }
+        pos = skip_ws(pos);
+        if (pos < doc_.size() && doc_[pos] == '}') {
+            object_end_ = pos;
+            return pos + 1;
+        }
+        if (pos >= doc_.size() || doc_[pos] != ',')
+            fail("',' expected", pos);
+        pos = skip_ws(pos + 1);
+    }
+}
+
+void JsonFieldSplicer::fail(const std::string &what, size_t pos) const
+{
+    throw JsonError("failed to parse JSON: " + what + " at offset "
+            + boost::lexical_cast<std::string>(pos));
+}
+
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,51 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef XXUTILS__JSON_SPLICER_H
+#define XXUTILS__JSON_SPLICER_H
+
+#include <string>
+#include <set>
+#include <vector>
+#include <util/data_types.h>
+
+// Takes some string members out of an object nested in a JSON document
+// and puts others in their place, in a single pass and without building
+// a DOM: the rest of the document is copied byte for byte.  The errors
+// are thrown as JsonError/JsonKeyError, see json_object.h.
+class JsonFieldSplicer
+{
+public:
+    // the members of doc.object_key named in names are taken out,
+    // their values must be strings; doc is not copied
+    JsonFieldSplicer(const std::string &doc, const std::string &object_key,
+                     const std::set<std::string> &names);
+
+    // the values taken out, unescaped
+    const Yb::StringDict &fields() const { return fields_; }
+
+    // the document without the members taken out, and with the given
+    // ones added to the object as strings
+    const std::string splice(const Yb::StringDict &new_fields) const;
+
+    static void append_quoted(std::string &out, const std::string &s);
+
+private:
+    struct Span
+    {
+        size_t begin, end;
+    };
+
+    const std::string &doc_;
+    Yb::StringDict fields_;
+    size_t object_begin_;           // at '{' of the object
+    size_t object_end_;             // at its '}'
+    std::vector<Span> kept_;        // its members left as they are
+
+    size_t skip_ws(size_t pos) const;
+    size_t skip_value(size_t pos, int depth) const;
+    size_t scan_string(size_t pos, std::string *value) const;
+    size_t scan_object(size_t pos, const std::set<std::string> &names);
+    void fail(const std::string &what, size_t pos) const;
+};
+
+#endif // XXUTILS__JSON_SPLICER_H
+// vim:ts=4:sts=4:sw=4:et:
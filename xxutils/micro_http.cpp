@@ -1,11 +1,28 @@
 #include "micro_http.h"
+#include "http_reactor.h"
+#include "worker_pool.h"
+#include "http_parser.h"
+#include "utils.h"
 #include <util/thread.h>
 #include <util/utility.h>
 #include <util/string_utils.h>
+#include <cstdio>
+#include <cstdlib>
 
 static inline bool logger_ok(Yb::ILogger *x) { return x != NULL; }
 static inline bool logger_ok(const Yb::ILogger::Ptr &x) { return x.get() != NULL; }
 
+// the acceptor itself sends the 503 when the worker queue is full,
+// a slow client mustn't hold it for long
+#define REJECT_TIMEOUT 200  // millisec
+#define REJECT_DRAIN_SIZE (64 * 1024)
+
+static long long
+deadline_after(int timeout)
+{
+    return timeout > 0? Yb::get_cur_time_millisec() + timeout: 0;
+}
+
 #define LOG_ERROR(msg) do { if (logger_ok(logger)) logger->error(msg); } while (0)
 #define LOG_WARN(msg) do { if (logger_ok(logger)) logger->warning(msg); } while (0)
 #define LOG_INFO(msg) do { if (logger_ok(logger)) logger->info(msg); } while (0)
@@ -17,20 +34,69 @@ using namespace Yb::StrUtils;
 
 typedef void (*WorkerFunc)(HttpServerBase *, SOCKET);
 
-class WorkerThread: public Thread {
+// Frames the pieces of a streamed body as HTTP/1.1 chunks
+class ChunkedBodyStream: public HttpBodyStream
+{
+    HttpBodyStreamPtr stream_;
+    string data_;
+    bool done_;
+public:
+    explicit ChunkedBodyStream(HttpBodyStreamPtr stream)
+        : stream_(stream), done_(false)
+    {}
+
+    bool read(string &piece)
+    {
+        if (done_)
+            return false;
+        // an empty chunk would end the body
+        do {
+            if (!stream_->read(data_)) {
+                done_ = true;
+                piece = "0\r\n\r\n";
+                return true;
+            }
+        } while (data_.empty());
+        char size_line[32];
+        snprintf(size_line, sizeof(size_line), "%zx\r\n", data_.size());
+        piece.reserve(data_.size() + 32);
+        piece = size_line;
+        piece += data_;
+        piece += "\r\n";
+        return true;
+    }
+};
+
+typedef void (*AcceptFunc)(HttpServerBase *, TcpSocket *, WorkerPool *, int);
+
+class AcceptorThread: public Thread {
+    HttpServerBase *serv_;
+    TcpSocket *listener_;
+    WorkerPool *pool_;
+    int idx_;
+    AcceptFunc acceptor_;
+    void on_run() { acceptor_(serv_, listener_, pool_, idx_); }
+public:
+    AcceptorThread(HttpServerBase *serv, TcpSocket *listener,
+                   WorkerPool *pool, int idx, AcceptFunc acceptor)
+        : serv_(serv), listener_(listener), pool_(pool), idx_(idx)
+        , acceptor_(acceptor)
+    {}
+};
+
+typedef SharedPtr<AcceptorThread>::Type AcceptorThreadPtr;
+
+class ClientSocketTask: public WorkerTask {
     HttpServerBase *serv_;
     SOCKET s_;
     WorkerFunc worker_;
-    void on_run() { worker_(serv_, s_); }
 public:
-    WorkerThread(HttpServerBase *serv, SOCKET s, WorkerFunc worker)
+    ClientSocketTask(HttpServerBase *serv, SOCKET s, WorkerFunc worker)
         : serv_(serv), s_(s), worker_(worker)
     {}
+    void run() { worker_(serv_, s_); }
 };
 
-typedef SharedPtr<WorkerThread>::Type WorkerThreadPtr;
-typedef std::vector<WorkerThreadPtr> Workers;
-
 HttpServerBase::HttpServerBase(const std::string &ip_addr, int port,
         int back_log, ILogger *root_logger,
         const String &content_type, const std::string &bad_resp)
@@ -42,9 +108,43 @@ HttpServerBase::HttpServerBase(const std::string &ip_addr, int port,
     , content_type_(content_type)
     , bad_resp_(bad_resp)
     , log_(root_logger? root_logger->new_logger("micro_http").release(): NULL)
-    , prev_clean_ts(time(NULL))
+    , mode_(HTTP_SERVER_THREADED)
+    , io_threads_(1)
+    , workers_(16)
+    , queue_size_(256)
+    , keep_alive_timeout_(0)
+    , max_keep_alive_requests_(100)
+    , header_timeout_(10000)
+    , body_timeout_(30000)
+    , handler_timeout_(30000)
+    , write_timeout_(30000)
+    , acceptors_(1)
+    , unix_socket_mode_(-1)
+    , reactor_(NULL)
+    , threaded_(false)
+    , stopping_(false)
 {}
 
+HttpServerBase::~HttpServerBase()
+{
+    stop();
+    if (is_bound_ && !unix_socket_.empty()) {
+        sock_.close();
+        std::remove(unix_socket_.c_str());
+    }
+}
+
+int
+HttpServerBase::parse_mode(const std::string &mode_str)
+{
+    String m = str_to_lower(trim_trailing_space(WIDEN(mode_str)));
+    if (m == _T("threads") || m == _T("threaded"))
+        return HTTP_SERVER_THREADED;
+    if (m == _T("epoll"))
+        return HTTP_SERVER_EPOLL;
+    throw std::runtime_error("unknown HTTP server mode: " + mode_str);
+}
+
 HttpResponse
 HttpServerBase::make_response(int code, const Yb::String &desc,
         const std::string &body, const Yb::String &cont_type)
@@ -54,13 +154,70 @@ HttpServerBase::make_response(int code, const Yb::String &desc,
     return response;
 }
 
+HttpResponse
+HttpServerBase::error_response(int code, const Yb::String &desc) const
+{
+    return make_response(code, desc, bad_resp_, content_type_);
+}
+
+bool
+HttpServerBase::prepare_response(const HttpRequest &request, int n_served,
+                                 HttpResponse &response) const
+{
+    if (keep_alive_timeout_ <= 0)
+        return false;
+    String conn_hdr = str_to_lower(request.get_header(_T("Connection"), _T("")));
+    bool keep_alive;
+    if (request.proto_ver() == HTTP_1_1)
+        keep_alive = conn_hdr != _T("close");
+    else
+        keep_alive = conn_hdr == _T("keep-alive");
+    if (n_served >= max_keep_alive_requests_)
+        keep_alive = false;
+    // the handler's own hop-by-hop headers make no sense here
+    response.remove_header(_T("Connection"));
+    response.remove_header(_T("Keep-Alive"));
+    response.remove_header(_T("Transfer-Encoding"));
+    response.set_proto_ver(request.proto_ver());
+    HttpBodyStreamPtr stream = response.body_stream();
+    if (stream && !str_length(response.get_header(_T("Content-Length"), _T(""))))
+    {
+        // the length of a streamed body may be unknown: HTTP/1.1 gets
+        // it chunked, for HTTP/1.0 the body ends with the connection
+        if (request.proto_ver() == HTTP_1_1) {
+            response.set_header(_T("Transfer-Encoding"), _T("chunked"));
+            response.set_body_stream(HttpBodyStreamPtr(
+                        new ChunkedBodyStream(stream)));
+        }
+        else
+            keep_alive = false;
+    }
+    response.set_header(_T("Connection"),
+                        keep_alive? _T("keep-alive"): _T("close"));
+    // a persistent connection needs the body to be delimited
+    if (!stream)
+        response.set_header(_T("Content-Length"),
+                            to_string(response.body().size()));
+    return keep_alive;
+}
+
 bool
 HttpServerBase::send_response(TcpSocket &cl_sock, ILogger *logger,
-                              const HttpResponse &response)
+                              const HttpResponse &response, bool keep_open)
 {
     try {
-        cl_sock.write(response.serialize());
-        cl_sock.close(true);
+        HttpBodyStreamPtr stream = response.body_stream();
+        if (stream) {
+            // the head goes first, the body as fast as it's produced
+            cl_sock.write(response.serialize_head());
+            string piece;
+            while (stream->read(piece))
+                cl_sock.write(piece);
+        }
+        else
+            cl_sock.write(response.serialize_head(), response.body());
+        if (!keep_open)
+            cl_sock.close(true);
         return true;
     }
     catch (const std::exception &ex) {
@@ -75,159 +232,163 @@ HttpServerBase::process(HttpServerBase *server, SOCKET cl_s)
     server->process_client_request(cl_s);
 }
 
+HttpRequest
+HttpServerBase::build_request(const HttpRequestParser &parser,
+                              const char *buf, ILogger *logger)
+{
+    HttpRequest request = parser.make_request(buf);
+    if (logger && logger->get_level() >= ll_DEBUG) {
+        LOG_DEBUG(NARROW(request.method()) + " " + NARROW(request.uri()) +
+                  " " + NARROW(request.get_proto_str()));
+        const StringDict &headers = request.headers();
+        StringDict::const_iterator i = headers.begin(), end = headers.end();
+        for (; i != end; ++i)
+            LOG_DEBUG(NARROW(i->first + _T(": ") + i->second));
+    }
+    String cont_type = request.get_header(_T("Content-Type"), _T(""));
+    if (starts_with(cont_type, _T("application/x-www-form-urlencoded")))
+        request.urlparse_body();
+    return request;
+}
+
+void
+HttpServerBase::set_deadline(HttpRequest &request) const
+{
+    long long deadline = deadline_after(handler_timeout_);
+    // the client may give up sooner than the handler is cut off
+    std::string timeout = NARROW(request.get_header(
+                _T(HTTP_TIMEOUT_HEADER), _T("")));
+    long client_timeout = std::strtol(timeout.c_str(), NULL, 10);
+    if (client_timeout > 0) {
+        long long client_deadline = deadline_after(client_timeout);
+        if (!deadline || client_deadline < deadline)
+            deadline = client_deadline;
+    }
+    request.set_deadline(deadline);
+}
+
+const HttpResponse
+HttpServerBase::handle_request(const HttpRequest &request_obj,
+                               ILogger *logger)
+{
+    if (request_obj.method() != _T("GET") &&
+        request_obj.method() != _T("POST"))
+    {
+        LOG_ERROR("unsupported method \""
+                  + NARROW(request_obj.method()) + "\"");
+        return error_response(400, _T("Bad request"));
+    }
+    if (!has_handler_for_path(request_obj.path()))
+    {
+        LOG_ERROR("Path " + NARROW(request_obj.path()) + " not found!");
+        return error_response(404, _T("Not found"));
+    }
+    try {
+        // handle the request
+        return call_handler(request_obj);
+    }
+    catch (const std::exception &ex) {
+        LOG_ERROR(string("exception: ") + ex.what());
+    }
+    return error_response(500, _T("Internal server error"));
+}
+
 void
 HttpServerBase::process_client_request(SOCKET cl_s)
 {
     TcpSocket cl_sock(cl_s);
     ILogger::Ptr logger(log_.get()? log_->new_logger("worker").release(): NULL);
-    string &bad_resp = bad_resp_;
-    String cont_type_resp = content_type_;
-    // read and process request
-    try {
-        // read request header
-        String req_line = WIDEN(cl_sock.readline());
-        LOG_DEBUG(NARROW(trim_trailing_space(req_line)));
-        HttpRequest request_obj = HttpRequest::parse_request_line(req_line);
-        // read all of the headers
-        String header_name, header_value;
-        while (1) {
-            String s = WIDEN(cl_sock.readline());
-            if (str_empty(s))
-                throw HttpParserError("process", "short read");
-            if (s == _T("\r\n") || s == _T("\n"))
-                break;
-            if (!is_space(s[0])) {
-                String new_header_name, new_header_value;
-                HttpMessage::parse_header_line(
-                            s, new_header_name, new_header_value);
-                if (!str_empty(header_name))
-                {
-                    header_value = trim_trailing_space(header_value);
-                    request_obj.set_header(header_name, header_value);
-                    LOG_DEBUG(NARROW(header_name + _T(": ") + header_value));
+    const int io_timeout = cl_sock.timeout();
+    int n_served = 0;
+    bool keep_alive = true;
+    string in_buf;
+    HttpRequestParser parser;
+    // read and process requests, one after another on the same connection
+    while (keep_alive) {
+        keep_alive = false;
+        bool in_request = false;
+        try {
+            // read the request, a pipelined one may be in the buffer already
+            parser.reset();
+            in_request = !in_buf.empty();
+            if (n_served && !in_request) {
+                cl_sock.set_timeout(keep_alive_timeout_);
+                cl_sock.set_deadline(0);
+            }
+            else
+                cl_sock.set_deadline(deadline_after(header_timeout_));
+            bool body_armed = false;
+            while (!parser.parse(in_buf.data(), in_buf.size())) {
+                // a slow client may trickle the data in, so the whole
+                // head and the whole body have their own deadlines
+                if (parser.head_complete() && !body_armed) {
+                    cl_sock.set_deadline(deadline_after(body_timeout_));
+                    body_armed = true;
+                }
+                if (!cl_sock.read_some(in_buf))
+                    break;
+                if (!in_request) {
+                    in_request = true;
+                    cl_sock.set_timeout(io_timeout);
+                    cl_sock.set_deadline(deadline_after(header_timeout_));
                 }
-                header_name = new_header_name;
-                header_value = new_header_value;
             }
-            else {
-                header_value += s;
+            if (!parser.complete()) {
+                if (!in_request && n_served)
+                    break;  // the client has closed the idle connection
+                throw HttpParserError("process", "short read");
             }
+            HttpRequest request_obj = build_request(
+                    parser, in_buf.data(), logger.get());
+            set_deadline(request_obj);
+            in_buf.erase(0, parser.message_length());
+            HttpResponse response = handle_request(request_obj, logger.get());
+            keep_alive = prepare_response(request_obj, ++n_served, response);
+            cl_sock.set_deadline(deadline_after(write_timeout_));
+            if (!send_response(cl_sock, logger.get(), response, keep_alive))
+                keep_alive = false;
         }
-        if (!str_empty(header_name))
-        {
-            header_value = trim_trailing_space(header_value);
-            request_obj.set_header(header_name, header_value);
-            LOG_DEBUG(NARROW(header_name + _T(": ") + header_value));
-        }
-        // parse content length and type
-        int cont_len = 0;
-        String cont_type;
-        if (request_obj.method() != _T("GET")) {
+        catch (const SocketEx &ex) {
+            if (!in_request && n_served) {
+                LOG_DEBUG(string("closing idle connection: ") + ex.what());
+                break;
+            }
+            LOG_ERROR(string("socket error: ") + ex.what());
             try {
-                cont_type = request_obj.get_content_type();
+                cl_sock.set_deadline(deadline_after(write_timeout_));
+                send_response(cl_sock, logger.get(),
+                              error_response(400, _T("Short read")));
             }
-            catch (const std::exception &) {
-                LOG_WARN("couldn't parse Content-Type header");
+            catch (const std::exception &ex2) {
+                LOG_ERROR(string("unable to send: ") + ex2.what());
             }
+        }
+        catch (const HttpParserError &ex) {
+            LOG_ERROR(string("parser error: ") + ex.what());
             try {
-                cont_len = request_obj.get_content_length();
+                cl_sock.set_deadline(deadline_after(write_timeout_));
+                send_response(cl_sock, logger.get(),
+                              error_response(400, _T("Bad request")));
             }
-            catch (const std::exception &) {
-                LOG_WARN("couldn't parse Content-Length header");
+            catch (const std::exception &ex2) {
+                LOG_ERROR(string("unable to send: ") + ex2.what());
             }
         }
-        // read request body
-        if (cont_len > 0) {
-            request_obj.set_body(cl_sock.read(cont_len));
-            if (starts_with(cont_type, _T("application/x-www-form-urlencoded")))
-                request_obj.urlparse_body();
-        }
-        if (request_obj.method() != _T("GET") &&
-            request_obj.method() != _T("POST"))
-        {
-            LOG_ERROR("unsupported method \""
-                      + NARROW(request_obj.method()) + "\"");
-            send_response(cl_sock, logger.get(),
-                          make_response(400, _T("Bad request"), bad_resp, cont_type_resp));
-        }
-        else {
-            if (!has_handler_for_path(request_obj.path()))
-            {
-                LOG_ERROR("Path " + NARROW(request_obj.path()) + " not found!");
+        catch (const std::exception &ex) {
+            LOG_ERROR(string("exception: ") + ex.what());
+            try {
+                cl_sock.set_deadline(deadline_after(write_timeout_));
                 send_response(cl_sock, logger.get(),
-                              make_response(404, _T("Not found"), bad_resp, cont_type_resp));
+                              error_response(500, _T("Internal server error")));
             }
-            else {
-                // handle the request
-                send_response(cl_sock, logger.get(), call_handler(request_obj));
+            catch (const std::exception &ex2) {
+                LOG_ERROR(string("unable to send: ") + ex2.what());
             }
         }
     }
-    catch (const SocketEx &ex) {
-        LOG_ERROR(string("socket error: ") + ex.what());
-        try {
-            send_response(cl_sock, logger.get(),
-                          make_response(400, _T("Short read"), bad_resp, cont_type_resp));
-        }
-        catch (const std::exception &ex2) {
-            LOG_ERROR(string("unable to send: ") + ex2.what());
-        }
-    }
-    catch (const HttpParserError &ex) {
-        LOG_ERROR(string("parser error: ") + ex.what());
-        try {
-            send_response(cl_sock, logger.get(),
-                          make_response(400, _T("Bad request"), bad_resp, cont_type_resp));
-        }
-        catch (const std::exception &ex2) {
-            LOG_ERROR(string("unable to send: ") + ex2.what());
-        }
-    }
-    catch (const std::exception &ex) {
-        LOG_ERROR(string("exception: ") + ex.what());
-        try {
-            send_response(cl_sock, logger.get(),
-                          make_response(500, _T("Internal server error"), bad_resp, cont_type_resp));
-        }
-        catch (const std::exception &ex2) {
-            LOG_ERROR(string("unable to send: ") + ex2.what());
-        }
-    }
     cl_sock.close(true);
 }
 
-static void
-cleanup_workers(bool force,
-        time_t &prev_clean_ts, Workers &workers, Yb::ILogger *logger)
-{
-    if (force || time(NULL) - prev_clean_ts >= 5) {   // sec.
-        LOG_DEBUG("clean up workers");
-        Workers workers_dead, workers_alive;
-        workers_dead.reserve(workers.size() + 1);
-        workers_alive.reserve(workers.size() + 1);
-        for (Workers::iterator i = workers.begin();
-             i != workers.end(); ++i)
-        {
-            if ((*i)->finished())
-                workers_dead.push_back(*i);
-            else
-                workers_alive.push_back(*i);
-        }
-        for (Workers::iterator i = workers_dead.begin();
-             i != workers_dead.end(); ++i)
-        {
-            (*i)->terminate();
-            (*i)->wait();
-        }
-        LOG_INFO("workers: "
-                 "processing=" + NARROW(to_string(workers_alive.size())) +
-                 ", done=" + NARROW(to_string(workers_dead.size())));
-        workers.swap(workers_alive);
-        prev_clean_ts = time(NULL);
-    }
-}
-
-
 void
 HttpServerBase::bind()
 {
@@ -235,9 +396,26 @@ HttpServerBase::bind()
         return;
     TcpSocket::init_socket_lib();
     Yb::ILogger *logger = log_.get();
+    if (!unix_socket_.empty()) {
+        LOG_INFO("start server on unix socket " + unix_socket_);
+        if (acceptors_ > 1)
+            LOG_WARN("only one acceptor is used with a unix socket");
+        sock_.bind_unix(unix_socket_, unix_socket_mode_);
+        sock_.listen(back_log_);
+        is_bound_ = true;
+        return;
+    }
     LOG_INFO("start server on port " + to_stdstring(port_));
-    sock_.bind(ip_addr_, port_);
+    bool reuse_port = acceptors_ > 1;
+    sock_.bind(ip_addr_, port_, reuse_port);
     sock_.listen(back_log_);
+    // the kernel balances the incoming connections among these sockets
+    for (int i = 1; i < acceptors_; ++i) {
+        TcpSocketPtr listener(new TcpSocket());
+        listener->bind(ip_addr_, port_, reuse_port);
+        listener->listen(back_log_);
+        listeners_.push_back(listener);
+    }
     is_bound_ = true;
 }
 
@@ -245,40 +423,204 @@ void
 HttpServerBase::serve()
 {
     bind();
+    if (HTTP_SERVER_EPOLL == mode_)
+        serve_epoll();
+    else
+        serve_threaded();
+}
+
+void
+HttpServerBase::pin_thread(int idx)
+{
+    if (!cpus_.size())
+        return;
+    std::vector<int> cpu(1, cpus_[idx % cpus_.size()]);
+    set_thread_affinity(cpu);
+}
+
+void
+HttpServerBase::serve_epoll()
+{
+#if defined(YBUTIL_WINDOWS)
+    throw std::runtime_error("epoll mode is not supported on this platform");
+#else
     Yb::ILogger *logger = log_.get();
-    Workers workers;
-    while (1) {
+    std::vector<SOCKET> listen_socks(1, sock_.handle());
+    for (size_t i = 0; i < listeners_.size(); ++i)
+        listen_socks.push_back(listeners_[i]->handle());
+    // with several acceptors each I/O thread accepts on its own socket
+    int io_threads = listen_socks.size() > 1?
+        (int)listen_socks.size(): io_threads_;
+    LOG_INFO("serving in epoll mode: io_threads=" + to_stdstring(io_threads) +
+             ", acceptors=" + to_stdstring(listen_socks.size()) +
+             ", workers=" + to_stdstring(workers_) +
+             ", queue_size=" + to_stdstring(queue_size_));
+    std::auto_ptr<HttpReactor> reactor(new HttpReactor(
+                this, io_threads, workers_, queue_size_, log_.get()));
+    {
+        ScopedLock lock(reactor_mux_);
+        reactor_ = reactor.get();
+    }
+    is_serving_ = true;
+    try {
+        reactor->run(listen_socks);
+    }
+    catch (...) {
+        ScopedLock lock(reactor_mux_);
+        reactor.reset();
+        reactor_ = NULL;
+        is_serving_ = false;
+        reactor_cond_.notify_all();
+        throw;
+    }
+    // stop() waits for this, so the server object can be destroyed
+    // as soon as it returns: nothing is touched after the unlock
+    ScopedLock lock(reactor_mux_);
+    reactor.reset();
+    reactor_ = NULL;
+    is_serving_ = false;
+    reactor_cond_.notify_all();
+#endif
+}
+
+void
+HttpServerBase::stop()
+{
+    // serve_epoll() can't drop the reactor until it is stopped
+    ScopedLock lock(reactor_mux_);
+    if (reactor_) {
+        reactor_->stop();
+        // wait for serve_epoll() to finish with this object
+        while (reactor_)
+            reactor_cond_.wait(lock);
+        return;
+    }
+    if (!threaded_)
+        return;
+    // this wakes up the acceptors blocked in accept()
+    stopping_ = true;
+    sock_.shutdown();
+    for (size_t i = 0; i < listeners_.size(); ++i)
+        listeners_[i]->shutdown();
+    // wait for serve_threaded() to join the acceptors and the workers
+    while (threaded_)
+        reactor_cond_.wait(lock);
+}
+
+void
+HttpServerBase::accept_loop(HttpServerBase *server, TcpSocket *listener,
+                            WorkerPool *pool, int idx)
+{
+    server->accept_clients(*listener, *pool, idx);
+}
+
+void
+HttpServerBase::serve_threaded()
+{
+    Yb::ILogger *logger = log_.get();
+    LOG_INFO("serving in threaded mode: acceptors=" +
+             to_stdstring(listeners_.size() + 1) +
+             ", workers=" + to_stdstring(workers_) +
+             ", queue_size=" + to_stdstring(queue_size_));
+    {
+        ScopedLock lock(reactor_mux_);
+        threaded_ = true;
+        stopping_ = false;
+    }
+    {
+        WorkerPool pool(workers_, queue_size_, log_.get());
+        pool.set_cpus(cpus_);
+        pool.start();
+        std::vector<AcceptorThreadPtr> acceptors;
+        for (size_t i = 0; i < listeners_.size(); ++i) {
+            AcceptorThreadPtr acceptor(new AcceptorThread(
+                        this, listeners_[i].get(), &pool, i + 1,
+                        HttpServerBase::accept_loop));
+            acceptors.push_back(acceptor);
+            acceptor->start();
+        }
+        accept_clients(sock_, pool, 0);
+        for (size_t i = 0; i < acceptors.size(); ++i)
+            acceptors[i]->wait();
+        // the queued clients are served before the workers quit
+        pool.stop();
+    }
+    // stop() waits for this, nothing is touched after the unlock
+    ScopedLock lock(reactor_mux_);
+    threaded_ = false;
+    is_serving_ = false;
+    reactor_cond_.notify_all();
+}
+
+void
+HttpServerBase::accept_clients(TcpSocket &listener, WorkerPool &pool, int idx)
+{
+    Yb::ILogger *logger = log_.get();
+    try {
+        pin_thread(idx);
+    }
+    catch (const std::exception &ex) {
+        LOG_WARN(ex.what());
+    }
+    while (!stopping_) {
         // accept request
-        bool force_clean = false;
         SOCKET cl_sock = INVALID_SOCKET;
         try {
             LOG_DEBUG("waiting for incoming connect...");
             string ip_addr;
             int ip_port;
             is_serving_ = true;
-            cl_sock = sock_.accept(&ip_addr, &ip_port);
+            cl_sock = listener.accept(&ip_addr, &ip_port);
             LOG_INFO("accepted from " + ip_addr + ":" + to_stdstring(ip_port));
-            WorkerThreadPtr worker(new WorkerThread(
+            WorkerTaskPtr task(new ClientSocketTask(
                         this, cl_sock, HttpServerBase::process));
-            workers.push_back(worker);
-            worker->start();
+            if (!pool.try_push(task)) {
+                LOG_WARN("worker queue is full, rejecting request from "
+                         + ip_addr + ":" + to_stdstring(ip_port));
+                SOCKET s = cl_sock;
+                cl_sock = INVALID_SOCKET;
+                reject_client(s);
+            }
         }
         catch (const std::exception &ex) {
+            // the listening socket is shut down by stop()
+            if (stopping_ && cl_sock == INVALID_SOCKET)
+                break;
             LOG_ERROR(string("exception: ") + ex.what());
             if (cl_sock != INVALID_SOCKET) {
                 LOG_INFO("closing failed socket");
                 TcpSocket s(cl_sock);
             }
-            force_clean = true;
         }
-        try {
-            cleanup_workers(force_clean,
-                    prev_clean_ts, workers, log_.get());
-        }
-        catch (const std::exception &ex) {
-            LOG_ERROR(string("cleanup exception: ") + ex.what());
+    }
+}
+
+void
+HttpServerBase::reject_client(SOCKET cl_s)
+{
+    Yb::ILogger *logger = log_.get();
+    TcpSocket cl_sock(cl_s, REJECT_TIMEOUT);
+    cl_sock.set_deadline(deadline_after(REJECT_TIMEOUT));
+    if (!send_response(cl_sock, logger,
+                       error_response(503, _T("Service unavailable")), true))
+        return;
+    // closing with the request unread makes the kernel send RST,
+    // which may destroy the 503 before the client has read it
+    try {
+        cl_sock.shutdown_write();
+        string buf;
+        size_t drained = 0;
+        while (drained < REJECT_DRAIN_SIZE) {
+            buf.clear();
+            size_t n = cl_sock.read_some(buf);
+            if (!n)
+                break;
+            drained += n;
         }
     }
+    catch (const std::exception &ex) {
+        LOG_DEBUG(string("closing rejected client: ") + ex.what());
+    }
 }
 
 // vim:ts=4:sts=4:sw=4:et:
@@ -1,29 +1,102 @@
 #ifndef _AUTH__MICRO_HTTP_H_
 #define _AUTH__MICRO_HTTP_H_
 
+#include <vector>
+#include <atomic>
+#include <condition_variable>
 #include <util/data_types.h>
 #include <util/nlogger.h>
+#include <util/thread.h>
+#include <util/utility.h>
 #include "http_message.h"
 #include "tcp_socket.h"
 
+enum {
+    HTTP_SERVER_THREADED = 0,   // blocking sockets served by a worker pool
+    HTTP_SERVER_EPOLL = 1,      // epoll reactor + bounded worker pool
+};
+
+class HttpReactor;
+class WorkerPool;
+class HttpRequestParser;
+
+typedef Yb::SharedPtr<TcpSocket>::Type TcpSocketPtr;
+
 class HttpServerBase
 {
 public:
     HttpServerBase(const std::string &ip_addr, int port, int back_log,
             Yb::ILogger *root_logger,
             const Yb::String &content_type, const std::string &bad_resp);
+    virtual ~HttpServerBase();
     void bind();
     void serve();
+    // makes serve() return and waits for it, the listening sockets
+    // are shut down in threaded mode
+    void stop();
     bool is_bound() const { return is_bound_; }
     bool is_serving() const { return is_serving_; }
 
+    // these must be set before serve() is called
+    void set_mode(int mode) { mode_ = mode; }
+    void set_io_threads(int n) { io_threads_ = n; }
+    void set_workers(int n) { workers_ = n; }
+    void set_queue_size(int n) { queue_size_ = n; }
+    // more than one acceptor means SO_REUSEPORT listening sockets,
+    // this must be set before bind()
+    void set_acceptors(int n) { acceptors_ = n; }
+    // listen on a Unix domain socket instead of ip_addr:port,
+    // mode is applied to the socket file unless negative;
+    // this must be set before bind()
+    void set_unix_socket(const std::string &path, int mode = -1)
+    {
+        unix_socket_ = path;
+        unix_socket_mode_ = mode;
+    }
+    // acceptor or I/O thread number i is pinned to cpus[i % cpus.size()]
+    void set_cpus(const std::vector<int> &cpus) { cpus_ = cpus; }
+    // keep_alive_timeout is in millisec, zero disables persistent connections;
+    // in the threaded mode an idle connection keeps its worker busy
+    void set_keep_alive(int keep_alive_timeout, int max_requests)
+    {
+        keep_alive_timeout_ = keep_alive_timeout;
+        max_keep_alive_requests_ = max_requests;
+    }
+    // deadlines in millisec for receiving the request head, the body,
+    // for the handler to respond and for sending the response back,
+    // zero disables a deadline
+    void set_timeouts(int header, int body, int handler, int write)
+    {
+        header_timeout_ = header;
+        body_timeout_ = body;
+        handler_timeout_ = handler;
+        write_timeout_ = write;
+    }
+    int mode() const { return mode_; }
+    int io_threads() const { return io_threads_; }
+    int workers() const { return workers_; }
+    int queue_size() const { return queue_size_; }
+    int acceptors() const { return acceptors_; }
+    const std::string &unix_socket() const { return unix_socket_; }
+    const std::vector<int> &cpus() const { return cpus_; }
+    int keep_alive_timeout() const { return keep_alive_timeout_; }
+    int max_keep_alive_requests() const { return max_keep_alive_requests_; }
+    int header_timeout() const { return header_timeout_; }
+    int body_timeout() const { return body_timeout_; }
+    int handler_timeout() const { return handler_timeout_; }
+    int write_timeout() const { return write_timeout_; }
+
+    static int parse_mode(const std::string &mode_str);
+
 protected:
     virtual bool has_handler_for_path(const Yb::String &path) = 0;
     virtual const HttpResponse call_handler(const HttpRequest &request) = 0;
 
 private:
+    friend class HttpReactor;
+
     bool is_bound_;
-    bool is_serving_;
+    std::atomic<bool> is_serving_;     // set by the acceptor threads too
     std::string ip_addr_;
     int port_;
     int back_log_;
@@ -31,15 +104,51 @@ private:
     std::string bad_resp_;
     Yb::ILogger::Ptr log_;
     TcpSocket sock_;
-    time_t prev_clean_ts;
+    int mode_;
+    int io_threads_;
+    int workers_;
+    int queue_size_;
+    int keep_alive_timeout_;
+    int max_keep_alive_requests_;
+    int header_timeout_;
+    int body_timeout_;
+    int handler_timeout_;
+    int write_timeout_;
+    int acceptors_;
+    std::string unix_socket_;
+    int unix_socket_mode_;
+    std::vector<int> cpus_;
+    std::vector<TcpSocketPtr> listeners_;
+    HttpReactor *reactor_;
+    bool threaded_;                 // serve_threaded() runs
+    std::atomic<bool> stopping_;    // the acceptors are to quit
+    Yb::Mutex reactor_mux_;
+    // reactor_ is dropped or threaded_ is reset
+    std::condition_variable_any reactor_cond_;
 
     static void process(HttpServerBase *server, SOCKET cl_s);
     void process_client_request(SOCKET cl_s);
+    void serve_threaded();
+    static void accept_loop(HttpServerBase *server, TcpSocket *listener,
+                            WorkerPool *pool, int idx);
+    void accept_clients(TcpSocket &listener, WorkerPool &pool, int idx);
+    void reject_client(SOCKET cl_s);
+    void pin_thread(int idx);
+    void serve_epoll();
+    static HttpRequest build_request(const HttpRequestParser &parser,
+                                     const char *buf, Yb::ILogger *logger);
+    void set_deadline(HttpRequest &request) const;
+    const HttpResponse handle_request(const HttpRequest &request,
+                                      Yb::ILogger *logger);
+    HttpResponse error_response(int code, const Yb::String &desc) const;
+    bool prepare_response(const HttpRequest &request, int n_served,
+                          HttpResponse &response) const;
     static HttpResponse make_response(int code, const Yb::String &desc,
                                       const std::string &body,
                                       const Yb::String &cont_type);
     static bool send_response(TcpSocket &cl_sock, Yb::ILogger *logger,
-                              const HttpResponse &response);
+                              const HttpResponse &response,
+                              bool keep_open = false);
     // non-copyable
     HttpServerBase(const HttpServerBase &);
     HttpServerBase &operator=(const HttpServerBase &);
@@ -5,8 +5,11 @@
 #include <ctime>
 #include <util/string_utils.h>
 #include "micro_http.h"
+#include "http_post.h"
+#include "upstream.h"
 #include "servant_utils.h"
 #include "app_class.h"
+#include "utils.h"
 
 void randomize()
 {
@@ -230,4 +233,128 @@ const HttpResponse XmlHttpWrapper::operator() (const HttpRequest &request)
     }
 }
 
+static int parse_file_mode(const std::string &s)
+{
+    char *end = NULL;
+    long mode = std::strtol(s.c_str(), &end, 8);
+    if (s.empty() || *end || mode < 0 || mode > 07777)
+        throw Yb::RunTimeError("invalid file mode: " + s);
+    return (int)mode;
+}
+
+void setup_http_server(HttpServerBase &server, IConfig &cfg)
+{
+    if (cfg.has_key("HttpListener/Mode"))
+        server.set_mode(HttpServerBase::parse_mode(
+                    cfg.get_value("HttpListener/Mode")));
+    if (cfg.has_key("HttpListener/IoThreads"))
+        server.set_io_threads(cfg.get_value_as_int("HttpListener/IoThreads"));
+    if (cfg.has_key("HttpListener/Workers"))
+        server.set_workers(cfg.get_value_as_int("HttpListener/Workers"));
+    if (cfg.has_key("HttpListener/QueueSize"))
+        server.set_queue_size(cfg.get_value_as_int("HttpListener/QueueSize"));
+    // in the threaded mode an idle persistent connection holds a worker,
+    // a few clients keeping theirs open would starve the rest
+    if (cfg.has_key("HttpListener/KeepAliveTimeout") &&
+            server.mode() != HTTP_SERVER_EPOLL)
+    {
+        Yb::ILogger::Ptr logger(
+                theApp::instance().new_logger("http_server"));
+        logger->warning("HttpListener/KeepAliveTimeout is ignored: "
+                        "keep-alive needs HttpListener/Mode epoll");
+    }
+    else if (cfg.has_key("HttpListener/KeepAliveTimeout")) {
+        int max_requests = server.max_keep_alive_requests();
+        if (cfg.has_key("HttpListener/KeepAliveRequests"))
+            max_requests = cfg.get_value_as_int("HttpListener/KeepAliveRequests");
+        server.set_keep_alive(
+                cfg.get_value_as_int("HttpListener/KeepAliveTimeout"),
+                max_requests);
+    }
+    if (cfg.has_key("HttpListener/Acceptors"))
+        server.set_acceptors(cfg.get_value_as_int("HttpListener/Acceptors"));
+    if (cfg.has_key("HttpListener/CpuList"))
+        server.set_cpus(parse_cpu_list(cfg.get_value("HttpListener/CpuList")));
+    int header_timeout = server.header_timeout();
+    if (cfg.has_key("HttpListener/HeaderTimeout"))
+        header_timeout = cfg.get_value_as_int("HttpListener/HeaderTimeout");
+    int body_timeout = server.body_timeout();
+    if (cfg.has_key("HttpListener/BodyTimeout"))
+        body_timeout = cfg.get_value_as_int("HttpListener/BodyTimeout");
+    int handler_timeout = server.handler_timeout();
+    if (cfg.has_key("HttpListener/HandlerTimeout"))
+        handler_timeout = cfg.get_value_as_int("HttpListener/HandlerTimeout");
+    int write_timeout = server.write_timeout();
+    if (cfg.has_key("HttpListener/WriteTimeout"))
+        write_timeout = cfg.get_value_as_int("HttpListener/WriteTimeout");
+    server.set_timeouts(header_timeout, body_timeout, handler_timeout,
+                        write_timeout);
+    if (cfg.has_key("HttpListener/UnixSocket")) {
+        int mode = -1;
+        if (cfg.has_key("HttpListener/UnixSocketMode"))
+            mode = parse_file_mode(
+                    NARROW(cfg.get_value("HttpListener/UnixSocketMode")));
+        server.set_unix_socket(
+                NARROW(cfg.get_value("HttpListener/UnixSocket")), mode);
+    }
+}
+
+void setup_http_client(IConfig &cfg)
+{
+    HttpClientEngine::set_default_logger(&theApp::instance());
+    if (cfg.has_key("HttpClient/Threads"))
+        HttpClientEngine::set_default_threads(
+                cfg.get_value_as_int("HttpClient/Threads"));
+    if (cfg.has_key("HttpClient/MaxIdleConnections"))
+        HttpClientEngine::set_default_max_idle(
+                cfg.get_value_as_int("HttpClient/MaxIdleConnections"));
+}
+
+static void read_upstream_settings(IConfig &cfg, const std::string &prefix,
+                                   UpstreamSettings &settings)
+{
+    struct {
+        const char *key;
+        int *value;
+    } keys[] = {
+        { "Timeout", &settings.timeout },
+        { "ConnectTimeout", &settings.connect_timeout },
+        { "Retries", &settings.retries },
+        { "RetryBudget", &settings.retry_budget },
+        { "Window", &settings.window },
+        { "MinRequests", &settings.min_requests },
+        { "ErrorPercent", &settings.error_percent },
+        { "SlowCall", &settings.slow_call },
+        { "OpenTime", &settings.open_time },
+        { "Probes", &settings.probes },
+        { "EjectErrors", &settings.eject_errors },
+        { "EjectTime", &settings.eject_time },
+        { "MaxEjectedPercent", &settings.max_ejected_percent },
+        { "HedgePercentile", &settings.hedge_percentile },
+        { "HedgeBudget", &settings.hedge_budget },
+        { "HedgeMinDelay", &settings.hedge_min_delay },
+    };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        const std::string key = prefix + keys[i].key;
+        if (cfg.has_key(key))
+            *keys[i].value = cfg.get_value_as_int(key);
+    }
+}
+
+void setup_upstreams(IConfig &cfg)
+{
+    UpstreamSettings settings;
+    read_upstream_settings(cfg, "Upstream/", settings);
+    UpstreamRegistry::set_default_settings(settings);
+}
+
+void setup_upstream_target(IConfig &cfg, const std::string &name,
+                           const std::string &uris)
+{
+    UpstreamSettings settings = UpstreamRegistry::default_settings();
+    read_upstream_settings(cfg, "Upstream/" + name + "/", settings);
+    UpstreamRegistry::instance().configure(
+            name, UpstreamRegistry::split_uris(uris), settings);
+}
+
 // vim:ts=4:sts=4:sw=4:et:
@@ -10,6 +10,8 @@
 #include "micro_http.h"
 #include "utils.h"
 
+class IConfig;
+
 void randomize();
 const std::string money2str(const Yb::Decimal &x);
 const std::string timestamp2str(double ts);
@@ -122,6 +124,27 @@ public:
     bool is_plain() const { return g_ != NULL; }
 };
 
+// Apply optional HttpListener/{Mode,IoThreads,Workers,QueueSize,
+// KeepAliveTimeout,KeepAliveRequests,Acceptors,CpuList,HeaderTimeout,
+// BodyTimeout,HandlerTimeout,WriteTimeout,UnixSocket,UnixSocketMode} settings.
+// Keep-alive is only turned on in the epoll mode
+void setup_http_server(HttpServerBase &server, IConfig &cfg);
+
+// Apply optional HttpClient/{Threads,MaxIdleConnections} settings
+// to the process-wide HttpClientEngine, before it's used
+void setup_http_client(IConfig &cfg);
+
+// Apply optional Upstream/* settings: the call timeouts, the retries,
+// the circuit breaker, the outlier ejection and the hedging of the
+// upstream calls
+void setup_upstreams(IConfig &cfg);
+
+// Same for the target called name at the given URIs, Upstream/<name>/*
+// keys override the defaults, to be called after setup_upstreams().
+// The targets are told apart by name, not by the hosts only
+void setup_upstream_target(IConfig &cfg, const std::string &name,
+                           const std::string &uris);
+
 #define WRAP(prefix, func) XmlHttpWrapper(_T(#func), func, prefix)
 #define SECURE_WRAP(prefix, secret, func) XmlHttpWrapper(_T(#func), func, prefix, secret)
 
@@ -4,16 +4,24 @@
 #include <cstdlib>
 #include <cstdio>
 #include <util/string_type.h>
+#include <util/utility.h>
+#ifndef YBUTIL_WINDOWS
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#endif
 
 using namespace std;
 
 void
 sleep_msec(int msec)
 {
-    struct timeval t;
-    t.tv_sec = msec / 1000;
-    t.tv_usec = (msec % 1000) * 1000;
-    ::select(0, NULL, NULL, NULL, &t);
+#ifdef YBUTIL_WINDOWS
+    ::Sleep(msec);
+#else
+    ::poll(NULL, 0, msec);
+#endif
 }
 
 void
@@ -36,9 +44,13 @@ TcpSocket::init_socket_lib()
 }
 
 SOCKET
-TcpSocket::create()
+TcpSocket::create(int family)
 {
-    SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+#ifdef YBUTIL_WINDOWS
+    SOCKET s = ::socket(family, SOCK_STREAM, 0);
+#else
+    SOCKET s = ::socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#endif
     if (INVALID_SOCKET == s)
         throw SocketEx("create", get_last_error());
     return s;
@@ -77,17 +89,49 @@ TcpSocket::get_last_error()
 }
 
 void
-TcpSocket::create_if_needed()
+TcpSocket::create_if_needed(int family)
 {
     if (!ok()) {
         buf_pos_ = 0;
         buf_.clear();
-        s_ = create();
+        s_ = create(family);
     }
 }
 
+#ifndef YBUTIL_WINDOWS
+static void
+fill_unix_addr(const string &path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw SocketEx("unix socket", "bad path: " + path);
+    memcpy(addr.sun_path, path.data(), path.size());
+}
+
+// whether a server still accepts the connections at the path, or it's
+// only the file left behind
+static bool
+unix_socket_alive(const string &path, const struct sockaddr_un &addr)
+{
+    SOCKET s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (INVALID_SOCKET == s)
+        throw SocketEx("create", TcpSocket::get_last_error());
+    int res = ::connect(s, (const struct sockaddr *)&addr, sizeof(addr));
+    int err = errno;
+    ::close(s);
+    // EAGAIN: the backlog of a live one is full
+    if (res == 0 || err == EAGAIN)
+        return true;
+    if (err == ECONNREFUSED)
+        return false;
+    errno = err;
+    throw SocketEx("connect", path + ": " + TcpSocket::get_last_error());
+}
+#endif
+
 void
-TcpSocket::bind(const string &ip_addr, int port)
+TcpSocket::bind(const string &ip_addr, int port, bool reuse_port)
 {
     create_if_needed();
     struct sockaddr_in addr;
@@ -98,10 +142,42 @@ TcpSocket::bind(const string &ip_addr, int port)
     SockOpt yes = 1;
     if (::setsockopt(s_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0)
         throw SocketEx("setsockopt(SO_REUSEADDR)", get_last_error());
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+        if (::setsockopt(s_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) != 0)
+            throw SocketEx("setsockopt(SO_REUSEPORT)", get_last_error());
+#else
+        throw SocketEx("setsockopt(SO_REUSEPORT)", "not supported");
+#endif
+    }
     if (::bind(s_, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         throw SocketEx("bind", get_last_error());
 }
 
+void
+TcpSocket::bind_unix(const string &path, int mode)
+{
+#ifdef YBUTIL_WINDOWS
+    throw SocketEx("bind_unix", "not supported");
+#else
+    struct sockaddr_un addr;
+    fill_unix_addr(path, addr);
+    create_if_needed(AF_UNIX);
+    // the file is left behind when the previous instance goes down,
+    // but a running one is not to be cut off
+    struct stat st;
+    if (::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (unix_socket_alive(path, addr))
+            throw SocketEx("bind", path + ": in use by another server");
+        ::unlink(path.c_str());
+    }
+    if (::bind(s_, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        throw SocketEx("bind", path + ": " + get_last_error());
+    if (mode >= 0 && ::chmod(path.c_str(), mode) == -1)
+        throw SocketEx("chmod", path + ": " + get_last_error());
+#endif
+}
+
 void
 TcpSocket::listen(int back_log)
 {
@@ -126,9 +202,21 @@ TcpSocket::accept(string *ip_addr, int *port)
         p_addr = (struct sockaddr *)&addr;
         p_addr_len = &addr_len;
     }
+#ifdef YBUTIL_WINDOWS
     SOCKET s2 = ::accept(s_, p_addr, p_addr_len);
+#else
+    SOCKET s2 = ::accept4(s_, p_addr, p_addr_len, SOCK_CLOEXEC);
+#endif
     if (INVALID_SOCKET == s2)
         throw SocketEx("accept", get_last_error());
+    if (p_addr && addr.sin_family != AF_INET) {
+        // the clients of a Unix domain socket are normally unnamed
+        if (port)
+            *port = 0;
+        if (ip_addr)
+            *ip_addr = "unix";
+        return s2;
+    }
     if (port)
         *port = ntohs(addr.sin_port);
     if (ip_addr) {
@@ -155,47 +243,152 @@ TcpSocket::connect(const string &ip_addr, int port)
         throw SocketEx("connect", get_last_error());
 }
 
-bool
-TcpSocket::read_chunk()
+void
+TcpSocket::connect_unix(const string &path)
 {
-    if (buf_pos_ < buf_.size())
-        return true;
-    buf_pos_ = 0;
-    buf_.clear();
-    fd_set rfds, efds;
-    FD_ZERO(&rfds);
+#ifdef YBUTIL_WINDOWS
+    throw SocketEx("connect_unix", "not supported");
+#else
+    struct sockaddr_un addr;
+    fill_unix_addr(path, addr);
+    create_if_needed(AF_UNIX);
+    if (::connect(s_, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        throw SocketEx("connect", path + ": " + get_last_error());
+#endif
+}
+
+void
+TcpSocket::wait_ready(bool for_write)
+{
+    int timeout = timeout_;
+    if (deadline_) {
+        long long time_left = deadline_ - Yb::get_cur_time_millisec();
+        if (time_left <= 0)
+            throw SocketEx("wait", "deadline expired");
+        if (time_left < timeout)
+            timeout = (int)time_left;
+    }
+#ifdef YBUTIL_WINDOWS
+    fd_set fds, efds;
+    FD_ZERO(&fds);
     FD_ZERO(&efds);
-    FD_SET(s_, &rfds);
+    FD_SET(s_, &fds);
     FD_SET(s_, &efds);
     struct timeval t;
-    t.tv_sec = timeout_ / 1000;
-    t.tv_usec = (timeout_ % 1000) * 1000;
-    int res = ::select(s_ + 1, &rfds, NULL, &efds, &t);
+    t.tv_sec = timeout / 1000;
+    t.tv_usec = (timeout % 1000) * 1000;
+    int res = ::select(s_ + 1, for_write? NULL: &fds, for_write? &fds: NULL,
+                       &efds, &t);
     if (!res)
         throw SocketEx("select", "timeout");
     if (res != 1 && res != 2)
         throw SocketEx("select", get_last_error());
     if (FD_ISSET(s_, &efds))
         throw SocketEx("select", "socket exception");
-    int max_chunk = 2500;
-    buf_.resize(max_chunk);
-    res = ::recv(s_, &buf_[0], max_chunk, 0);
-    if (res < 0 || res > max_chunk)
+#else
+    // unlike select() poll() works with any descriptor number
+    short events = for_write? POLLOUT: POLLIN;
+    struct pollfd pfd;
+    pfd.fd = s_;
+    pfd.events = events;
+    pfd.revents = 0;
+    int res;
+    do {
+        res = ::poll(&pfd, 1, timeout);
+    } while (res == -1 && errno == EINTR);
+    if (!res)
+        throw SocketEx("poll", "timeout");
+    if (res != 1)
+        throw SocketEx("poll", get_last_error());
+    if ((pfd.revents & (POLLERR | POLLNVAL)) && !(pfd.revents & events))
+        throw SocketEx("poll", "socket exception");
+#endif
+}
+
+int
+TcpSocket::recv_wait(char *dst, size_t n)
+{
+#ifdef YBUTIL_WINDOWS
+    wait_ready(false);
+    int res = ::recv(s_, dst, n, 0);
+    if (res < 0)
         throw SocketEx("read", get_last_error());
-    buf_.resize(res);
-    return buf_pos_ < buf_.size();
+    return res;
+#else
+    // try to read first, only wait for the socket if there is nothing yet
+    while (1) {
+        ssize_t res = ::recv(s_, dst, n, MSG_DONTWAIT);
+        if (res >= 0)
+            return res;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            throw SocketEx("read", get_last_error());
+        wait_ready(false);
+    }
+#endif
+}
+
+void
+TcpSocket::adapt_recv_size(size_t received)
+{
+    // the peer sends big messages, read them with fewer calls
+    if (received == recv_size_ && recv_size_ < MAX_RECV_SIZE)
+        recv_size_ *= 2;
+}
+
+bool
+TcpSocket::read_chunk()
+{
+    if (buf_pos_ < buf_len_)
+        return true;
+    buf_pos_ = buf_len_ = 0;
+    if (buf_.size() < recv_size_)
+        buf_.resize(recv_size_);
+    int res = recv_wait(&buf_[0], buf_.size());
+    buf_len_ = res;
+    adapt_recv_size(res);
+    return buf_pos_ < buf_len_;
+}
+
+size_t
+TcpSocket::read_some(string &buf)
+{
+    if (buf_pos_ < buf_len_) {
+        size_t n = buf_len_ - buf_pos_;
+        buf.append(buf_, buf_pos_, n);
+        buf_pos_ = buf_len_ = 0;
+        return n;
+    }
+    // receive right into the caller's buffer
+    size_t old_size = buf.size();
+    buf.resize(old_size + recv_size_);
+    int res;
+    try {
+        res = recv_wait(&buf[old_size], recv_size_);
+    }
+    catch (...) {
+        buf.resize(old_size);
+        throw;
+    }
+    buf.resize(old_size + res);
+    adapt_recv_size(res);
+    return res;
 }
 
 const string
 TcpSocket::readline()
 {
     string req;
-    req.reserve(40);
     while (1) {
-        while (buf_pos_ < buf_.size()) {
-            char c = buf_[buf_pos_++];
-            req.push_back(c);
-            if (c == '\n')
+        if (buf_pos_ < buf_len_) {
+            const char *start = buf_.data() + buf_pos_;
+            const char *eol = (const char *)memchr(
+                    start, '\n', buf_len_ - buf_pos_);
+            size_t n = eol? eol - start + 1: buf_len_ - buf_pos_;
+            req.append(start, n);
+            buf_pos_ += n;
+            if (eol)
                 return req;
         }
         if (!read_chunk())
@@ -206,22 +399,53 @@ TcpSocket::readline()
 const string
 TcpSocket::read(size_t n)
 {
-    string r;
-    r.reserve(n);
-    size_t pos = 0;
+    string r(n, '\0');
+    size_t pos = buf_len_ - buf_pos_;
+    if (pos > n)
+        pos = n;
+    if (pos) {
+        memcpy(&r[0], buf_.data() + buf_pos_, pos);
+        buf_pos_ += pos;
+    }
     while (pos < n) {
-        if (buf_pos_ < buf_.size()) {
-            size_t min_sz = buf_.size() - buf_pos_;
-            if (n - pos < min_sz)
-                min_sz = n - pos;
-            r.append(buf_, buf_pos_, min_sz);
-            buf_pos_ += min_sz;
-            pos += min_sz;
+        // the message goes straight to its destination,
+        // whatever follows it lands in the socket buffer
+        buf_pos_ = buf_len_ = 0;
+        if (buf_.size() < recv_size_)
+            buf_.resize(recv_size_);
+#ifdef YBUTIL_WINDOWS
+        int res = recv_wait(&r[pos], n - pos);
+        if (!res)
+            throw SocketEx("read", "short read");
+        pos += res;
+#else
+        struct iovec iov[2];
+        iov[0].iov_base = &r[pos];
+        iov[0].iov_len = n - pos;
+        iov[1].iov_base = &buf_[0];
+        iov[1].iov_len = buf_.size();
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t res = ::recvmsg(s_, &msg, MSG_DONTWAIT);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                throw SocketEx("read", get_last_error());
+            wait_ready(false);
+            continue;
         }
-        if (pos < n) {
-            if (!read_chunk())
-                throw SocketEx("read", "short read");
+        if (!res)
+            throw SocketEx("read", "short read");
+        if ((size_t)res > n - pos) {
+            buf_len_ = res - (n - pos);
+            pos = n;
         }
+        else
+            pos += res;
+#endif
     }
     return r;
 }
@@ -229,11 +453,68 @@ TcpSocket::read(size_t n)
 void
 TcpSocket::write(const string &msg)
 {
-    int count = ::send(s_, msg.c_str(), msg.size(), 0);
-    if (-1 == count)
-        throw SocketEx("write", get_last_error());
-    if (static_cast<size_t>(count) < msg.size())
-        throw SocketEx("write", "short write");
+    write(msg, string());
+}
+
+void
+TcpSocket::write(const string &head, const string &body)
+{
+    const size_t total = head.size() + body.size();
+    size_t pos = 0;
+    while (pos < total) {
+#ifdef YBUTIL_WINDOWS
+        const string &part = pos < head.size()? head: body;
+        size_t part_pos = pos < head.size()? pos: pos - head.size();
+        wait_ready(true);
+        int res = ::send(s_, part.data() + part_pos,
+                         part.size() - part_pos, 0);
+        if (res < 0)
+            throw SocketEx("write", get_last_error());
+        pos += res;
+#else
+        // gather both parts in one call, continue after a partial write
+        struct iovec iov[2];
+        int n = 0;
+        if (pos < head.size()) {
+            iov[n].iov_base = const_cast<char *>(head.data() + pos);
+            iov[n].iov_len = head.size() - pos;
+            ++n;
+        }
+        size_t body_pos = pos > head.size()? pos - head.size(): 0;
+        if (body_pos < body.size()) {
+            iov[n].iov_base = const_cast<char *>(body.data() + body_pos);
+            iov[n].iov_len = body.size() - body_pos;
+            ++n;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t res = ::sendmsg(s_, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (res >= 0)
+            pos += res;
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_ready(true);
+        else
+            throw SocketEx("write", get_last_error());
+#endif
+    }
+}
+
+void
+TcpSocket::shutdown_write()
+{
+    if (ok())
+        ::shutdown(s_, 1);
+}
+
+void
+TcpSocket::shutdown()
+{
+    if (ok())
+        ::shutdown(s_, 2);
 }
 
 void
@@ -249,8 +530,7 @@ TcpSocket::close(bool shut_down)
     ::close(s_);
 #endif
     s_ = INVALID_SOCKET;
-    buf_pos_ = 0;
-    buf_.clear();
+    buf_pos_ = buf_len_ = 0;
 }
 
 // vim:ts=4:sts=4:sw=4:et:
@@ -33,23 +33,34 @@ void sleep_msec(int msec);
 class TcpSocket {
     SOCKET s_;
     int timeout_;  // millisec
+    long long deadline_;  // absolute millisec, zero for none
     size_t buf_pos_;
-    std::string buf_;
+    size_t buf_len_;
+    size_t recv_size_;  // grows while the reads fill up the buffer
+    std::string buf_;   // reused, only buf_[buf_pos_ .. buf_len_) is data
 
+    void wait_ready(bool for_write);
+    int recv_wait(char *dst, size_t n);
+    void adapt_recv_size(size_t received);
     bool read_chunk();
-    void create_if_needed();
+    void create_if_needed(int family = AF_INET);
 
     TcpSocket(const TcpSocket &);  // non-copyable
     TcpSocket &operator=(const TcpSocket &);
 public:
+    enum { MIN_RECV_SIZE = 16 * 1024, MAX_RECV_SIZE = 64 * 1024 };
+
     static void init_socket_lib();
-    static SOCKET create();
+    static SOCKET create(int family = AF_INET);
     static std::string get_last_error();
 
     explicit TcpSocket(SOCKET s = INVALID_SOCKET, int timeout = 30000)
         : s_(s)
         , timeout_(timeout)
+        , deadline_(0)
         , buf_pos_(0)
+        , buf_len_(0)
+        , recv_size_(MIN_RECV_SIZE)
     {}
     ~TcpSocket()
     {
@@ -57,13 +68,31 @@ public:
     }
 
     bool ok() const { return INVALID_SOCKET != s_; }
-    void bind(const std::string &ip_addr, int port);
+    SOCKET handle() const { return s_; }
+    int timeout() const { return timeout_; }
+    void set_timeout(int timeout) { timeout_ = timeout; }
+    // unlike the timeout, which is applied to each wait, this is
+    // a limit for all of the waits until it's changed
+    void set_deadline(long long deadline) { deadline_ = deadline; }
+    void bind(const std::string &ip_addr, int port, bool reuse_port = false);
+    // a Unix domain socket instead of TCP, a stale socket file is removed;
+    // mode (e.g. 0660) is applied to the socket file unless negative
+    void bind_unix(const std::string &path, int mode = -1);
     void listen(int back_log = 3);
     SOCKET accept(std::string *ip_addr = NULL, int *port = NULL);
     void connect(const std::string &ip_addr, int port);
+    void connect_unix(const std::string &path);
     const std::string readline();
     const std::string read(size_t n);
+    // append whatever is available to buf, returns 0 on EOF
+    size_t read_some(std::string &buf);
     void write(const std::string &msg);
+    // send both parts with one writev-like call, no concatenation
+    void write(const std::string &head, const std::string &body);
+    // no more writes, the peer reads EOF after what's been sent
+    void shutdown_write();
+    // both ways, this also wakes up a thread blocked in accept()
+    void shutdown();
     void close(bool shut_down = false);
 };
 
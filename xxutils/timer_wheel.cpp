@@ -0,0 +1,80 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(int tick_msec, Yb::MilliSec now)
+    : tick_(tick_msec > 0? tick_msec: 1)
+    , next_tick_(now / tick_ + 1)
+    , size_(0)
+{}
+
+void
+TimerWheel::place(const Timer &timer)
+{
+    Tick tick = (timer.deadline + tick_ - 1) / tick_;
+    // what is already due fires at the next tick processed
+    if (tick < next_tick_)
+        tick = next_tick_;
+    Tick delta = tick - next_tick_;
+    int level = 0;
+    while (level < LEVELS - 1 &&
+           delta >= ((Tick)1 << (SLOT_BITS * (level + 1))))
+        ++level;
+    if (level == LEVELS - 1) {
+        // too far away, it will be re-placed when its slot fires
+        Tick max_delta = ((Tick)1 << (SLOT_BITS * LEVELS)) - 1;
+        if (delta > max_delta)
+            tick = next_tick_ + max_delta;
+    }
+    int idx = (tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+    slots_[level][idx].push_back(timer);
+}
+
+void
+TimerWheel::schedule(Key key, Yb::MilliSec deadline)
+{
+    Timer timer;
+    timer.key = key;
+    timer.deadline = deadline;
+    place(timer);
+    ++size_;
+}
+
+int
+TimerWheel::cascade(int level)
+{
+    int idx = (next_tick_ >> (SLOT_BITS * level)) & (SLOTS - 1);
+    Slot timers;
+    timers.swap(slots_[level][idx]);
+    for (size_t i = 0; i < timers.size(); ++i)
+        place(timers[i]);
+    return idx;
+}
+
+void
+TimerWheel::advance(Yb::MilliSec now, std::vector<Timer> &expired)
+{
+    Tick now_tick = now / tick_;
+    while (next_tick_ <= now_tick) {
+        if (!size_) {
+            next_tick_ = now_tick + 1;
+            break;
+        }
+        int idx = next_tick_ & (SLOTS - 1);
+        // when a level wraps, bring the next level's slot one level down
+        for (int level = 1; !idx && level < LEVELS; ++level)
+            idx = cascade(level);
+        Slot timers;
+        timers.swap(slots_[0][next_tick_ & (SLOTS - 1)]);
+        ++next_tick_;
+        for (size_t i = 0; i < timers.size(); ++i) {
+            if (timers[i].deadline <= now) {
+                expired.push_back(timers[i]);
+                --size_;
+            }
+            else
+                place(timers[i]);
+        }
+    }
+}
+
+// vim:ts=4:sts=4:sw=4:et:
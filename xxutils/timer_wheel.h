@@ -0,0 +1,48 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__TIMER_WHEEL_H
+#define CARD_PROXY__TIMER_WHEEL_H
+
+#include <vector>
+#include <util/utility.h>
+
+// Hierarchical timing wheel: four levels of 64 slots, each level
+// covering 64 times the span of the previous one.  Scheduling is O(1),
+// advancing costs O(1) per tick plus the number of the fired timers.
+// There is no cancellation: the owner re-schedules a key when its
+// deadline changes and ignores the stale expirations, comparing
+// the fired deadline with the actual one.
+class TimerWheel
+{
+public:
+    typedef unsigned long long Key;
+
+    struct Timer
+    {
+        Key key;
+        Yb::MilliSec deadline;
+    };
+
+    TimerWheel(int tick_msec, Yb::MilliSec now);
+    void schedule(Key key, Yb::MilliSec deadline);
+    // appends the timers with deadline <= now to expired
+    void advance(Yb::MilliSec now, std::vector<Timer> &expired);
+    size_t size() const { return size_; }
+    bool empty() const { return !size_; }
+    int tick_msec() const { return tick_; }
+
+private:
+    enum { LEVELS = 4, SLOT_BITS = 6, SLOTS = 1 << SLOT_BITS };
+    typedef unsigned long long Tick;
+    typedef std::vector<Timer> Slot;
+
+    int tick_;
+    Tick next_tick_;    // the first tick not processed yet
+    size_t size_;
+    Slot slots_[LEVELS][SLOTS];
+
+    void place(const Timer &timer);
+    int cascade(int level);
+};
+
+#endif // CARD_PROXY__TIMER_WHEEL_H
+// vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,362 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "upstream.h"
+#include <sstream>
+#include <algorithm>
+#include <util/string_utils.h>
+#include "utils.h"
+
+using namespace std;
+using namespace Yb;
+
+static const int MAX_EJECTION_FACTOR = 10;
+// that many retries may be saved up for a burst
+static const int MAX_RETRY_TOKENS = 1000;
+
+static Mutex settings_mux_;
+static UpstreamSettings default_settings_;
+
+UpstreamSettings::UpstreamSettings()
+    : timeout(30000)
+    , connect_timeout(0)
+    , retries(1)
+    , retry_budget(10)
+    , window(10000)
+    , min_requests(20)
+    , error_percent(50)
+    , slow_call(10000)
+    , open_time(5000)
+    , probes(3)
+    , eject_errors(5)
+    , eject_time(30000)
+    , max_ejected_percent(50)
+    , hedge_percentile(0)
+    , hedge_budget(10)
+    , hedge_min_delay(5)
+{}
+
+UpstreamTarget::UpstreamTarget(const vector<string> &endpoints,
+                               const UpstreamSettings &settings)
+    : settings_(settings)
+    , state_(BREAKER_CLOSED)
+    , opened_at_(0)
+    , probes_out_(0)
+    , probes_ok_(0)
+    , next_(0)
+    , retry_tokens_(0)
+{
+    if (settings_.window < BUCKETS)
+        settings_.window = BUCKETS;
+    if (settings_.probes < 1)
+        settings_.probes = 1;
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        Endpoint ep;
+        ep.name = endpoints[i];
+        ep.outstanding = ep.errors = ep.ejections = 0;
+        ep.ejected_until = 0;
+        endpoints_.push_back(ep);
+    }
+    close();
+    if (settings_.hedge_percentile > 0)
+        hedge_policy_.reset(new HttpHedgePolicy(settings_.hedge_percentile,
+                                                settings_.hedge_budget,
+                                                settings_.hedge_min_delay));
+}
+
+int
+UpstreamTarget::pick(MilliSec now)
+{
+    // the least loaded of the healthy ones, or the one to be back first
+    int best = -1, back_first = 0;
+    for (size_t j = 0; j < endpoints_.size(); ++j) {
+        size_t i = (next_ + j) % endpoints_.size();
+        const Endpoint &ep = endpoints_[i];
+        if (ep.ejected_until > now) {
+            if (ep.ejected_until < endpoints_[back_first].ejected_until)
+                back_first = i;
+            continue;
+        }
+        if (best == -1 || ep.outstanding < endpoints_[best].outstanding)
+            best = i;
+    }
+    ++next_;
+    return best != -1? best: back_first;
+}
+
+bool
+UpstreamTarget::acquire(MilliSec now, UpstreamCall &call)
+{
+    ScopedLock lock(mux_);
+    if (endpoints_.empty())
+        return false;
+    call.probe = false;
+    if (state_ == BREAKER_OPEN) {
+        if (now - opened_at_ < settings_.open_time)
+            return false;
+        state_ = BREAKER_HALF_OPEN;
+        probes_out_ = probes_ok_ = 0;
+    }
+    if (state_ == BREAKER_HALF_OPEN) {
+        if (probes_out_ + probes_ok_ >= settings_.probes)
+            return false;
+        ++probes_out_;
+        call.probe = true;
+    }
+    call.endpoint = pick(now);
+    call.started = now;
+    retry_tokens_ = std::min(retry_tokens_ + settings_.retry_budget,
+                             MAX_RETRY_TOKENS);
+    ++endpoints_[call.endpoint].outstanding;
+    return true;
+}
+
+bool
+UpstreamTarget::acquire_hedge(const UpstreamCall &call, MilliSec now,
+                              UpstreamCall &hedge)
+{
+    ScopedLock lock(mux_);
+    if (state_ != BREAKER_CLOSED)
+        return false;
+    int best = -1;
+    for (size_t i = 0; i < endpoints_.size(); ++i) {
+        const Endpoint &ep = endpoints_[i];
+        if ((int)i == call.endpoint || ep.ejected_until > now)
+            continue;
+        if (best == -1 || ep.outstanding < endpoints_[best].outstanding)
+            best = i;
+    }
+    if (best == -1)
+        return false;
+    hedge.endpoint = best;
+    hedge.probe = false;
+    hedge.started = now;
+    ++endpoints_[best].outstanding;
+    return true;
+}
+
+void
+UpstreamTarget::cancel(const UpstreamCall &call)
+{
+    ScopedLock lock(mux_);
+    --endpoints_[call.endpoint].outstanding;
+    if (call.probe)
+        --probes_out_;
+}
+
+bool
+UpstreamTarget::spend_retry()
+{
+    ScopedLock lock(mux_);
+    if (retry_tokens_ < 100)
+        return false;
+    retry_tokens_ -= 100;
+    return true;
+}
+
+void
+UpstreamTarget::release(const UpstreamCall &call, bool ok, MilliSec now)
+{
+    ScopedLock lock(mux_);
+    Endpoint &ep = endpoints_[call.endpoint];
+    --ep.outstanding;
+    // a slow endpoint is not an outlier, the breaker sees to it
+    if (ok) {
+        ep.errors = 0;
+        if (ep.ejected_until <= now)
+            ep.ejections = 0;
+    }
+    else if (++ep.errors >= settings_.eject_errors)
+        eject(ep, now);
+    bool failed = !ok ||
+        (settings_.slow_call > 0 && now - call.started > settings_.slow_call);
+    if (call.probe) {
+        --probes_out_;
+        if (state_ != BREAKER_HALF_OPEN)
+            return;
+        if (failed)
+            trip(now);
+        else if (++probes_ok_ >= settings_.probes)
+            close();
+        return;
+    }
+    record(failed, now);
+}
+
+void
+UpstreamTarget::eject(Endpoint &ep, MilliSec now)
+{
+    ep.errors = 0;
+    if (ep.ejected_until > now)
+        return;
+    size_t ejected = 0;
+    for (size_t i = 0; i < endpoints_.size(); ++i)
+        if (endpoints_[i].ejected_until > now)
+            ++ejected;
+    // keep enough of them to serve, the breaker takes it from there
+    if ((int)(ejected + 1) * 100 >
+            settings_.max_ejected_percent * (int)endpoints_.size())
+        return;
+    if (ep.ejections < MAX_EJECTION_FACTOR)
+        ++ep.ejections;
+    ep.ejected_until = now + (MilliSec)settings_.eject_time * ep.ejections;
+}
+
+void
+UpstreamTarget::record(bool failed, MilliSec now)
+{
+    long long slot = now / (settings_.window / BUCKETS);
+    Bucket &bucket = buckets_[slot % BUCKETS];
+    if (bucket.slot != slot) {
+        bucket.slot = slot;
+        bucket.total = bucket.failed = 0;
+    }
+    ++bucket.total;
+    if (failed)
+        ++bucket.failed;
+    // the calls which were in flight when it opened change nothing
+    if (state_ != BREAKER_CLOSED)
+        return;
+    int total = 0, n_failed = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        if (buckets_[i].slot > slot - BUCKETS) {
+            total += buckets_[i].total;
+            n_failed += buckets_[i].failed;
+        }
+    }
+    if (total >= settings_.min_requests &&
+            n_failed * 100 >= settings_.error_percent * total)
+        trip(now);
+}
+
+void
+UpstreamTarget::trip(MilliSec now)
+{
+    state_ = BREAKER_OPEN;
+    opened_at_ = now;
+    probes_out_ = probes_ok_ = 0;
+}
+
+void
+UpstreamTarget::close()
+{
+    state_ = BREAKER_CLOSED;
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets_[i].slot = -1;
+        buckets_[i].total = buckets_[i].failed = 0;
+    }
+}
+
+int
+UpstreamTarget::state()
+{
+    ScopedLock lock(mux_);
+    return state_;
+}
+
+bool
+UpstreamTarget::is_ejected(int endpoint, MilliSec now)
+{
+    ScopedLock lock(mux_);
+    return endpoints_[endpoint].ejected_until > now;
+}
+
+int
+UpstreamTarget::outstanding(int endpoint)
+{
+    ScopedLock lock(mux_);
+    return endpoints_[endpoint].outstanding;
+}
+
+UpstreamRegistry &
+UpstreamRegistry::instance()
+{
+    static UpstreamRegistry registry;
+    return registry;
+}
+
+void
+UpstreamRegistry::set_default_settings(const UpstreamSettings &settings)
+{
+    ScopedLock lock(settings_mux_);
+    default_settings_ = settings;
+}
+
+const UpstreamSettings
+UpstreamRegistry::default_settings()
+{
+    ScopedLock lock(settings_mux_);
+    return default_settings_;
+}
+
+const string
+UpstreamRegistry::uri_endpoint(const string &uri)
+{
+    size_t pos = uri.find("://");
+    pos = uri.find('/', pos == string::npos? 0: pos + 3);
+    return StrUtils::str_to_lower(uri.substr(0, pos));
+}
+
+const vector<string>
+UpstreamRegistry::split_uris(const string &uris)
+{
+    vector<string> result;
+    istringstream in(uris);
+    string uri;
+    while (in >> uri)
+        result.push_back(uri);
+    return result;
+}
+
+const string
+UpstreamRegistry::replace_uri_suffix(const string &uris,
+                                     const string &suffix,
+                                     const string &replacement)
+{
+    string result;
+    vector<string> v = split_uris(uris);
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (!StrUtils::ends_with(v[i], suffix))
+            throw ::RunTimeError("URI '" + v[i] + "' doesn't end with '"
+                                 + suffix + "'");
+        if (!result.empty())
+            result += " ";
+        result += v[i].substr(0, v[i].size() - suffix.size()) + replacement;
+    }
+    return result;
+}
+
+const vector<string>
+UpstreamRegistry::endpoints(const string &name, const vector<string> &uris,
+                            string &key)
+{
+    vector<string> result;
+    key = name + " ";
+    for (size_t i = 0; i < uris.size(); ++i) {
+        result.push_back(uri_endpoint(uris[i]));
+        key += result.back() + " ";
+    }
+    return result;
+}
+
+UpstreamTargetPtr
+UpstreamRegistry::get(const string &name, const vector<string> &uris)
+{
+    string key;
+    vector<string> eps = endpoints(name, uris, key);
+    ScopedLock lock(mux_);
+    UpstreamTargetPtr &target = targets_[key];
+    if (!target)
+        target.reset(new UpstreamTarget(eps, default_settings()));
+    return target;
+}
+
+void
+UpstreamRegistry::configure(const string &name, const vector<string> &uris,
+                            const UpstreamSettings &settings)
+{
+    string key;
+    vector<string> eps = endpoints(name, uris, key);
+    ScopedLock lock(mux_);
+    targets_[key].reset(new UpstreamTarget(eps, settings));
+}
+
+// vim:ts=4:sts=4:sw=4:et:
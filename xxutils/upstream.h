@@ -0,0 +1,160 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__UPSTREAM_H
+#define CARD_PROXY__UPSTREAM_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <util/data_types.h>
+#include <util/utility.h>
+#include <util/thread.h>
+#include "http_client.h"
+
+// All the times are in milliseconds
+struct UpstreamSettings
+{
+    int timeout;                // of a single call
+    int connect_timeout;        // 0 - only the call timeout
+    int retries;                // of an idempotent call, at most
+    int retry_budget;           // percent of the calls which may be retried
+    int window;                 // the breaker looks that far back
+    int min_requests;           // fewer calls in the window never trip it
+    int error_percent;          // of failed or slow calls to trip it
+    int slow_call;              // a slower call counts as failed, 0 - off
+    int open_time;              // failing fast before probing again
+    int probes;                 // successful probes needed to close
+    int eject_errors;           // errors in a row to eject an endpoint
+    int eject_time;             // grows with each ejection in a row
+    int max_ejected_percent;    // of the endpoints which may be out
+    int hedge_percentile;       // of the latencies to hedge after, 0 - off
+    int hedge_budget;           // percent of the calls which may be hedged
+    int hedge_min_delay;
+
+    UpstreamSettings();
+};
+
+enum {
+    BREAKER_CLOSED = 0,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN,
+};
+
+struct UpstreamCall
+{
+    int endpoint;
+    bool probe;
+    Yb::MilliSec started;
+};
+
+// A service reachable at one or more endpoints: a circuit breaker over
+// all of them, outlier ejection and least-outstanding-request balancing
+// between them.  The breaker counts the failed and the slow calls over
+// a rolling window, once it's open the calls fail fast, and after
+// open_time a few probes decide whether to close it.
+class UpstreamTarget
+{
+public:
+    UpstreamTarget(const std::vector<std::string> &endpoints,
+                   const UpstreamSettings &settings);
+    // picks the endpoint for the next call, false means fail fast
+    bool acquire(Yb::MilliSec now, UpstreamCall &call);
+    // each acquired call must be released
+    void release(const UpstreamCall &call, bool ok, Yb::MilliSec now);
+    // a hedge of the given call: the least loaded healthy endpoint
+    // except the call's one, false if there's none or the breaker is not
+    // closed.  It's released as any call if it has been sent
+    bool acquire_hedge(const UpstreamCall &call, Yb::MilliSec now,
+                       UpstreamCall &hedge);
+    // an acquired call which has not been sent, or has been cancelled
+    // having lost to its hedge: it tells nothing of the endpoint
+    void cancel(const UpstreamCall &call);
+    // NULL unless hedging is on
+    HttpHedgePolicyPtr hedge_policy() const { return hedge_policy_; }
+    // a failed call is about to be repeated, false if it's over the
+    // budget: the retries must not add to the load of a failing service
+    bool spend_retry();
+
+    int state();
+    bool is_ejected(int endpoint, Yb::MilliSec now);
+    int outstanding(int endpoint);
+    size_t size() const { return endpoints_.size(); }
+    const std::string &endpoint(int idx) const { return endpoints_[idx].name; }
+    const UpstreamSettings &settings() const { return settings_; }
+
+private:
+    struct Endpoint
+    {
+        std::string name;
+        int outstanding;
+        int errors;             // in a row
+        int ejections;          // in a row
+        Yb::MilliSec ejected_until;
+    };
+    struct Bucket
+    {
+        long long slot;
+        int total;
+        int failed;
+    };
+    enum { BUCKETS = 10 };
+
+    UpstreamSettings settings_;
+    Yb::Mutex mux_;
+    std::vector<Endpoint> endpoints_;
+    Bucket buckets_[BUCKETS];
+    int state_;
+    Yb::MilliSec opened_at_;
+    int probes_out_;
+    int probes_ok_;
+    size_t next_;               // where the ties are broken from
+    int retry_tokens_;          // in percent of a retry
+    HttpHedgePolicyPtr hedge_policy_;
+
+    int pick(Yb::MilliSec now);
+    void eject(Endpoint &ep, Yb::MilliSec now);
+    void record(bool failed, Yb::MilliSec now);
+    void trip(Yb::MilliSec now);
+    void close();
+};
+
+typedef Yb::SharedPtr<UpstreamTarget>::Type UpstreamTargetPtr;
+
+// The targets by their names and endpoints: the calls of a target share
+// the state whatever path they go to, while two targets served by the
+// same hosts keep their own settings and circuit breakers
+class UpstreamRegistry
+{
+public:
+    static UpstreamRegistry &instance();
+    // these only have effect on the targets created afterwards
+    static void set_default_settings(const UpstreamSettings &settings);
+    static const UpstreamSettings default_settings();
+
+    // the endpoint of a URI is its scheme, host and port
+    static const std::string uri_endpoint(const std::string &uri);
+    // URIs separated by whitespace
+    static const std::vector<std::string> split_uris(const std::string &uris);
+    // for each of the URIs: replace the suffix with the replacement,
+    // throws RunTimeError if some of them doesn't end with the suffix
+    static const std::string replace_uri_suffix(const std::string &uris,
+                                                const std::string &suffix,
+                                                const std::string &replacement);
+
+    UpstreamTargetPtr get(const std::string &name,
+                          const std::vector<std::string> &uris);
+    // the target's own settings, instead of the default ones
+    void configure(const std::string &name,
+                   const std::vector<std::string> &uris,
+                   const UpstreamSettings &settings);
+
+private:
+    Yb::Mutex mux_;
+    std::map<std::string, UpstreamTargetPtr> targets_;
+
+    static const std::vector<std::string> endpoints(
+            const std::string &name, const std::vector<std::string> &uris,
+            std::string &key);
+};
+
+#endif // CARD_PROXY__UPSTREAM_H
+// vim:ts=4:sts=4:sw=4:et:
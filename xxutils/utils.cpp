@@ -3,10 +3,14 @@
 #include <iterator>
 #include <cstring>
 #include <ctime>
+#include <cerrno>
+#include <atomic>
 #include <unistd.h>
 #include <fcntl.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <openssl/crypto.h>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <util/string_utils.h>
 #include "stack_trace.h"
@@ -88,21 +92,51 @@ std::string string_from_hexstring(const std::string &hex_input, int mode)
     return result;
 }
 
+static const char b64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define B64_INVALID 0x80
+
+// the 6-bit values by character, B64_INVALID for the rest including '='
+static const unsigned char *b64_decode_table()
+{
+    static unsigned char table[256];
+    static bool ready = [] {
+        memset(table, B64_INVALID, sizeof(table));
+        for (int i = 0; i < 64; ++i)
+            table[(unsigned char)b64_alphabet[i]] = i;
+        return true;
+    }();
+    (void)ready;
+    return table;
+}
+
 std::string encode_base64(const std::string &message)
 {
     if (!message.size())
         return std::string();
     size_t encoded_size = ((message.size() + 2) / 3) * 4;
     std::string result(encoded_size, 0);
-    FILE *stream = fmemopen(&result[0], encoded_size + 1, "w");
-    BIO *b64 = BIO_new(BIO_f_base64());
-    BIO *bio = BIO_new_fp(stream, BIO_NOCLOSE);
-    bio = BIO_push(b64, bio);
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(bio, message.data(), message.size());
-    (void)BIO_flush(bio);
-    BIO_free_all(bio);
-    fclose(stream);
+    const unsigned char *in = (const unsigned char *)message.data();
+    char *out = &result[0];
+    size_t full = message.size() / 3 * 3;
+    for (size_t i = 0; i < full; i += 3, out += 4) {
+        unsigned v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        out[0] = b64_alphabet[v >> 18];
+        out[1] = b64_alphabet[(v >> 12) & 63];
+        out[2] = b64_alphabet[(v >> 6) & 63];
+        out[3] = b64_alphabet[v & 63];
+    }
+    size_t tail = message.size() - full;
+    if (tail) {
+        unsigned v = in[full] << 16;
+        if (tail == 2)
+            v |= in[full + 1] << 8;
+        out[0] = b64_alphabet[v >> 18];
+        out[1] = b64_alphabet[(v >> 12) & 63];
+        out[2] = tail == 2? b64_alphabet[(v >> 6) & 63]: '=';
+        out[3] = '=';
+    }
     return result;
 }
 
@@ -114,20 +148,6 @@ static bool valid_b64_char(char c)
             c == '+' || c == '/' || c == '=');
 }
 
-static int b64_decoded_size(const std::string &b64input)
-{
-    size_t length = b64input.size();
-    size_t padding = 0;
-    if (length > 1) {
-        // Check for trailing '=''s as padding
-        if (b64input[length - 1] == '=' && b64input[length - 2] == '=')
-            padding = 2;
-        else if (b64input[length - 1] == '=')
-            padding = 1;
-    }
-    return (length / 4) * 3 - padding;
-}
-
 static void check_base64(const std::string &b64message)
 {
     if (b64message.size() % 4)
@@ -149,24 +169,46 @@ std::string decode_base64(const std::string &b64message)
 {
     if (!b64message.size())
         return std::string();
-    check_base64(b64message);
-    size_t decoded_size = b64_decoded_size(b64message);
-    std::string result(decoded_size, 0);
-    FILE *stream = fmemopen(const_cast<char *>(b64message.data()),
-                            b64message.size(), "r");
-    BIO *b64 = BIO_new(BIO_f_base64());
-    BIO *bio = BIO_new_fp(stream, BIO_NOCLOSE);
-    bio = BIO_push(b64, bio);
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    char *buffer = &result[0];
-    decoded_size = BIO_read(bio, buffer, b64message.size());
-    buffer[decoded_size] = '\0';
-    BIO_free_all(bio);
-    fclose(stream);
-    return result; 
+    size_t length = b64message.size();
+    if (length % 4)
+        throw RunTimeError("BASE64 data of wrong size");
+    const unsigned char *in = (const unsigned char *)b64message.data();
+    size_t padding = 0;
+    if (in[length - 1] == '=')
+        padding = in[length - 2] == '='? 2: 1;
+    std::string result(length / 4 * 3 - padding, 0);
+    unsigned char *out = (unsigned char *)&result[0];
+    const unsigned char *table = b64_decode_table();
+    // any invalid character, '=' in the middle included, is collected
+    // in bad and reported by check_base64() with its usual message
+    unsigned bad = 0;
+    size_t full = padding? length - 4: length;
+    for (size_t i = 0; i < full; i += 4, out += 3) {
+        unsigned a = table[in[i]], b = table[in[i + 1]],
+                 c = table[in[i + 2]], d = table[in[i + 3]];
+        bad |= a | b | c | d;
+        unsigned v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = v >> 16;
+        out[1] = v >> 8;
+        out[2] = v;
+    }
+    if (padding) {
+        unsigned a = table[in[full]], b = table[in[full + 1]],
+                 c = padding == 1? table[in[full + 2]]: 0;
+        bad |= a | b | c;
+        unsigned v = (a << 18) | (b << 12) | (c << 6);
+        out[0] = v >> 16;
+        if (padding == 1)
+            out[1] = v >> 8;
+    }
+    if (bad & B64_INVALID) {
+        check_base64(b64message);
+        throw RunTimeError("Invalid BASE64 character");
+    }
+    return result;
 }
 
-void generate_random_bytes(void *buf, size_t len)
+static void read_urandom(void *buf, size_t len)
 {
     int fd = ::open("/dev/urandom", O_RDONLY);
     if (fd == -1)
@@ -177,6 +219,84 @@ void generate_random_bytes(void *buf, size_t len)
         throw RunTimeError("Can't read from /dev/urandom");
 }
 
+// straight from the kernel CSPRNG, /dev/urandom where there's no getrandom
+static void read_getrandom(void *buf, size_t len)
+{
+#ifdef SYS_getrandom
+    unsigned char *p = (unsigned char *)buf;
+    while (len) {
+        long n = ::syscall(SYS_getrandom, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOSYS) {
+                read_urandom(p, len);
+                return;
+            }
+            throw RunTimeError("getrandom() failed");
+        }
+        p += n;
+        len -= n;
+    }
+#else
+    read_urandom(buf, len);
+#endif
+}
+
+// bumped in a forked child, whose pools are copies of the parent's
+static std::atomic<unsigned> random_fork_generation(0);
+
+static void random_on_fork()
+{
+    ++random_fork_generation;
+}
+
+// The random bytes of a thread, read from the kernel RANDOM_POOL_SIZE
+// at a time.  The bytes are wiped as they are served, the unserved
+// ones are at the end of the buffer.
+struct RandomPool
+{
+    unsigned char bytes[RANDOM_POOL_SIZE];
+    size_t avail;
+    unsigned generation;
+
+    RandomPool()
+        : avail(0)
+    {
+        static int registered = pthread_atfork(NULL, NULL, random_on_fork);
+        (void)registered;
+        generation = random_fork_generation;
+    }
+
+    ~RandomPool()
+    {
+        OPENSSL_cleanse(bytes, sizeof(bytes));
+    }
+};
+
+void generate_random_bytes(void *buf, size_t len)
+{
+    static thread_local RandomPool pool;
+    if (pool.generation != random_fork_generation) {
+        // the parent may serve the same bytes
+        OPENSSL_cleanse(pool.bytes, sizeof(pool.bytes));
+        pool.avail = 0;
+        pool.generation = random_fork_generation;
+    }
+    if (len > RANDOM_POOL_SIZE / 4) {
+        read_getrandom(buf, len);
+        return;
+    }
+    if (len > pool.avail) {
+        read_getrandom(pool.bytes, RANDOM_POOL_SIZE);
+        pool.avail = RANDOM_POOL_SIZE;
+    }
+    unsigned char *src = pool.bytes + RANDOM_POOL_SIZE - pool.avail;
+    memcpy(buf, src, len);
+    OPENSSL_cleanse(src, len);
+    pool.avail -= len;
+}
+
 std::string generate_random_bytes(size_t length)
 {
     std::string result(length, 0);
@@ -294,4 +414,44 @@ const std::string get_utc_iso_ts()
     return out.str();
 }
 
+std::vector<int> parse_cpu_list(const std::string &cpu_list)
+{
+    std::vector<int> cpus;
+    Yb::Strings parts;
+    Yb::StrUtils::split_str_by_chars(cpu_list, ", \t\r\n", parts);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        Yb::Strings range;
+        Yb::StrUtils::split_str_by_chars(parts[i], "-", range, 2);
+        int from = -1, to = -1;
+        try {
+            Yb::from_string(range.at(0), from);
+            to = from;
+            if (range.size() > 1)
+                Yb::from_string(range[1], to);
+        }
+        catch (const std::exception &) {
+            throw RunTimeError("Invalid CPU list: " + cpu_list);
+        }
+        if (from < 0 || to < from || to >= CPU_SETSIZE)
+            throw RunTimeError("Invalid CPU list: " + cpu_list);
+        for (int cpu = from; cpu <= to; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+void set_thread_affinity(const std::vector<int> &cpus)
+{
+    if (!cpus.size())
+        return;
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (size_t i = 0; i < cpus.size(); ++i)
+        CPU_SET(cpus[i], &cpu_set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (err)
+        throw RunTimeError("pthread_setaffinity_np failed: " +
+                           Yb::to_string(err));
+}
+
 // vim:ts=4:sts=4:sw=4:et:
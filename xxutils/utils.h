@@ -3,6 +3,7 @@
 #define CARD_PROXY__UTILS_H
 
 #include <string>
+#include <vector>
 #include <stdexcept>
 
 class RunTimeError: public std::runtime_error
@@ -22,6 +23,8 @@ std::string string_from_hexstring(const std::string &hex_input, int mode=0);
 std::string encode_base64(const std::string &message);
 std::string decode_base64(const std::string &b64message);
 
+// served from a per-thread buffer refilled with getrandom(2)
+#define RANDOM_POOL_SIZE 4096
 void generate_random_bytes(void *buf, size_t len);
 std::string generate_random_bytes(size_t length);
 
@@ -37,5 +40,9 @@ const std::string replace_str(const std::string &str,
                               const std::string &replace);
 const std::string get_utc_iso_ts();
 
+// CPU list in the form like "0-3,6,8"
+std::vector<int> parse_cpu_list(const std::string &cpu_list);
+void set_thread_affinity(const std::vector<int> &cpus);
+
 #endif // CARD_PROXY__UTILS_H
 // vim:ts=4:sts=4:sw=4:et:
@@ -0,0 +1,124 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#include "worker_pool.h"
+#include "utils.h"
+
+WorkerTask::~WorkerTask()
+{}
+
+class WorkerPool::PoolThread: public Yb::Thread
+{
+    WorkerPool *pool_;
+    void on_run() { pool_->worker_loop(); }
+public:
+    explicit PoolThread(WorkerPool *pool): pool_(pool) {}
+};
+
+WorkerPool::WorkerPool(int n_workers, size_t max_queue,
+                       Yb::ILogger *root_logger)
+    : n_workers_(n_workers > 0? n_workers: 1)
+    , max_queue_(max_queue > 0? max_queue: 1)
+    , log_(root_logger? root_logger->new_logger("worker_pool").release(): NULL)
+    , stopping_(false)
+{}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void
+WorkerPool::start()
+{
+    if (threads_.size())
+        return;
+    {
+        Yb::ScopedLock lock(queue_mux_);
+        stopping_ = false;
+    }
+    if (log_.get())
+        log_->info("starting " + Yb::to_string(n_workers_) +
+                   " workers, queue size " + Yb::to_string(max_queue_));
+    threads_.reserve(n_workers_);
+    for (int i = 0; i < n_workers_; ++i) {
+        PoolThreadPtr t(new PoolThread(this));
+        threads_.push_back(t);
+        t->start();
+    }
+}
+
+void
+WorkerPool::stop()
+{
+    {
+        Yb::ScopedLock lock(queue_mux_);
+        stopping_ = true;
+    }
+    queue_cond_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+        threads_[i]->wait();
+    threads_.clear();
+}
+
+bool
+WorkerPool::try_push(WorkerTaskPtr task)
+{
+    {
+        Yb::ScopedLock lock(queue_mux_);
+        if (stopping_ || queue_.size() >= max_queue_)
+            return false;
+        queue_.push_back(task);
+    }
+    queue_cond_.notify_one();
+    return true;
+}
+
+size_t
+WorkerPool::queue_size()
+{
+    Yb::ScopedLock lock(queue_mux_);
+    return queue_.size();
+}
+
+WorkerTaskPtr
+WorkerPool::pop()
+{
+    Yb::ScopedLock lock(queue_mux_);
+    while (!stopping_ && queue_.empty())
+        queue_cond_.wait(lock);
+    WorkerTaskPtr task;
+    if (!queue_.empty()) {
+        task = queue_.front();
+        queue_.pop_front();
+    }
+    return task;
+}
+
+void
+WorkerPool::worker_loop()
+{
+    try {
+        set_thread_affinity(cpus_);
+    }
+    catch (const std::exception &ex) {
+        if (log_.get())
+            log_->warning(ex.what());
+    }
+    while (1) {
+        WorkerTaskPtr task = pop();
+        if (!task.get())
+            break;
+        try {
+            task->run();
+        }
+        catch (const std::exception &ex) {
+            if (log_.get())
+                log_->error(std::string("task exception: ") + ex.what());
+        }
+        catch (...) {
+            if (log_.get())
+                log_->error("task: unknown exception");
+        }
+    }
+}
+
+// vim:ts=4:sts=4:sw=4:et:
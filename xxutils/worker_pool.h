@@ -0,0 +1,62 @@
+// -*- Mode: C++; c-basic-offset: 4; tab-width: 4; indent-tabs-mode: nil; -*-
+#ifndef CARD_PROXY__WORKER_POOL_H
+#define CARD_PROXY__WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <condition_variable>
+#include <util/data_types.h>
+#include <util/nlogger.h>
+#include <util/thread.h>
+#include <util/utility.h>
+
+class WorkerTask
+{
+public:
+    virtual ~WorkerTask();
+    virtual void run() = 0;
+};
+
+typedef Yb::SharedPtr<WorkerTask>::Type WorkerTaskPtr;
+
+// A fixed set of pre-spawned threads fed from a bounded FIFO queue.
+// When the queue is full try_push() refuses the task immediately,
+// so that the caller can shed the load instead of queueing it.
+class WorkerPool
+{
+public:
+    WorkerPool(int n_workers, size_t max_queue, Yb::ILogger *root_logger);
+    ~WorkerPool();
+    // restrict the workers to these CPUs, must be set before start()
+    void set_cpus(const std::vector<int> &cpus) { cpus_ = cpus; }
+    void start();
+    void stop();
+    bool try_push(WorkerTaskPtr task);
+    int n_workers() const { return n_workers_; }
+    size_t max_queue() const { return max_queue_; }
+    size_t queue_size();
+
+private:
+    class PoolThread;
+    typedef Yb::SharedPtr<PoolThread>::Type PoolThreadPtr;
+
+    int n_workers_;
+    size_t max_queue_;
+    Yb::ILogger::Ptr log_;
+    Yb::Mutex queue_mux_;
+    std::condition_variable_any queue_cond_;
+    std::deque<WorkerTaskPtr> queue_;
+    std::vector<PoolThreadPtr> threads_;
+    std::vector<int> cpus_;
+    bool stopping_;
+
+    WorkerTaskPtr pop();
+    void worker_loop();
+
+    // non-copyable
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
+
+#endif // CARD_PROXY__WORKER_POOL_H
+// vim:ts=4:sts=4:sw=4:et: